@@ -0,0 +1,158 @@
+#include <cctype>
+#include <cstring>
+#include <zlib.h>
+#include "archive.h"
+
+namespace {
+
+const size_t INFLATE_CHUNK = 64 * 1024;
+const size_t MAX_IMAGE_BYTES = 16 << 20;  // far above any D64 or T64, a larger size is a damaged or hostile archive
+
+// Zip records, all numbers little endian
+const uint32_t ZIP_END_SIGNATURE = 0x06054B50;
+const uint32_t ZIP_CENTRAL_SIGNATURE = 0x02014B50;
+const uint32_t ZIP_LOCAL_SIGNATURE = 0x04034B50;
+const size_t ZIP_END_BYTES = 22;
+const size_t ZIP_CENTRAL_BYTES = 46;
+const size_t ZIP_LOCAL_BYTES = 30;
+const size_t ZIP_COMMENT_MAX = 0xFFFF;
+const uint16_t ZIP_STORED = 0;
+const uint16_t ZIP_DEFLATED = 8;
+
+std::string upperExtension(const std::string& name, size_t len)
+{
+	std::string ext = name.size() >= len ? name.substr(name.size() - len) : "";
+	for(char& c : ext)
+		c = std::toupper(static_cast<unsigned char>(c));
+	return ext;
+} // upperExtension
+
+
+bool isImage(const std::string& name)
+{
+	std::string ext = upperExtension(name, 4);
+	return ext == ".D64" or ext == ".T64" or ext == ".PRG";
+} // isImage
+
+
+uint16_t get16(const uint8_t* p) { return uint16_t(p[0] | (p[1] << 8)); }
+uint32_t get32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24); }
+
+
+// Inflate in chunks, straight from the mapped archive into image. windowBits picks gzip (with concatenated members,
+// as gzip -c a b writes them) or raw deflate for zip.
+bool inflateAll(const uint8_t* data, size_t size, int windowBits, size_t expected, std::vector<uint8_t>& image)
+{
+	z_stream zs = {};
+	if(inflateInit2(&zs, windowBits) != Z_OK)
+		return false;
+
+	image.clear();
+	image.reserve(expected <= MAX_IMAGE_BYTES ? expected : 0);
+	zs.next_in = const_cast<Bytef*>(data);
+	zs.avail_in = uInt(size);
+
+	int result = Z_OK;
+	while(result == Z_OK) {
+		size_t have = image.size();
+		if(have > MAX_IMAGE_BYTES)
+			break;
+		image.resize(have + INFLATE_CHUNK);
+		zs.next_out = image.data() + have;
+		zs.avail_out = uInt(INFLATE_CHUNK);
+		result = inflate(&zs, Z_NO_FLUSH);
+		image.resize(have + INFLATE_CHUNK - zs.avail_out);
+
+		if(result == Z_STREAM_END and windowBits > MAX_WBITS and zs.avail_in and *zs.next_in == 0x1F)
+			result = inflateReset(&zs);
+	}
+
+	inflateEnd(&zs);
+	return result == Z_STREAM_END and image.size() <= MAX_IMAGE_BYTES;
+} // inflateAll
+
+
+bool unpackGzip(const std::string& path, const uint8_t* data, size_t size, std::vector<uint8_t>& image,
+	std::string& name)
+{
+	// The trailer has the size modulo 4 GB, good enough to size the buffer
+	size_t expected = size >= 4 ? get32(data + size - 4) : 0;
+	if(not inflateAll(data, size, MAX_WBITS + 16, expected, image))
+		return false;
+	name = path.substr(0, path.size() - 3);
+	return true;
+} // unpackGzip
+
+
+bool unpackZip(const std::string& path, const uint8_t* data, size_t size, std::vector<uint8_t>& image,
+	std::string& name)
+{
+	// The end record is at the end, behind a comment of up to 64 KB
+	if(size < ZIP_END_BYTES)
+		return false;
+	const uint8_t* end = nullptr;
+	for(size_t pos = size - ZIP_END_BYTES + 1; pos-- > 0 and size - pos <= ZIP_END_BYTES + ZIP_COMMENT_MAX; )
+		if(get32(data + pos) == ZIP_END_SIGNATURE) {
+			end = data + pos;
+			break;
+		}
+	if(end == nullptr)
+		return false;
+
+	size_t pos = get32(end + 16);
+	for(unsigned entries = get16(end + 10); entries; entries--) {
+		if(pos + ZIP_CENTRAL_BYTES > size or get32(data + pos) != ZIP_CENTRAL_SIGNATURE)
+			return false;
+		const uint8_t* entry = data + pos;
+		uint16_t method = get16(entry + 10);
+		uint32_t crc = get32(entry + 16);
+		size_t packed = get32(entry + 20);
+		size_t unpacked = get32(entry + 24);
+		size_t nameLen = get16(entry + 28);
+		size_t local = get32(entry + 42);
+		if(pos + ZIP_CENTRAL_BYTES + nameLen > size)
+			return false;
+		std::string member(reinterpret_cast<const char*>(entry + ZIP_CENTRAL_BYTES), nameLen);
+		pos += ZIP_CENTRAL_BYTES + nameLen + get16(entry + 30) + get16(entry + 32);
+
+		if(not isImage(member) or (method != ZIP_STORED and method != ZIP_DEFLATED))
+			continue;
+
+		// The data follows the member's local header, whose name and extra field may differ in length
+		if(local + ZIP_LOCAL_BYTES > size or get32(data + local) != ZIP_LOCAL_SIGNATURE)
+			return false;
+		size_t start = local + ZIP_LOCAL_BYTES + get16(data + local + 26) + get16(data + local + 28);
+		if(start > size or packed > size - start or unpacked > MAX_IMAGE_BYTES)
+			return false;
+
+		if(method == ZIP_STORED)
+			image.assign(data + start, data + start + packed);
+		else if(not inflateAll(data + start, packed, -MAX_WBITS, unpacked, image))
+			return false;
+		if(image.size() != unpacked or crc32(0, image.data(), uInt(image.size())) != crc)
+			return false;
+
+		name = path + '/' + member.substr(member.find_last_of('/') + 1);
+		return true;
+	}
+	return false;
+} // unpackZip
+
+} // unnamed namespace
+
+
+bool Archive::isArchiveName(const std::string& path)
+{
+	return upperExtension(path, 3) == ".GZ" or upperExtension(path, 4) == ".ZIP";
+} // isArchiveName
+
+
+bool Archive::unpack(const std::string& path, const uint8_t* data, size_t size, std::vector<uint8_t>& image,
+	std::string& name)
+{
+	if(upperExtension(path, 3) == ".GZ")
+		return unpackGzip(path, data, size, image, name);
+	if(upperExtension(path, 4) == ".ZIP")
+		return unpackZip(path, data, size, image, name);
+	return false;
+} // unpack
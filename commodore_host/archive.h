@@ -0,0 +1,24 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Images kept compressed in the media folder: NAME.D64.gz, or a zip holding the image, served without unpacking
+// them to disk first.
+namespace Archive {
+
+// A .gz or .zip name, ignoring case
+bool isArchiveName(const std::string& path);
+
+// Inflate the image in the archive at path, whose bytes are data, into image. A zip gives its first D64, T64 or PRG
+// member. name is the image's file name: path without .gz, or the member's name. False for a damaged archive or one
+// without an image.
+bool unpack(const std::string& path, const uint8_t* data, size_t size, std::vector<uint8_t>& image,
+	std::string& name);
+
+} // namespace Archive
+
+#endif
@@ -0,0 +1,361 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "catalog.h"
+
+namespace {
+
+const char INDEX_NAME[] = ".commodroid_catalog";
+const char INDEX_MAGIC[] = "CDCAT1";
+
+const uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+
+std::string upper(std::string text)
+{
+	for(char& c : text)
+		c = std::toupper(static_cast<unsigned char>(c));
+	return text;
+} // upper
+
+
+// The saved index: counts and numbers little endian, strings and byte strings with a length in front
+class IndexWriter
+{
+public:
+	explicit IndexWriter(std::ofstream& out) : m_out(out) {}
+
+	void number(uint64_t value, int bytes)
+	{
+		for(int i = 0; i < bytes; i++)
+			m_out.put(char(value >> (8 * i)));
+	}
+
+	template<typename T> void bytes(const T& data)
+	{
+		number(data.size(), 2);
+		m_out.write(reinterpret_cast<const char*>(data.data()), data.size());
+	}
+
+private:
+	std::ofstream& m_out;
+};
+
+
+class IndexReader
+{
+public:
+	explicit IndexReader(std::ifstream& in) : m_in(in) {}
+
+	uint64_t number(int bytes)
+	{
+		uint64_t value = 0;
+		for(int i = 0; i < bytes; i++)
+			value |= uint64_t(uint8_t(m_in.get())) << (8 * i);
+		return value;
+	}
+
+	template<typename T> T bytes()
+	{
+		T data(number(2), 0);
+		m_in.read(reinterpret_cast<char*>(&data[0]), data.size());
+		return data;
+	}
+
+	bool ok() const { return bool(m_in); }
+
+private:
+	std::ifstream& m_in;
+};
+
+} // unnamed namespace
+
+
+Catalog::Catalog(const std::string& folder)
+	: m_folder(folder), m_indexPath(folder + '/' + INDEX_NAME), m_notify(-1)
+{}
+
+
+Catalog::~Catalog()
+{
+	if(m_notify >= 0)
+		::close(m_notify);
+} // dtor
+
+
+// FNV-1a
+uint32_t Catalog::nameHash(const std::string& name)
+{
+	uint32_t hash = 2166136261u;
+	for(unsigned char c : name)
+		hash = (hash ^ c) * 16777619u;
+	return hash;
+} // nameHash
+
+
+bool Catalog::isImageName(const std::string& name)
+{
+	std::string key = upper(name);
+	if(key.size() >= 4 and key.compare(key.size() - 4, 4, ".ZIP") == 0)
+		return true;
+	if(key.size() >= 3 and key.compare(key.size() - 3, 3, ".GZ") == 0)
+		key.erase(key.size() - 3);
+	std::string ext = key.size() >= 4 ? key.substr(key.size() - 4) : "";
+	return ext == ".D64" or ext == ".T64" or ext == ".PRG";
+} // isImageName
+
+
+size_t Catalog::scan()
+{
+	load();
+
+	DIR* dir = opendir(m_folder.c_str());
+	if(dir == nullptr)
+		return 0;
+
+	size_t changed = 0;
+	std::set<std::string> seen;
+	while(dirent* entry = readdir(dir)) {
+		std::string name = entry->d_name;
+		struct stat st;
+		if(not isImageName(name) or stat((m_folder + '/' + name).c_str(), &st) < 0 or not S_ISREG(st.st_mode))
+			continue;
+
+		seen.insert(upper(name));
+		auto it = m_images.find(upper(name));
+		if(it != m_images.end() and it->second.mtime == st.st_mtime and it->second.size == uint64_t(st.st_size))
+			continue;
+		changed += indexImage(name, st.st_mtime, st.st_size);
+	}
+	closedir(dir);
+
+	for(auto it = m_images.begin(); it != m_images.end(); ) {
+		auto next = std::next(it);
+		if(not seen.count(it->first))
+			changed += removeImage(it->second.name);
+		it = next;
+	}
+
+	if(changed)
+		save();
+	return changed;
+} // scan
+
+
+int Catalog::watch()
+{
+	if(m_notify < 0) {
+		m_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(m_notify >= 0 and inotify_add_watch(m_notify, m_folder.c_str(), WATCH_EVENTS) < 0) {
+			::close(m_notify);
+			m_notify = -1;
+		}
+	}
+	return m_notify;
+} // watch
+
+
+size_t Catalog::update()
+{
+	alignas(inotify_event) char buf[4096];
+	size_t changed = 0;
+	bool overflow = false;
+
+	for(;;) {
+		ssize_t got = ::read(m_notify, buf, sizeof(buf));
+		if(got <= 0)
+			break;
+
+		for(char* p = buf; p < buf + got; ) {
+			const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+			p += sizeof(inotify_event) + event->len;
+
+			if(event->mask & IN_Q_OVERFLOW)
+				overflow = true;
+			if(event->len == 0 or not isImageName(event->name))
+				continue;
+
+			std::string name = event->name;
+			struct stat st;
+			if(event->mask & (IN_DELETE | IN_MOVED_FROM))
+				changed += removeImage(name);
+			else if(stat((m_folder + '/' + name).c_str(), &st) == 0 and S_ISREG(st.st_mode))
+				changed += indexImage(name, st.st_mtime, st.st_size);
+		}
+	}
+
+	// Events were lost, compare the whole folder with the index instead
+	if(overflow)
+		return changed + scan();
+
+	if(changed)
+		save();
+	return changed;
+} // update
+
+
+const Catalog::Image* Catalog::find(const std::string& pattern) const
+{
+	std::string key = upper(pattern);
+	size_t star = key.find('*');
+	if(star == std::string::npos) {
+		// "GAME.D64" is also found packed, as GAME.D64.GZ or GAME.ZIP
+		size_t dot = key.find_last_of('.');
+		for(const std::string& name : { key, key + ".GZ", key.substr(0, dot) + ".ZIP" }) {
+			auto it = m_images.find(name);
+			if(it != m_images.end())
+				return &it->second;
+		}
+		return nullptr;
+	}
+
+	// Everything before the first '*' is a prefix, the rest has to end the name
+	std::string prefix = key.substr(0, star);
+	std::string suffix = key.substr(key.find_last_of('*') + 1);
+	for(auto it = m_names.lower_bound(prefix); it != m_names.end() and it->compare(0, prefix.size(), prefix) == 0;
+			++it)
+		if(it->size() >= prefix.size() + suffix.size() and it->compare(it->size() - suffix.size(), suffix.size(), suffix) == 0)
+			return &m_images.at(*it);
+	return nullptr;
+} // find
+
+
+const Catalog::File* Catalog::file(const Image& image, const std::string& name) const
+{
+	auto it = image.byHash.find(nameHash(name));
+	if(it == image.byHash.end())
+		return nullptr;
+
+	// Names with the same hash are rare, look past the first one only if it is a different name
+	for(size_t i = it->second; i < image.files.size(); i++)
+		if(image.files[i].name == name)
+			return &image.files[i];
+	return nullptr;
+} // file
+
+
+bool Catalog::indexImage(const std::string& name, int64_t mtime, uint64_t size)
+{
+	std::unique_ptr<Media> media = Media::create(MappedFile::open(m_folder + '/' + name));
+	if(not media) {
+		removeImage(name);
+		return false;
+	}
+
+	Image image;
+	image.name = name;
+	image.mtime = mtime;
+	image.size = size;
+
+	std::shared_ptr<Lines> lines(new Lines);
+	for(const DirLine& line : media->directory())
+		lines->push_back(encodeDirLine(line));
+	image.lines = lines;
+
+	for(const MediaFile& file : media->files()) {
+		uint32_t hash = nameHash(file.name);
+		image.byHash.emplace(hash, image.files.size());
+		image.files.push_back({ file.name, hash, file.blocks, file.type });
+	}
+
+	std::string key = upper(name);
+	m_images[key] = std::move(image);
+	m_names.insert(key);
+	if(m_listener)
+		m_listener(path(m_images[key]));
+	return true;
+} // indexImage
+
+
+bool Catalog::removeImage(const std::string& name)
+{
+	std::string key = upper(name);
+	m_names.erase(key);
+	if(m_images.erase(key) == 0)
+		return false;
+	if(m_listener)
+		m_listener(m_folder + '/' + name);
+	return true;
+} // removeImage
+
+
+bool Catalog::load()
+{
+	std::ifstream in(m_indexPath, std::ios::binary);
+	if(not in)
+		return false;
+
+	IndexReader reader(in);
+	if(reader.bytes<std::string>() != INDEX_MAGIC)
+		return false;
+
+	m_images.clear();
+	m_names.clear();
+	for(uint64_t count = reader.number(4); count and reader.ok(); count--) {
+		Image image;
+		image.name = reader.bytes<std::string>();
+		image.mtime = int64_t(reader.number(8));
+		image.size = reader.number(8);
+
+		for(uint64_t files = reader.number(2); files and reader.ok(); files--) {
+			File file;
+			file.name = reader.bytes<std::string>();
+			file.hash = nameHash(file.name);
+			file.blocks = uint16_t(reader.number(2));
+			file.type = uint8_t(reader.number(1));
+			image.byHash.emplace(file.hash, image.files.size());
+			image.files.push_back(file);
+		}
+
+		std::shared_ptr<Lines> lines(new Lines);
+		for(uint64_t n = reader.number(2); n and reader.ok(); n--)
+			lines->push_back(reader.bytes<std::vector<uint8_t>>());
+		image.lines = lines;
+
+		if(not reader.ok())
+			break;
+		std::string key = upper(image.name);
+		m_names.insert(key);
+		m_images[key] = std::move(image);
+	}
+	return reader.ok();
+} // load
+
+
+// Written to a temporary file and renamed, so a crash never leaves half an index
+bool Catalog::save() const
+{
+	std::string temp = m_indexPath + ".tmp";
+	{
+		std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+		if(not out)
+			return false;
+
+		IndexWriter writer(out);
+		writer.bytes(std::string(INDEX_MAGIC));
+		writer.number(m_images.size(), 4);
+		for(const auto& entry : m_images) {
+			const Image& image = entry.second;
+			writer.bytes(image.name);
+			writer.number(uint64_t(image.mtime), 8);
+			writer.number(image.size, 8);
+			writer.number(image.files.size(), 2);
+			for(const File& file : image.files) {
+				writer.bytes(file.name);
+				writer.number(file.blocks, 2);
+				writer.number(file.type, 1);
+			}
+			writer.number(image.lines->size(), 2);
+			for(const std::vector<uint8_t>& line : *image.lines)
+				writer.bytes(line);
+		}
+		if(not out.flush())
+			return false;
+	}
+	return std::rename(temp.c_str(), m_indexPath.c_str()) == 0;
+} // save
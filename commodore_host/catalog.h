@@ -0,0 +1,85 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "media.h"
+
+// Index of the D64, T64 and PRG images in the media folder, packed or not, so that opening an image by name and
+// listing it need no folder scan or image parsing. Each image keeps its file names and the 'L' frame bodies of its
+// directory, ready to send. The index is saved next to the images and brought up to date at start-up by comparing
+// sizes and modification times, then kept current with inotify. Not thread safe, it is updated from the server's thread.
+class Catalog
+{
+public:
+	struct File {
+		std::string name;  // PETSCII, no padding
+		uint32_t hash;
+		uint16_t blocks;
+		uint8_t type;
+	};
+
+	typedef std::vector<std::vector<uint8_t>> Lines;
+
+	struct Image {
+		std::string name;  // file name in the media folder
+		int64_t mtime = 0;
+		uint64_t size = 0;
+		std::vector<File> files;
+		std::shared_ptr<const Lines> lines;  // shared, a listing in progress keeps its copy through an update
+		std::unordered_map<uint32_t, size_t> byHash;  // name hash, index of the first file with it
+	};
+
+	// Told the path of each image added, changed or removed by scan() or update()
+	typedef std::function<void(const std::string& path)> Listener;
+
+	explicit Catalog(const std::string& folder);
+	~Catalog();
+
+	void setListener(Listener listener) { m_listener = listener; }
+
+	// Read the saved index, then re-read only the images that changed since. Returns the images re-read.
+	size_t scan();
+	bool save() const;
+
+	// Start watching the folder. The descriptor is non-blocking, call update() when it is readable.
+	int watch();
+	// Apply pending inotify events, returns the images added, changed or removed.
+	size_t update();
+
+	// Image by file name, ignoring case, or by a pattern with '*' as the Excel host's Dir() does. A name without '*'
+	// also finds the image packed in a .gz or .zip of the same name. Null if none.
+	const Image* find(const std::string& pattern) const;
+
+	// File on the image by name, for names without wildcards.
+	const File* file(const Image& image, const std::string& name) const;
+
+	std::string path(const Image& image) const { return m_folder + '/' + image.name; }
+	const std::string& folder() const { return m_folder; }
+	size_t size() const { return m_images.size(); }
+
+	static uint32_t nameHash(const std::string& name);
+
+	// An image, or an archive of one: NAME.D64.gz, or any zip. Ignores case.
+	static bool isImageName(const std::string& name);
+
+private:
+	bool indexImage(const std::string& name, int64_t mtime, uint64_t size);
+	bool removeImage(const std::string& name);
+	bool load();
+
+	std::string m_folder;
+	std::string m_indexPath;
+	int m_notify;
+	Listener m_listener;
+	std::unordered_map<std::string, Image> m_images;  // by upper case name
+	std::set<std::string> m_names;                    // upper case names in order, for prefix patterns
+};
+
+#endif
@@ -0,0 +1,156 @@
+// Host daemon: serves every Arduino given on the command line from one process, in place of an Excel workbook per
+// Commodore.
+//
+//   commodroid_server [--mode N] [--pins P] [--media FOLDER] [--streams MB] [--spill FOLDER] [--unpacked MB]
+//                     [--metrics FILE [SECONDS]] PORT=IMAGE[,IMAGE...] ...
+//
+// Images after the first go on devices 9, 10 and so on, up to 23. --mode is the handshake mode (HostProtocol::Modes) and
+// --pins the atn|clock|data|reset pins, as in the workbook, with |srq added for C128 burst mode. With --media,
+// LOAD"NAME.D64" (or "NAM.*") picks an image from the folder as MEDIA_FOLDER does in the workbook; ports given after
+// it may then leave out the images.
+//
+// Loads and listings are kept framed and ready to send in up to --streams MB of memory (16 by default). With --spill
+// they go to FOLDER once pushed out, so a title loaded again, even after a restart, is not read from its image.
+//
+// Images may be kept packed, as NAME.D64.gz or in a zip, and are unpacked in memory when mounted. The most recently
+// used are kept unpacked, up to --unpacked MB (64 by default).
+//
+// --metrics writes each link's latency histograms, per request type and image format, and its byte counts to FILE
+// every SECONDS (10 by default) in Prometheus text format, e.g. for node_exporter's textfile collector. The same
+// percentiles are printed when the server stops.
+//
+// --sniff FILE puts the links after it in sniffer mode: the Arduino answers for no device and every byte on the bus
+// goes to FILE, one line each, to profile a real drive on the same bus or capture what a title does.
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "catalog.h"
+#include "host_protocol.h"
+#include "serial_port.h"
+#include "server.h"
+
+namespace {
+
+Server* g_server = nullptr;
+
+void onSignal(int)
+{
+	if(g_server)
+		g_server->stop();
+} // onSignal
+
+
+void usage()
+{
+	std::fprintf(stderr, "usage: commodroid_server [--mode N] [--pins atn|clock|data|reset[|srq]] [--media FOLDER] "
+		"[--streams MB] [--spill FOLDER] [--unpacked MB] [--metrics FILE [SECONDS]] [--sniff FILE] "
+		"PORT[=IMAGE[,IMAGE...]] ...\n");
+} // usage
+
+} // unnamed namespace
+
+
+int main(int argc, char* argv[])
+{
+	LinkConfig config;
+	config.mode = HostProtocol::MODE_FRAMED | HostProtocol::MODE_DRIVE_CODE | HostProtocol::MODE_SECTORS
+		| HostProtocol::MODE_CHANNELS | HostProtocol::MODE_EVENTS | HostProtocol::MODE_RECORDS;
+
+	Server server;
+	std::unique_ptr<Catalog> catalog;
+	std::string trace;
+	for(int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if(arg == "--mode" and i + 1 < argc)
+			config.mode = uint8_t(std::strtoul(argv[++i], nullptr, 0));
+		else if(arg == "--pins" and i + 1 < argc)
+			config.pins = argv[++i];
+		else if(arg == "--streams" and i + 1 < argc)
+			server.streams().setMemoryLimit(size_t(std::strtoul(argv[++i], nullptr, 0)) << 20);
+		else if(arg == "--metrics" and i + 1 < argc) {
+			std::string path = argv[++i];
+			unsigned seconds = 10;
+			if(i + 1 < argc and std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+				seconds = std::max(1ul, std::strtoul(argv[++i], nullptr, 0));
+			server.setMetricsFile(path, seconds);
+		}
+		else if(arg == "--unpacked" and i + 1 < argc)
+			server.cache().setUnpackedLimit(size_t(std::strtoul(argv[++i], nullptr, 0)) << 20);
+		else if(arg == "--spill" and i + 1 < argc) {
+			if(not server.streams().setSpillFolder(argv[++i])) {
+				std::fprintf(stderr, "%s: %s\n", argv[i], std::strerror(errno));
+				return 1;
+			}
+		}
+		else if(arg == "--sniff" and i + 1 < argc) {
+			trace = argv[++i];
+			config.mode |= HostProtocol::MODE_SNIFF;
+		}
+		else if(arg == "--media" and i + 1 < argc) {
+			std::string folder = argv[++i];
+			while(folder.size() > 1 and folder.back() == '/')
+				folder.pop_back();
+			catalog.reset(new Catalog(folder));
+			// A changed image must be mapped again, links that have it mounted keep the old one until they remount
+			catalog->setListener([&server](const std::string& path) { server.cache().evict(path); });
+			size_t changed = catalog->scan();
+			if(catalog->watch() < 0 or not server.watch(catalog->watch(), [&catalog] { catalog->update(); })) {
+				std::fprintf(stderr, "%s: %s\n", folder.c_str(), std::strerror(errno));
+				return 1;
+			}
+			std::printf("%s: %zu images, %zu indexed\n", folder.c_str(), catalog->size(), changed);
+			config.catalog = catalog.get();
+		}
+		else if(arg.find('=') != std::string::npos or (catalog and arg[0] != '-')) {
+			LinkConfig link = config;
+			size_t equals = arg.find('=');
+			std::string port = arg.substr(0, equals);
+			std::string images = equals == std::string::npos ? "" : arg.substr(equals + 1);
+			uint8_t device = HostProtocol::FIRST_DEVICE;
+			for(size_t start = 0; start < images.size(); device++) {
+				size_t end = images.find(',', start);
+				if(end == std::string::npos)
+					end = images.size();
+				link.images[device] = images.substr(start, end - start);
+				start = end + 1;
+			}
+			if(device > HostProtocol::LAST_DEVICE + 1) {
+				std::fprintf(stderr, "%s: at most %d images, devices %d to %d\n", port.c_str(),
+						HostProtocol::LAST_DEVICE - HostProtocol::FIRST_DEVICE + 1, HostProtocol::FIRST_DEVICE,
+						HostProtocol::LAST_DEVICE);
+				return 1;
+			}
+
+			int fd = openSerialPort(port);
+			int index = fd < 0 ? -1 : server.addLink(fd, port, link);
+			if(index < 0 or (not trace.empty() and not server.traceLink(index, trace))) {
+				std::fprintf(stderr, "%s: %s\n", index < 0 ? port.c_str() : trace.c_str(), std::strerror(errno));
+				return 1;
+			}
+		}
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	if(server.links() == 0) {
+		usage();
+		return 1;
+	}
+
+	g_server = &server;
+	std::signal(SIGINT, onSignal);
+	std::signal(SIGTERM, onSignal);
+	std::printf("serving %zu links\n", server.links());
+	bool ok = server.run();
+	server.printStats();
+	return ok ? 0 : 1;
+} // main
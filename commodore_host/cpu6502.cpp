@@ -0,0 +1,434 @@
+#include "cpu6502.h"
+
+Cpu6502::Cpu6502()
+	: pc(0), a(0), x(0), y(0), sp(0xFF), p(FLAG_U | FLAG_I), m_jammed(false), m_lastJsr(false)
+{}
+
+
+void Cpu6502::reset(uint16_t startPc)
+{
+	pc = startPc;
+	a = x = y = 0;
+	sp = 0xFF;
+	p = FLAG_U | FLAG_I;
+	m_jammed = false;
+	m_lastJsr = false;
+} // reset
+
+
+uint16_t Cpu6502::read16(Bus& bus, uint16_t addr)
+{
+	return bus.read(addr) | (bus.read(addr + 1) << 8);
+} // read16
+
+
+uint16_t Cpu6502::addrZp(Bus& bus)
+{
+	return bus.read(pc++);
+} // addrZp
+
+
+uint16_t Cpu6502::addrZpIndexed(Bus& bus, uint8_t index)
+{
+	return uint8_t(bus.read(pc++) + index);
+} // addrZpIndexed
+
+
+uint16_t Cpu6502::addrAbs(Bus& bus)
+{
+	uint16_t addr = read16(bus, pc);
+	pc += 2;
+	return addr;
+} // addrAbs
+
+
+// Indexed absolute, adds a cycle to cycles when the index crosses a page.
+uint16_t Cpu6502::addrAbsIndexed(Bus& bus, uint8_t index, unsigned& cycles)
+{
+	uint16_t base = addrAbs(bus);
+	uint16_t addr = base + index;
+	if((base ^ addr) & 0xFF00)
+		cycles++;
+	return addr;
+} // addrAbsIndexed
+
+
+uint16_t Cpu6502::addrIndX(Bus& bus)
+{
+	uint8_t zp = bus.read(pc++) + x;
+	return bus.read(zp) | (bus.read(uint8_t(zp + 1)) << 8);
+} // addrIndX
+
+
+uint16_t Cpu6502::addrIndY(Bus& bus, unsigned& cycles)
+{
+	uint8_t zp = bus.read(pc++);
+	uint16_t base = bus.read(zp) | (bus.read(uint8_t(zp + 1)) << 8);
+	uint16_t addr = base + y;
+	if((base ^ addr) & 0xFF00)
+		cycles++;
+	return addr;
+} // addrIndY
+
+
+void Cpu6502::push(Bus& bus, uint8_t data)
+{
+	bus.write(0x100 | sp--, data);
+} // push
+
+
+uint8_t Cpu6502::pull(Bus& bus)
+{
+	return bus.read(0x100 | ++sp);
+} // pull
+
+
+void Cpu6502::setNZ(uint8_t value)
+{
+	p = (p & ~(FLAG_N | FLAG_Z)) | (value & FLAG_N) | (value ? 0 : FLAG_Z);
+} // setNZ
+
+
+void Cpu6502::adc(uint8_t value)
+{
+	unsigned carry = p & FLAG_C;
+
+	if(p & FLAG_D) {
+		unsigned lo = (a & 0x0F) + (value & 0x0F) + carry;
+		unsigned hi = (a & 0xF0) + (value & 0xF0);
+		if(lo > 0x09) {
+			hi += 0x10;
+			lo += 0x06;
+		}
+		// N, V and Z as the NMOS part computes them, from the binary intermediate result
+		uint8_t bin = a + value + carry;
+		p &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
+		if(not bin)
+			p |= FLAG_Z;
+		if(hi & 0x80)
+			p |= FLAG_N;
+		if(~(a ^ value) & (a ^ hi) & 0x80)
+			p |= FLAG_V;
+		if(hi > 0x90)
+			hi += 0x60;
+		if(hi > 0xFF)
+			p |= FLAG_C;
+		a = (hi & 0xF0) | (lo & 0x0F);
+		return;
+	}
+
+	unsigned sum = a + value + carry;
+	p &= ~(FLAG_V | FLAG_C);
+	if(~(a ^ value) & (a ^ sum) & 0x80)
+		p |= FLAG_V;
+	if(sum > 0xFF)
+		p |= FLAG_C;
+	a = uint8_t(sum);
+	setNZ(a);
+} // adc
+
+
+void Cpu6502::sbc(uint8_t value)
+{
+	unsigned borrow = (p & FLAG_C) ? 0 : 1;
+	unsigned diff = a - value - borrow;
+
+	if(p & FLAG_D) {
+		unsigned lo = (a & 0x0F) - (value & 0x0F) - borrow;
+		unsigned hi = (a & 0xF0) - (value & 0xF0);
+		if(lo & 0x10) {
+			lo -= 6;
+			hi -= 0x10;
+		}
+		if(hi & 0x100)
+			hi -= 0x60;
+		p &= ~(FLAG_V | FLAG_C);
+		if((a ^ value) & (a ^ diff) & 0x80)
+			p |= FLAG_V;
+		if(diff < 0x100)
+			p |= FLAG_C;
+		setNZ(uint8_t(diff));
+		a = (hi & 0xF0) | (lo & 0x0F);
+		return;
+	}
+
+	p &= ~(FLAG_V | FLAG_C);
+	if((a ^ value) & (a ^ diff) & 0x80)
+		p |= FLAG_V;
+	if(diff < 0x100)
+		p |= FLAG_C;
+	a = uint8_t(diff);
+	setNZ(a);
+} // sbc
+
+
+void Cpu6502::compare(uint8_t reg, uint8_t value)
+{
+	p = (reg >= value) ? (p | FLAG_C) : (p & ~FLAG_C);
+	setNZ(uint8_t(reg - value));
+} // compare
+
+
+// Conditional branch, returns the cycles taken.
+unsigned Cpu6502::branch(Bus& bus, bool taken)
+{
+	int8_t offset = int8_t(bus.read(pc++));
+
+	if(not taken)
+		return 2;
+
+	uint16_t target = pc + offset;
+	unsigned cycles = ((pc ^ target) & 0xFF00) ? 4 : 3;
+	pc = target;
+	return cycles;
+} // branch
+
+
+void Cpu6502::bit(uint8_t value)
+{
+	p = (p & ~(FLAG_N | FLAG_V | FLAG_Z)) | (value & (FLAG_N | FLAG_V)) | ((a & value) ? 0 : FLAG_Z);
+} // bit
+
+
+uint8_t Cpu6502::inc(uint8_t value)
+{
+	setNZ(++value);
+	return value;
+} // inc
+
+
+uint8_t Cpu6502::dec(uint8_t value)
+{
+	setNZ(--value);
+	return value;
+} // dec
+
+
+uint8_t Cpu6502::asl(uint8_t value)
+{
+	p = (value & 0x80) ? (p | FLAG_C) : (p & ~FLAG_C);
+	value <<= 1;
+	setNZ(value);
+	return value;
+} // asl
+
+
+uint8_t Cpu6502::lsr(uint8_t value)
+{
+	p = (value & 0x01) ? (p | FLAG_C) : (p & ~FLAG_C);
+	value >>= 1;
+	setNZ(value);
+	return value;
+} // lsr
+
+
+uint8_t Cpu6502::rol(uint8_t value)
+{
+	uint8_t carry = p & FLAG_C;
+	p = (value & 0x80) ? (p | FLAG_C) : (p & ~FLAG_C);
+	value = (value << 1) | carry;
+	setNZ(value);
+	return value;
+} // rol
+
+
+uint8_t Cpu6502::ror(uint8_t value)
+{
+	uint8_t carry = (p & FLAG_C) ? 0x80 : 0;
+	p = (value & 0x01) ? (p | FLAG_C) : (p & ~FLAG_C);
+	value = (value >> 1) | carry;
+	setNZ(value);
+	return value;
+} // ror
+
+
+unsigned Cpu6502::step(Bus& bus)
+{
+	uint8_t op = bus.read(pc++);
+	unsigned cycles = 0;
+	uint16_t addr;
+	uint8_t value;
+
+	m_lastJsr = false;
+
+	// Read-modify-write on memory
+#define RMW(fn) { value = bus.read(addr); bus.write(addr, value); bus.write(addr, fn(value)); }
+
+	switch(op) {
+		// Loads
+		case 0xA9: a = bus.read(pc++); setNZ(a); return 2;
+		case 0xA5: a = bus.read(addrZp(bus)); setNZ(a); return 3;
+		case 0xB5: a = bus.read(addrZpIndexed(bus, x)); setNZ(a); return 4;
+		case 0xAD: a = bus.read(addrAbs(bus)); setNZ(a); return 4;
+		case 0xBD: cycles = 4; a = bus.read(addrAbsIndexed(bus, x, cycles)); setNZ(a); return cycles;
+		case 0xB9: cycles = 4; a = bus.read(addrAbsIndexed(bus, y, cycles)); setNZ(a); return cycles;
+		case 0xA1: a = bus.read(addrIndX(bus)); setNZ(a); return 6;
+		case 0xB1: cycles = 5; a = bus.read(addrIndY(bus, cycles)); setNZ(a); return cycles;
+
+		case 0xA2: x = bus.read(pc++); setNZ(x); return 2;
+		case 0xA6: x = bus.read(addrZp(bus)); setNZ(x); return 3;
+		case 0xB6: x = bus.read(addrZpIndexed(bus, y)); setNZ(x); return 4;
+		case 0xAE: x = bus.read(addrAbs(bus)); setNZ(x); return 4;
+		case 0xBE: cycles = 4; x = bus.read(addrAbsIndexed(bus, y, cycles)); setNZ(x); return cycles;
+
+		case 0xA0: y = bus.read(pc++); setNZ(y); return 2;
+		case 0xA4: y = bus.read(addrZp(bus)); setNZ(y); return 3;
+		case 0xB4: y = bus.read(addrZpIndexed(bus, x)); setNZ(y); return 4;
+		case 0xAC: y = bus.read(addrAbs(bus)); setNZ(y); return 4;
+		case 0xBC: cycles = 4; y = bus.read(addrAbsIndexed(bus, x, cycles)); setNZ(y); return cycles;
+
+		// Stores
+		case 0x85: bus.write(addrZp(bus), a); return 3;
+		case 0x95: bus.write(addrZpIndexed(bus, x), a); return 4;
+		case 0x8D: bus.write(addrAbs(bus), a); return 4;
+		case 0x9D: bus.write(addrAbsIndexed(bus, x, cycles), a); return 5;
+		case 0x99: bus.write(addrAbsIndexed(bus, y, cycles), a); return 5;
+		case 0x81: bus.write(addrIndX(bus), a); return 6;
+		case 0x91: bus.write(addrIndY(bus, cycles), a); return 6;
+		case 0x86: bus.write(addrZp(bus), x); return 3;
+		case 0x96: bus.write(addrZpIndexed(bus, y), x); return 4;
+		case 0x8E: bus.write(addrAbs(bus), x); return 4;
+		case 0x84: bus.write(addrZp(bus), y); return 3;
+		case 0x94: bus.write(addrZpIndexed(bus, x), y); return 4;
+		case 0x8C: bus.write(addrAbs(bus), y); return 4;
+
+		// Transfers
+		case 0xAA: x = a; setNZ(x); return 2;
+		case 0xA8: y = a; setNZ(y); return 2;
+		case 0xBA: x = sp; setNZ(x); return 2;
+		case 0x8A: a = x; setNZ(a); return 2;
+		case 0x9A: sp = x; return 2;
+		case 0x98: a = y; setNZ(a); return 2;
+
+		// Stack
+		case 0x48: push(bus, a); return 3;
+		case 0x08: push(bus, p | FLAG_B | FLAG_U); return 3;
+		case 0x68: a = pull(bus); setNZ(a); return 4;
+		case 0x28: p = pull(bus) | FLAG_U; return 4;
+
+		// Logic and arithmetic
+#define ALU(base, fn) \
+		case base + 0x09: fn(bus.read(pc++)); return 2; \
+		case base + 0x05: fn(bus.read(addrZp(bus))); return 3; \
+		case base + 0x15: fn(bus.read(addrZpIndexed(bus, x))); return 4; \
+		case base + 0x0D: fn(bus.read(addrAbs(bus))); return 4; \
+		case base + 0x1D: cycles = 4; fn(bus.read(addrAbsIndexed(bus, x, cycles))); return cycles; \
+		case base + 0x19: cycles = 4; fn(bus.read(addrAbsIndexed(bus, y, cycles))); return cycles; \
+		case base + 0x01: fn(bus.read(addrIndX(bus))); return 6; \
+		case base + 0x11: cycles = 5; fn(bus.read(addrIndY(bus, cycles))); return cycles;
+
+#define ORA(v) { a |= (v); setNZ(a); }
+#define AND(v) { a &= (v); setNZ(a); }
+#define EOR(v) { a ^= (v); setNZ(a); }
+#define CMP(v) compare(a, (v))
+		ALU(0x00, ORA)
+		ALU(0x20, AND)
+		ALU(0x40, EOR)
+		ALU(0x60, adc)
+		ALU(0xC0, CMP)
+		ALU(0xE0, sbc)
+#undef ORA
+#undef AND
+#undef EOR
+#undef CMP
+#undef ALU
+
+		case 0xE0: compare(x, bus.read(pc++)); return 2;
+		case 0xE4: compare(x, bus.read(addrZp(bus))); return 3;
+		case 0xEC: compare(x, bus.read(addrAbs(bus))); return 4;
+		case 0xC0: compare(y, bus.read(pc++)); return 2;
+		case 0xC4: compare(y, bus.read(addrZp(bus))); return 3;
+		case 0xCC: compare(y, bus.read(addrAbs(bus))); return 4;
+
+		case 0x24: bit(bus.read(addrZp(bus))); return 3;
+		case 0x2C: bit(bus.read(addrAbs(bus))); return 4;
+
+		// Increments and decrements
+		case 0xE6: addr = addrZp(bus); RMW(inc); return 5;
+		case 0xF6: addr = addrZpIndexed(bus, x); RMW(inc); return 6;
+		case 0xEE: addr = addrAbs(bus); RMW(inc); return 6;
+		case 0xFE: addr = addrAbsIndexed(bus, x, cycles); RMW(inc); return 7;
+		case 0xC6: addr = addrZp(bus); RMW(dec); return 5;
+		case 0xD6: addr = addrZpIndexed(bus, x); RMW(dec); return 6;
+		case 0xCE: addr = addrAbs(bus); RMW(dec); return 6;
+		case 0xDE: addr = addrAbsIndexed(bus, x, cycles); RMW(dec); return 7;
+		case 0xE8: x++; setNZ(x); return 2;
+		case 0xC8: y++; setNZ(y); return 2;
+		case 0xCA: x--; setNZ(x); return 2;
+		case 0x88: y--; setNZ(y); return 2;
+
+		// Shifts and rotates
+#define SHIFT(base, fn) \
+		case base + 0x0A: a = fn(a); return 2; \
+		case base + 0x06: addr = addrZp(bus); RMW(fn); return 5; \
+		case base + 0x16: addr = addrZpIndexed(bus, x); RMW(fn); return 6; \
+		case base + 0x0E: addr = addrAbs(bus); RMW(fn); return 6; \
+		case base + 0x1E: addr = addrAbsIndexed(bus, x, cycles); RMW(fn); return 7;
+		SHIFT(0x00, asl)
+		SHIFT(0x20, rol)
+		SHIFT(0x40, lsr)
+		SHIFT(0x60, ror)
+#undef SHIFT
+
+		// Jumps and subroutines
+		case 0x4C: pc = addrAbs(bus); return 3;
+		case 0x6C:
+			addr = addrAbs(bus);
+			// the NMOS part does not carry into the high byte of the pointer
+			pc = bus.read(addr) | (bus.read((addr & 0xFF00) | uint8_t(addr + 1)) << 8);
+			return 5;
+		case 0x20:
+			addr = addrAbs(bus);
+			push(bus, (pc - 1) >> 8);
+			push(bus, pc - 1);
+			pc = addr;
+			m_lastJsr = true;
+			return 6;
+		case 0x60:
+			pc = pull(bus);
+			pc |= pull(bus) << 8;
+			pc++;
+			return 6;
+		case 0x40:
+			p = pull(bus) | FLAG_U;
+			pc = pull(bus);
+			pc |= pull(bus) << 8;
+			return 6;
+		case 0x00:
+			pc++;
+			push(bus, pc >> 8);
+			push(bus, pc);
+			push(bus, p | FLAG_B | FLAG_U);
+			p |= FLAG_I;
+			pc = read16(bus, 0xFFFE);
+			return 7;
+
+		// Branches
+		case 0x10: return branch(bus, not (p & FLAG_N));
+		case 0x30: return branch(bus, p & FLAG_N);
+		case 0x50: return branch(bus, not (p & FLAG_V));
+		case 0x70: return branch(bus, p & FLAG_V);
+		case 0x90: return branch(bus, not (p & FLAG_C));
+		case 0xB0: return branch(bus, p & FLAG_C);
+		case 0xD0: return branch(bus, not (p & FLAG_Z));
+		case 0xF0: return branch(bus, p & FLAG_Z);
+
+		// Flags
+		case 0x18: p &= ~FLAG_C; return 2;
+		case 0x38: p |= FLAG_C; return 2;
+		case 0x58: p &= ~FLAG_I; return 2;
+		case 0x78: p |= FLAG_I; return 2;
+		case 0xB8: p &= ~FLAG_V; return 2;
+		case 0xD8: p &= ~FLAG_D; return 2;
+		case 0xF8: p |= FLAG_D; return 2;
+
+		case 0xEA: return 2;
+
+		default:
+			// Illegal opcode, stop here rather than guess at its behaviour
+			pc--;
+			m_jammed = true;
+			return 0;
+	}
+#undef RMW
+} // step
@@ -0,0 +1,78 @@
+#ifndef CPU6502_H
+#define CPU6502_H
+
+#include <cstdint>
+
+// NMOS 6502 core, official opcodes only. The CPU holds registers only, memory is reached through the Bus passed
+// to step(), so the whole drive state can be copied for speculative runs.
+class Cpu6502
+{
+public:
+	class Bus
+	{
+	public:
+		virtual ~Bus() {}
+		virtual uint8_t read(uint16_t addr) = 0;
+		virtual void write(uint16_t addr, uint8_t data) = 0;
+	};
+
+	enum Flags {
+		FLAG_C = 0x01,
+		FLAG_Z = 0x02,
+		FLAG_I = 0x04,
+		FLAG_D = 0x08,
+		FLAG_B = 0x10,
+		FLAG_U = 0x20,
+		FLAG_V = 0x40,
+		FLAG_N = 0x80
+	};
+
+	Cpu6502();
+
+	void reset(uint16_t pc);
+
+	// Execute one instruction, returns the cycles it took. Returns 0 and sets jammed() on an illegal opcode.
+	unsigned step(Bus& bus);
+
+	bool jammed() const { return m_jammed; }
+
+	// Set by JSR, cleared by every other instruction.
+	bool lastWasJsr() const { return m_lastJsr; }
+
+	void setOverflow() { p |= FLAG_V; }
+
+	uint16_t pc;
+	uint8_t a, x, y, sp, p;
+
+private:
+	uint16_t addrZp(Bus& bus);
+	uint16_t addrZpIndexed(Bus& bus, uint8_t index);
+	uint16_t addrAbs(Bus& bus);
+	uint16_t addrAbsIndexed(Bus& bus, uint8_t index, unsigned& cycles);
+	uint16_t addrIndX(Bus& bus);
+	uint16_t addrIndY(Bus& bus, unsigned& cycles);
+	uint16_t read16(Bus& bus, uint16_t addr);
+
+	void push(Bus& bus, uint8_t data);
+	uint8_t pull(Bus& bus);
+
+	void setNZ(uint8_t value);
+	void adc(uint8_t value);
+	void sbc(uint8_t value);
+	void compare(uint8_t reg, uint8_t value);
+	unsigned branch(Bus& bus, bool taken);
+	void bit(uint8_t value);
+
+	uint8_t inc(uint8_t value);
+	uint8_t dec(uint8_t value);
+
+	uint8_t asl(uint8_t value);
+	uint8_t lsr(uint8_t value);
+	uint8_t rol(uint8_t value);
+	uint8_t ror(uint8_t value);
+
+	bool m_jammed;
+	bool m_lastJsr;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#include "d64_image.h"
+
+D64Image::D64Image(const uint8_t* data, size_t size)
+	: m_data(data), m_tracks(0)
+{
+	if(size >= IMAGE_SIZE_EXTENDED)
+		m_tracks = TRACKS_EXTENDED;
+	else if(size >= IMAGE_SIZE)
+		m_tracks = TRACKS;
+}
+
+
+int D64Image::sectorsInTrack(int track)
+{
+	if(track < 18)
+		return 21;
+	if(track < 25)
+		return 19;
+	if(track < 31)
+		return 18;
+	return 17;
+} // sectorsInTrack
+
+
+const uint8_t* D64Image::sector(int track, int sector) const
+{
+	if(track < 1 or track > m_tracks or sector < 0 or sector >= sectorsInTrack(track))
+		return nullptr;
+
+	size_t offset = 0;
+	for(int t = 1; t < track; t++)
+		offset += sectorsInTrack(t);
+	offset += sector;
+
+	return m_data + offset * SECTOR_SIZE;
+} // sector
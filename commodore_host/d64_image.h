@@ -0,0 +1,35 @@
+#ifndef D64_IMAGE_H
+#define D64_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Read-only view of a D64 disk image held in memory.
+class D64Image
+{
+public:
+	enum {
+		SECTOR_SIZE = 256,
+		TRACKS = 35,
+		TRACKS_EXTENDED = 40,
+		IMAGE_SIZE = 174848,
+		IMAGE_SIZE_EXTENDED = 196608
+	};
+
+	// data must outlive the image. Error bytes appended to the image are ignored.
+	D64Image(const uint8_t* data, size_t size);
+
+	bool valid() const { return m_tracks > 0; }
+	int tracks() const { return m_tracks; }
+
+	static int sectorsInTrack(int track);
+
+	// Pointer to the 256 bytes of the sector, null if it is outside the image.
+	const uint8_t* sector(int track, int sector) const;
+
+private:
+	const uint8_t* m_data;
+	int m_tracks;
+};
+
+#endif
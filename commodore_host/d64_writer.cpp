@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "d64_writer.h"
+
+namespace {
+
+const int DIR_TRACK = 18;
+const int DIR_SECTOR = 1;
+const size_t BAM_ENTRIES_OFFSET = 4;  // free count and three bitmap bytes per track, bit set for a free sector
+const int BAM_TRACKS = 35;            // 40 track images keep tracks 36 to 40 elsewhere, they are left alone
+const size_t ENTRY_BYTES = 32;
+const size_t NAME_BYTES = 16;
+const size_t BLOCK_DATA_BYTES = 254;
+const int FILE_INTERLEAVE = 10;  // sectors between the blocks of a file, and of the directory, as the 1541 lays them
+const int DIR_INTERLEAVE = 3;
+const int MAX_HOPS = 768;  // a disk has at most 768 sectors, more links than that is a loop
+
+// 16 bytes of directory name, shifted space padded
+void entryName(uint8_t* bytes, const std::string& name)
+{
+	for(size_t i = 0; i < NAME_BYTES; i++)
+		bytes[i] = i < name.size() ? uint8_t(name[i]) : 0xA0;
+} // entryName
+
+
+bool nameIs(const uint8_t* bytes, const std::string& name)
+{
+	for(size_t i = 0; i < NAME_BYTES; i++)
+		if(bytes[i] != (i < name.size() ? uint8_t(name[i]) : 0xA0))
+			return false;
+	return name.size() <= NAME_BYTES;
+} // nameIs
+
+} // unnamed namespace
+
+
+D64Writer::D64Writer(const uint8_t* data, size_t size)
+	: m_data(data, data + size), m_disk(m_data.data(), m_data.size())
+{}
+
+
+const uint8_t* D64Writer::block(int track, int sector) const
+{
+	return m_disk.sector(track, sector);
+} // block
+
+
+uint8_t* D64Writer::block(int track, int sector)
+{
+	const uint8_t* data = m_disk.sector(track, sector);
+	return data ? &m_data[data - m_data.data()] : nullptr;
+} // block
+
+
+uint8_t* D64Writer::bamEntry(int track)
+{
+	return block(DIR_TRACK, 0) + BAM_ENTRIES_OFFSET + 4 * (track - 1);
+} // bamEntry
+
+
+bool D64Writer::isFree(int track, int sector) const
+{
+	const uint8_t* entry = block(DIR_TRACK, 0) + BAM_ENTRIES_OFFSET + 4 * (track - 1);
+	return entry[1 + sector / 8] & (1 << (sector % 8));
+} // isFree
+
+
+void D64Writer::allocate(int track, int sector)
+{
+	uint8_t* entry = bamEntry(track);
+	entry[1 + sector / 8] &= ~(1 << (sector % 8));
+	entry[0]--;
+} // allocate
+
+
+void D64Writer::release(int track, int sector)
+{
+	uint8_t* entry = bamEntry(track);
+	if(track > BAM_TRACKS or isFree(track, sector))
+		return;
+	entry[1 + sector / 8] |= 1 << (sector % 8);
+	entry[0]++;
+} // release
+
+
+int D64Writer::freeBlocks() const
+{
+	int count = 0;
+	const uint8_t* bam = block(DIR_TRACK, 0);
+	for(int track = 1; bam and track <= BAM_TRACKS; track++)
+		if(track != DIR_TRACK)
+			count += bam[BAM_ENTRIES_OFFSET + 4 * (track - 1)];
+	return count;
+} // freeBlocks
+
+
+int D64Writer::fileBlocks(const std::string& name) const
+{
+	const uint8_t* entry = findEntry(name);
+	return entry ? entry[30] | (entry[31] << 8) : 0;
+} // fileBlocks
+
+
+int D64Writer::blocksFor(size_t bytes)
+{
+	return bytes ? int((bytes + BLOCK_DATA_BYTES - 1) / BLOCK_DATA_BYTES) : 1;
+} // blocksFor
+
+
+// The next free sector for a file, track and sector are the last one given out, track 0 for the first. Like the DOS,
+// a file starts on the free track nearest the directory and stays on its track, FILE_INTERLEAVE sectors on, until
+// the track is full. It then moves on away from the directory, and to the other half of the disk when that is full.
+bool D64Writer::nextFree(int& track, int& sector)
+{
+	std::vector<int> order;
+	if(track == 0) {
+		for(int distance = 1; distance < DIR_TRACK; distance++) {
+			order.push_back(DIR_TRACK - distance);
+			if(DIR_TRACK + distance <= BAM_TRACKS)
+				order.push_back(DIR_TRACK + distance);
+		}
+	}
+	else {
+		int step = track < DIR_TRACK ? -1 : 1;
+		for(int t = track; t >= 1 and t <= BAM_TRACKS; t += step)
+			order.push_back(t);
+		for(int t = DIR_TRACK - step; t >= 1 and t <= BAM_TRACKS; t -= step)
+			order.push_back(t);
+	}
+
+	for(int t : order) {
+		if(bamEntry(t)[0] == 0)
+			continue;
+		int sectors = D64Image::sectorsInTrack(t);
+		int base = t == track ? sector + FILE_INTERLEAVE : 0;
+		for(int i = 0; i < sectors; i++) {
+			int s = (base + i) % sectors;
+			if(isFree(t, s)) {
+				allocate(t, s);
+				track = t;
+				sector = s;
+				return true;
+			}
+		}
+	}
+	return false;
+} // nextFree
+
+
+const uint8_t* D64Writer::findEntry(const std::string& name) const
+{
+	int track = DIR_TRACK, sector = DIR_SECTOR;
+	for(int hops = 0; track and hops < D64Image::sectorsInTrack(DIR_TRACK); hops++) {
+		const uint8_t* dir = block(track, sector);
+		if(dir == nullptr)
+			break;
+		for(size_t i = 0; i < D64Image::SECTOR_SIZE; i += ENTRY_BYTES)
+			if(dir[i + 2] and nameIs(dir + i + 5, name))
+				return dir + i;
+		track = dir[0];
+		sector = dir[1];
+	}
+	return nullptr;
+} // findEntry
+
+
+// A free directory entry, in a new directory sector when the ones there are full
+uint8_t* D64Writer::newEntry()
+{
+	int track = DIR_TRACK, sector = DIR_SECTOR;
+	uint8_t* dir = nullptr;
+
+	for(int hops = 0; track and hops < D64Image::sectorsInTrack(DIR_TRACK); hops++) {
+		dir = block(track, sector);
+		if(dir == nullptr)
+			return nullptr;
+		for(size_t i = 0; i < D64Image::SECTOR_SIZE; i += ENTRY_BYTES)
+			if(dir[i + 2] == 0)
+				return dir + i;
+		if(dir[0] == 0)
+			break;
+		track = dir[0];
+		sector = dir[1];
+	}
+
+	int sectors = D64Image::sectorsInTrack(DIR_TRACK);
+	for(int i = 1; dir and i <= sectors; i++) {
+		int s = (sector + i * DIR_INTERLEAVE) % sectors;
+		if(s == 0 or not isFree(DIR_TRACK, s))
+			continue;
+		allocate(DIR_TRACK, s);
+		dir[0] = DIR_TRACK;
+		dir[1] = uint8_t(s);
+		uint8_t* next = block(DIR_TRACK, s);
+		std::memset(next, 0, D64Image::SECTOR_SIZE);
+		next[1] = 0xFF;
+		return next;
+	}
+	return nullptr;
+} // newEntry
+
+
+void D64Writer::deleteFile(uint8_t* entry)
+{
+	int track = entry[3], sector = entry[4];
+	for(int hops = 0; track and hops < MAX_HOPS; hops++) {
+		const uint8_t* data = block(track, sector);
+		if(data == nullptr)
+			break;
+		release(track, sector);
+		track = data[0];
+		sector = data[1];
+	}
+	entry[2] = 0;
+} // deleteFile
+
+
+D64Writer::Result D64Writer::addFile(const std::string& name, uint8_t type, const std::vector<uint8_t>& data,
+	bool replace)
+{
+	const uint8_t* found = findEntry(name);
+	uint8_t* old = found ? &m_data[found - m_data.data()] : nullptr;
+	if(old and not replace)
+		return FILE_EXISTS;
+
+	int blocks = blocksFor(data.size());
+	if(blocks > freeBlocks() + (old ? fileBlocks(name) : 0))
+		return DISK_FULL;
+	if(old)
+		deleteFile(old);
+
+	uint8_t* entry = old ? old : newEntry();
+	if(entry == nullptr)
+		return DISK_FULL;  // the directory track is full
+
+	// Chain the blocks, the last one's link is the index of its last byte
+	int track = 0, sector = 0;
+	uint8_t* previous = nullptr;
+	for(int i = 0; i < blocks; i++) {
+		if(not nextFree(track, sector))
+			return DISK_FULL;
+		if(previous) {
+			previous[0] = uint8_t(track);
+			previous[1] = uint8_t(sector);
+		}
+		else {
+			entry[3] = uint8_t(track);
+			entry[4] = uint8_t(sector);
+		}
+
+		uint8_t* out = block(track, sector);
+		size_t pos = i * BLOCK_DATA_BYTES;
+		size_t len = std::min(BLOCK_DATA_BYTES, data.size() - std::min(pos, data.size()));
+		std::memset(out, 0, D64Image::SECTOR_SIZE);
+		if(len)
+			std::memcpy(out + 2, data.data() + pos, len);
+		out[0] = 0;
+		out[1] = uint8_t(len + 1);
+		previous = out;
+	}
+
+	entry[2] = 0x80 | type;  // closed
+	entryName(entry + 5, name);
+	std::memset(entry + 21, 0, 9);  // no side sectors, record length or replace link
+	entry[30] = uint8_t(blocks & 0xFF);
+	entry[31] = uint8_t(blocks >> 8);
+	return SAVED;
+} // addFile
+
+
+bool D64Writer::writeSector(int track, int sector, const uint8_t* data)
+{
+	uint8_t* out = block(track, sector);
+	if(out == nullptr)
+		return false;
+	std::memcpy(out, data, D64Image::SECTOR_SIZE);
+	return true;
+} // writeSector
+
+
+bool D64Writer::writeTo(const std::string& path) const
+{
+	std::string temp = path + ".saving";
+	struct stat st;
+	mode_t mode = stat(path.c_str(), &st) == 0 ? st.st_mode & 07777 : 0644;
+
+	int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+	if(fd < 0)
+		return false;
+
+	size_t done = 0;
+	while(done < m_data.size()) {
+		ssize_t n = ::write(fd, m_data.data() + done, m_data.size() - done);
+		if(n < 0 and errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		done += size_t(n);
+	}
+
+	// One sync for the whole save, before the rename makes it the image
+	bool ok = done == m_data.size() and fsync(fd) == 0;
+	int error = errno;
+	if(::close(fd) != 0 and ok)
+		ok = false, error = errno;
+	if(ok and std::rename(temp.c_str(), path.c_str()) == 0)
+		return true;
+
+	if(ok)
+		error = errno;
+	::unlink(temp.c_str());
+	errno = error;
+	return false;
+} // writeTo
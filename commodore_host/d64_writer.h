@@ -0,0 +1,71 @@
+#ifndef D64_WRITER_H
+#define D64_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "d64_image.h"
+
+// A D64 image copied into memory to save files or sectors into, then written back in one go. Sectors are allocated
+// and the BAM and directory updated the way the 1541 DOS does, so the drive and other tools read the files back.
+class D64Writer
+{
+public:
+	// DOS status codes of addFile()
+	enum Result {
+		SAVED = 0,
+		FILE_EXISTS = 63,
+		DISK_FULL = 72
+	};
+
+	// CBM file types addFile() writes
+	enum FileType {
+		SEQ = 1,
+		PRG = 2,
+		USR = 3
+	};
+
+	D64Writer(const uint8_t* data, size_t size);
+	D64Writer(const D64Writer&) = delete;
+	D64Writer& operator=(const D64Writer&) = delete;
+
+	bool valid() const { return m_disk.valid(); }
+
+	// Blocks free in the BAM, and the blocks of a file that a replacing save would free.
+	int freeBlocks() const;
+	int fileBlocks(const std::string& name) const;
+
+	// Blocks a file of that many bytes takes, at least one
+	static int blocksFor(size_t bytes);
+
+	// A file of that name in the directory, a zero block one too
+	bool exists(const std::string& name) const { return findEntry(name) != nullptr; }
+
+	// Add a file of the CBM type, over the one of the same name when replace is set.
+	Result addFile(const std::string& name, uint8_t type, const std::vector<uint8_t>& data, bool replace);
+
+	// The 256 bytes of a sector replaced, as U2 and B-W do: the BAM is left as it is. False outside the image.
+	bool writeSector(int track, int sector, const uint8_t* data);
+
+	// Write the image to path through a temporary file in the same folder, synced and renamed over it, so a crash
+	// leaves either the old image or the new one. False with errno set when it fails.
+	bool writeTo(const std::string& path) const;
+
+private:
+	uint8_t* block(int track, int sector);
+	const uint8_t* block(int track, int sector) const;
+	uint8_t* bamEntry(int track);
+	bool isFree(int track, int sector) const;
+	void allocate(int track, int sector);
+	void release(int track, int sector);
+	bool nextFree(int& track, int& sector);
+	const uint8_t* findEntry(const std::string& name) const;
+	uint8_t* newEntry();
+	void deleteFile(uint8_t* entry);
+
+	std::vector<uint8_t> m_data;
+	D64Image m_disk;
+};
+
+#endif
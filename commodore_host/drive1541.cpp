@@ -0,0 +1,415 @@
+#include <cstring>
+#include "drive1541.h"
+
+namespace {
+
+// VIA1 port B, the serial port
+enum {
+	PB_DATA_IN = 0x01,
+	PB_DATA_OUT = 0x02,
+	PB_CLOCK_IN = 0x04,
+	PB_CLOCK_OUT = 0x08,
+	PB_ATN_ACK = 0x10,
+	PB_ATN_IN = 0x80
+};
+
+// VIA registers and interrupt flags
+enum {
+	VIA_ORB = 0x0, VIA_ORA = 0x1, VIA_DDRB = 0x2, VIA_DDRA = 0x3,
+	VIA_T1CL = 0x4, VIA_T1CH = 0x5, VIA_T1LL = 0x6, VIA_T1LH = 0x7,
+	VIA_T2CL = 0x8, VIA_T2CH = 0x9, VIA_SR = 0xA, VIA_ACR = 0xB,
+	VIA_PCR = 0xC, VIA_IFR = 0xD, VIA_IER = 0xE, VIA_ORA_NH = 0xF,
+
+	IFR_T2 = 0x20,
+	IFR_T1 = 0x40,
+	ACR_T1_FREE_RUN = 0x40
+};
+
+// Job codes and results, see the job queue at $00
+enum {
+	JOB_READ = 0x80,
+	JOB_WRITE = 0x90,
+	JOB_VERIFY = 0xA0,
+	JOB_SEEK = 0xB0,
+	JOB_BUMP = 0xC0,
+	JOB_OK = 0x01,
+	JOB_NO_HEADER = 0x02,
+	JOB_WRITE_PROTECT = 0x08,
+	JOB_NO_DISK = 0x0F,
+
+	JOB_SLOTS = 5,
+	JOB_TRACK_SECTOR = 0x06,
+	JOB_BUFFERS = 0x0300
+};
+
+// The drive's stack has this return address on it when M-E code starts, its RTS ends the run
+const uint16_t ROM_RETURN = 0xEBE6;
+
+// Same port B read at the same PC this many times without I/O in between is a busy-wait
+const unsigned POLL_THRESHOLD = 3;
+
+// Instructions a probe may run to leave the wait loop
+const unsigned PROBE_STEPS = 64;
+
+} // unnamed namespace
+
+
+Drive1541::Drive1541()
+	: m_image(nullptr), m_probing(false)
+{
+	reset();
+} // ctor
+
+
+void Drive1541::reset()
+{
+	m_s = State();
+	m_s.via1.ddrb = PB_DATA_OUT bitor PB_CLOCK_OUT bitor PB_ATN_ACK;
+	m_trace.bytes.clear();
+} // reset
+
+
+void Drive1541::setC64Lines(bool clock, bool data, bool atn)
+{
+	m_s.c64Clock = clock;
+	m_s.c64Data = data;
+	m_s.c64Atn = atn;
+} // setC64Lines
+
+
+void Drive1541::memoryWrite(uint16_t addr, const uint8_t* data, size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+		write(uint16_t(addr + i), data[i]);
+} // memoryWrite
+
+
+uint8_t Drive1541::memoryRead(uint16_t addr)
+{
+	return addr < 0x1800 ? m_s.ram[addr bitand (RAM_SIZE - 1)] : 0;
+} // memoryRead
+
+
+void Drive1541::execute(uint16_t addr)
+{
+	m_s.cpu.reset(addr);
+	// The ROM calls M-E code with JSR
+	m_s.ram[0x100 + m_s.cpu.sp--] = (ROM_RETURN - 1) >> 8;
+	m_s.ram[0x100 + m_s.cpu.sp--] = (ROM_RETURN - 1) bitand 0xFF;
+
+	m_s.cycles = m_s.lastEvent = 0;
+	m_s.pollCount = 0;
+	m_s.ioWritten = false;
+	emitOutputs();
+	m_trace.bytes.clear();
+} // execute
+
+
+Drive1541::RunResult Drive1541::run(uint64_t maxCycles)
+{
+	uint64_t end = m_s.cycles + maxCycles;
+
+	while(m_s.cycles < end) {
+		RunResult result = step();
+		if(result != RUN_LIMIT) {
+			if(result == RUN_FINISHED) {
+				m_trace.delay(m_s.cycles - m_s.lastEvent);
+				m_trace.end();
+			}
+			return result;
+		}
+
+		if(m_s.pollCount >= POLL_THRESHOLD and not resolveBusyWait())
+			return RUN_STALLED;
+	}
+
+	return RUN_LIMIT;
+} // run
+
+
+// One instruction, or the return from a call into ROM.
+Drive1541::RunResult Drive1541::step()
+{
+	Cpu6502& cpu = m_s.cpu;
+
+	if(cpu.pc >= ROM_START) {
+		if(not cpu.lastWasJsr())
+			return RUN_FINISHED;
+
+		// No ROM, return straight away from the subroutine
+		uint16_t ret = m_s.ram[0x100 + uint8_t(cpu.sp + 1)] bitor (m_s.ram[0x100 + uint8_t(cpu.sp + 2)] << 8);
+		cpu.sp += 2;
+		cpu.pc = ret + 1;
+		m_s.cycles += 6;
+		tickVia(m_s.via1, 6);
+		tickVia(m_s.via2, 6);
+		return RUN_LIMIT;
+	}
+
+	m_s.instrPc = cpu.pc;
+	unsigned cycles = cpu.step(*this);
+	if(cpu.jammed())
+		return RUN_JAMMED;
+
+	m_s.cycles += cycles;
+	tickVia(m_s.via1, cycles);
+	tickVia(m_s.via2, cycles);
+
+	if(m_s.instrPc < m_s.loopLow)
+		m_s.loopLow = m_s.instrPc;
+	if(m_s.instrPc > m_s.loopHigh)
+		m_s.loopHigh = m_s.instrPc;
+
+	emitOutputs();
+	return RUN_LIMIT;
+} // step
+
+
+uint8_t Drive1541::read(uint16_t addr)
+{
+	if(addr >= ROM_START)
+		return addr >> 8;  // no ROM
+
+	addr &= 0x1FFF;
+	if(addr < 0x1800)
+		return m_s.ram[addr bitand (RAM_SIZE - 1)];
+
+	uint8_t reg = addr bitand 0x0F;
+	if(addr < 0x1C00) {
+		uint8_t value = readVia(m_s.via1, reg, serialInputs(), 0xFF);
+		if(reg == VIA_ORB and not m_probing) {
+			// Watch for the code spinning on the serial port
+			if(m_s.instrPc == m_s.pollPc and value == m_s.pollValue and not m_s.ioWritten)
+				m_s.pollCount++;
+			else {
+				m_s.pollPc = m_s.loopLow = m_s.loopHigh = m_s.instrPc;
+				m_s.pollValue = value;
+				m_s.pollCount = 0;
+				m_s.pollStart = m_s.cycles;
+			}
+			m_s.ioWritten = false;
+		}
+		return value;
+	}
+
+	// Disk controller: no sync, not write protected, nothing under the head
+	return readVia(m_s.via2, reg, 0x90, 0xFF);
+} // read
+
+
+void Drive1541::write(uint16_t addr, uint8_t data)
+{
+	if(addr >= ROM_START)
+		return;
+
+	addr &= 0x1FFF;
+	if(addr < 0x1800) {
+		m_s.ram[addr bitand (RAM_SIZE - 1)] = data;
+		if(addr < JOB_SLOTS and (data bitand 0x80))
+			runJob(addr);
+		return;
+	}
+
+	m_s.ioWritten = true;
+	writeVia(addr < 0x1C00 ? m_s.via1 : m_s.via2, addr bitand 0x0F, data);
+} // write
+
+
+uint8_t Drive1541::readVia(Via& via, uint8_t reg, uint8_t inputsB, uint8_t inputsA)
+{
+	switch(reg) {
+		case VIA_ORB: return (via.orb bitand via.ddrb) bitor (inputsB bitand ~via.ddrb);
+		case VIA_ORA: case VIA_ORA_NH: return (via.ora bitand via.ddra) bitor (inputsA bitand ~via.ddra);
+		case VIA_DDRB: return via.ddrb;
+		case VIA_DDRA: return via.ddra;
+		case VIA_T1CL: via.ifr &= ~IFR_T1; return via.t1 bitand 0xFF;
+		case VIA_T1CH: return via.t1 >> 8;
+		case VIA_T1LL: return via.t1LatchLo;
+		case VIA_T1LH: return via.t1LatchHi;
+		case VIA_T2CL: via.ifr &= ~IFR_T2; return via.t2 bitand 0xFF;
+		case VIA_T2CH: return via.t2 >> 8;
+		case VIA_ACR: return via.acr;
+		case VIA_PCR: return via.pcr;
+		case VIA_IFR: return via.ifr bitor ((via.ifr bitand via.ier bitand 0x7F) ? 0x80 : 0);
+		case VIA_IER: return via.ier bitor 0x80;
+		default: return 0;
+	}
+} // readVia
+
+
+void Drive1541::writeVia(Via& via, uint8_t reg, uint8_t data)
+{
+	switch(reg) {
+		case VIA_ORB: via.orb = data; break;
+		case VIA_ORA: case VIA_ORA_NH: via.ora = data; break;
+		case VIA_DDRB: via.ddrb = data; break;
+		case VIA_DDRA: via.ddra = data; break;
+		case VIA_T1CL: case VIA_T1LL: via.t1LatchLo = data; break;
+		case VIA_T1CH:
+			via.t1LatchHi = data;
+			via.t1 = (data << 8) bitor via.t1LatchLo;
+			via.ifr &= ~IFR_T1;
+			via.t1Armed = true;
+			break;
+		case VIA_T1LH: via.t1LatchHi = data; via.ifr &= ~IFR_T1; break;
+		case VIA_T2CL: via.t2LatchLo = data; break;
+		case VIA_T2CH:
+			via.t2 = (data << 8) bitor via.t2LatchLo;
+			via.ifr &= ~IFR_T2;
+			via.t2Armed = true;
+			break;
+		case VIA_ACR: via.acr = data; break;
+		case VIA_PCR: via.pcr = data; break;
+		case VIA_IFR: via.ifr &= ~data; break;
+		case VIA_IER:
+			if(data bitand 0x80)
+				via.ier |= data bitand 0x7F;
+			else
+				via.ier &= ~data;
+			break;
+	}
+} // writeVia
+
+
+// Count the timers down. Interrupts are flagged in IFR but not delivered, drive code runs with them disabled.
+void Drive1541::tickVia(Via& via, unsigned cycles)
+{
+	if(cycles > via.t1) {
+		if(via.t1Armed)
+			via.ifr |= IFR_T1;
+		if(via.acr bitand ACR_T1_FREE_RUN) {
+			unsigned period = ((via.t1LatchHi << 8) bitor via.t1LatchLo) + 2;
+			via.t1 = uint16_t(period - 1 - (cycles - via.t1 - 1) % period);
+		}
+		else {
+			via.t1Armed = false;
+			via.t1 = uint16_t(via.t1 - cycles);
+		}
+	}
+	else
+		via.t1 -= cycles;
+
+	if(cycles > via.t2) {
+		if(via.t2Armed)
+			via.ifr |= IFR_T2;
+		via.t2Armed = false;
+	}
+	via.t2 = uint16_t(via.t2 - cycles);
+} // tickVia
+
+
+// Serial port inputs as the drive sees them: a line reads pulled when either side pulls it.
+uint8_t Drive1541::serialInputs() const
+{
+	return (busData() ? PB_DATA_IN : 0) bitor (busClock() ? PB_CLOCK_IN : 0) bitor (m_s.c64Atn ? PB_ATN_IN : 0);
+} // serialInputs
+
+
+bool Drive1541::busClock() const
+{
+	return m_s.c64Clock or m_s.outClock;
+} // busClock
+
+
+bool Drive1541::busData() const
+{
+	return m_s.c64Data or m_s.outData;
+} // busData
+
+
+// Drive side of CLOCK and DATA after the last instruction. DATA is also pulled by the ATN acknowledge hardware
+// while ATN and ATNA differ.
+void Drive1541::emitOutputs()
+{
+	uint8_t pins = m_s.via1.orb bitand m_s.via1.ddrb;
+	bool clock = pins bitand PB_CLOCK_OUT;
+	bool data = (pins bitand PB_DATA_OUT) or (bool(pins bitand PB_ATN_ACK) != m_s.c64Atn);
+
+	if(clock == m_s.outClock and data == m_s.outData)
+		return;
+
+	m_s.outClock = clock;
+	m_s.outData = data;
+	if(m_probing)
+		return;
+
+	m_trace.out(clock, data, m_s.cycles - m_s.lastEvent);
+	m_s.lastEvent = m_s.cycles;
+} // emitOutputs
+
+
+void Drive1541::runJob(uint8_t slot)
+{
+	uint8_t job = m_s.ram[slot] bitand 0xF0;
+	uint8_t track = m_s.ram[JOB_TRACK_SECTOR + slot * 2];
+	uint8_t sector = m_s.ram[JOB_TRACK_SECTOR + slot * 2 + 1];
+	uint8_t result = JOB_OK;
+
+	if(m_image == nullptr or not m_image->valid())
+		result = JOB_NO_DISK;
+	else if(job == JOB_READ or job == JOB_VERIFY or job == JOB_WRITE) {
+		const uint8_t* data = m_image->sector(track, sector);
+		if(data == nullptr)
+			result = JOB_NO_HEADER;
+		else if(job == JOB_WRITE)
+			result = JOB_WRITE_PROTECT;
+		else if(job == JOB_READ)
+			std::memcpy(&m_s.ram[JOB_BUFFERS + slot * D64Image::SECTOR_SIZE], data, D64Image::SECTOR_SIZE);
+	}
+	else if(job != JOB_SEEK and job != JOB_BUMP)
+		result = JOB_NO_DISK;  // execute jobs are not supported
+
+	m_s.ram[slot] = result;
+} // runJob
+
+
+// The code has been spinning on the serial port. Find the Commodore line change that lets it go on, record it as
+// a WAIT for the Arduino, and make it happen here too.
+bool Drive1541::resolveBusyWait()
+{
+	for(uint8_t line = LINE_CLOCK; line <= LINE_ATN; line++) {
+		if(probe(line)) {
+			flipLine(line);
+			// The time spent spinning is the Commodore's, the wait starts with the first poll
+			if(m_s.pollStart > m_s.lastEvent)
+				m_trace.delay(m_s.pollStart - m_s.lastEvent);
+			m_trace.wait(line, line == LINE_CLOCK ? m_s.c64Clock : line == LINE_DATA ? m_s.c64Data : m_s.c64Atn);
+			m_s.lastEvent = m_s.cycles;
+			m_s.pollCount = 0;
+			emitOutputs();
+			return true;
+		}
+	}
+
+	return false;
+} // resolveBusyWait
+
+
+// Does flipping the line make the code leave its wait loop within a few instructions?
+bool Drive1541::probe(uint8_t line)
+{
+	State saved = m_s;
+	bool left = false;
+
+	m_probing = true;
+	flipLine(line);
+	for(unsigned i = 0; i < PROBE_STEPS and not left; i++) {
+		uint16_t low = saved.loopLow, high = saved.loopHigh;
+		if(m_s.cpu.pc < low or m_s.cpu.pc > high or step() != RUN_LIMIT)
+			left = true;
+	}
+	m_probing = false;
+
+	m_s = saved;
+	return left;
+} // probe
+
+
+void Drive1541::flipLine(uint8_t line)
+{
+	switch(line) {
+		case LINE_CLOCK: m_s.c64Clock = not m_s.c64Clock; break;
+		case LINE_DATA: m_s.c64Data = not m_s.c64Data; break;
+		case LINE_ATN: m_s.c64Atn = not m_s.c64Atn; break;
+	}
+} // flipLine
@@ -0,0 +1,114 @@
+#ifndef DRIVE1541_H
+#define DRIVE1541_H
+
+#include <cstddef>
+#include <cstdint>
+#include "cpu6502.h"
+#include "d64_image.h"
+#include "drive_trace.h"
+
+// 1541 model for drive code uploaded by the Commodore with M-W and started with M-E. It has the 6502, the 2K of
+// drive RAM and both VIAs, but no ROM. The serial port pins the code drives are turned into a DriveTrace that the
+// Arduino replays against the real Commodore.
+//
+// Since the Commodore is not there while the code runs, a busy-wait on the serial port is resolved by trying each
+// Commodore line in a scratch copy of the drive, the one that makes the code leave its loop is recorded as a WAIT.
+// Sector reads through the job queue ($00-$04) complete at once from the disk image. Calls into ROM return
+// immediately, a jump into ROM ends the run.
+class Drive1541 : public Cpu6502::Bus
+{
+public:
+	enum RunResult {
+		RUN_LIMIT,     // cycle budget used up, call run() again
+		RUN_FINISHED,  // code returned or jumped into ROM, the trace is complete
+		RUN_JAMMED,    // illegal opcode
+		RUN_STALLED    // waiting for something no Commodore line changes
+	};
+
+	enum Line {
+		LINE_CLOCK = 0,
+		LINE_DATA = 1,
+		LINE_ATN = 2
+	};
+
+	enum {
+		RAM_SIZE = 0x800,
+		ROM_START = 0x8000,
+		CLOCK_HZ = 1000000
+	};
+
+	Drive1541();
+
+	// Power on state, the RAM is cleared.
+	void reset();
+
+	void setImage(const D64Image* image) { m_image = image; }
+
+	// State of the Commodore's bus lines when the code starts, true is pulled low.
+	void setC64Lines(bool clock, bool data, bool atn);
+
+	// M-W
+	void memoryWrite(uint16_t addr, const uint8_t* data, size_t len);
+	// M-R
+	uint8_t memoryRead(uint16_t addr);
+
+	// M-E, prepares the CPU and starts a new trace. Use run() to execute.
+	void execute(uint16_t addr);
+
+	// Run for up to maxCycles drive cycles (1 us each).
+	RunResult run(uint64_t maxCycles);
+
+	DriveTrace& trace() { return m_trace; }
+	uint64_t cycles() const { return m_s.cycles; }
+
+	uint8_t read(uint16_t addr) override;
+	void write(uint16_t addr, uint8_t data) override;
+
+private:
+	struct Via {
+		uint8_t orb, ora, ddrb, ddra;
+		uint8_t acr, pcr, ifr, ier;
+		uint8_t t1LatchLo, t1LatchHi, t2LatchLo;
+		uint16_t t1, t2;
+		bool t1Armed, t2Armed;
+	};
+
+	// Everything that changes while code runs, copied for the busy-wait probes.
+	struct State {
+		Cpu6502 cpu;
+		uint8_t ram[RAM_SIZE];
+		Via via1, via2;
+		bool c64Clock, c64Data, c64Atn;
+		bool outClock, outData;
+		uint64_t cycles;
+		uint64_t lastEvent;
+		uint64_t pollStart;
+		uint16_t instrPc;
+		uint16_t pollPc, loopLow, loopHigh;
+		uint8_t pollValue;
+		unsigned pollCount;
+		bool ioWritten;
+	};
+
+	uint8_t readVia(Via& via, uint8_t reg, uint8_t inputsB, uint8_t inputsA);
+	void writeVia(Via& via, uint8_t reg, uint8_t data);
+	void tickVia(Via& via, unsigned cycles);
+
+	uint8_t serialInputs() const;
+	bool busClock() const;
+	bool busData() const;
+
+	void runJob(uint8_t slot);
+	RunResult step();
+	void emitOutputs();
+	bool resolveBusyWait();
+	bool probe(uint8_t line);
+	void flipLine(uint8_t line);
+
+	State m_s;
+	const D64Image* m_image;
+	DriveTrace m_trace;
+	bool m_probing;
+};
+
+#endif
@@ -0,0 +1,190 @@
+// Cycle budget benchmark for the drive emulation. A fastloader style transfer routine reads a file through the job
+// queue and sends each byte two bits at a time, handshaking with the Commodore per byte. The emulation has to run
+// well ahead of the 1 MHz drive, and the trace it produces has to fit through the serial link to the Arduino.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+#include "drive1541.h"
+
+namespace {
+
+// Just enough of an assembler for the transfer routine
+class Assembler
+{
+public:
+	explicit Assembler(uint16_t org) : m_org(org) {}
+
+	void label(const std::string& name) { m_labels[name] = uint16_t(m_org + code.size()); }
+	void op(uint8_t opcode) { code.push_back(opcode); }
+	void imm(uint8_t opcode, uint8_t value) { code.push_back(opcode); code.push_back(value); }
+	void abs(uint8_t opcode, uint16_t addr) { code.push_back(opcode); code.push_back(addr & 0xFF); code.push_back(addr >> 8); }
+
+	void jump(uint8_t opcode, const std::string& name)
+	{
+		m_fixups.push_back({ code.size() + 1, name, false });
+		abs(opcode, 0);
+	}
+
+	void branch(uint8_t opcode, const std::string& name)
+	{
+		m_fixups.push_back({ code.size() + 1, name, true });
+		imm(opcode, 0);
+	}
+
+	void link()
+	{
+		for(const Fixup& f : m_fixups) {
+			uint16_t target = m_labels.at(f.label);
+			if(f.relative)
+				code[f.offset] = uint8_t(target - (m_org + f.offset + 1));
+			else {
+				code[f.offset] = target & 0xFF;
+				code[f.offset + 1] = target >> 8;
+			}
+		}
+	}
+
+	std::vector<uint8_t> code;
+
+private:
+	struct Fixup {
+		size_t offset;
+		std::string label;
+		bool relative;
+	};
+
+	uint16_t m_org;
+	std::map<std::string, uint16_t> m_labels;
+	std::vector<Fixup> m_fixups;
+};
+
+enum {
+	LDA_IMM = 0xA9, LDA_ZP = 0xA5, LDA_ABS = 0xAD, LDA_ABS_Y = 0xB9, LDX_IMM = 0xA2, LDY_IMM = 0xA0,
+	STA_ZP = 0x85, STA_ABS = 0x8D, AND_IMM = 0x29, ORA_IMM = 0x09, CMP_IMM = 0xC9, LSR_ZP = 0x46,
+	DEX = 0xCA, INY = 0xC8, JMP = 0x4C, RTS = 0x60,
+	BCC = 0x90, BEQ = 0xF0, BNE = 0xD0, BMI = 0x30
+};
+
+const uint16_t CODE_ADDR = 0x0500;
+const uint16_t SERIAL_PORT = 0x1800;
+
+std::vector<uint8_t> transferRoutine()
+{
+	Assembler a(CODE_ADDR);
+
+	a.imm(LDA_IMM, 1); a.imm(STA_ZP, 0x06);  // first block at 1/0
+	a.imm(LDA_IMM, 0); a.imm(STA_ZP, 0x07);
+	a.label("read");
+	a.imm(LDA_IMM, 0x80); a.imm(STA_ZP, 0x00);  // read job into buffer 0
+	a.label("job");
+	a.imm(LDA_ZP, 0x00); a.branch(BMI, "job");
+	a.imm(CMP_IMM, 0x01); a.branch(BNE, "done");
+	a.imm(LDY_IMM, 0);
+
+	a.label("byte");
+	a.imm(LDA_IMM, 0); a.abs(STA_ABS, SERIAL_PORT);
+	a.label("ready");  // Commodore pulls DATA when it wants the next byte
+	a.abs(LDA_ABS, SERIAL_PORT); a.imm(AND_IMM, 0x01); a.branch(BEQ, "ready");
+	a.abs(LDA_ABS_Y, 0x0300); a.imm(STA_ZP, 0x10);
+	a.imm(LDX_IMM, 4);
+	a.label("pair");
+	a.imm(LDA_IMM, 0);
+	a.imm(LSR_ZP, 0x10); a.branch(BCC, "bit1"); a.imm(ORA_IMM, 0x02); a.label("bit1");
+	a.imm(LSR_ZP, 0x10); a.branch(BCC, "bit2"); a.imm(ORA_IMM, 0x08); a.label("bit2");
+	a.abs(STA_ABS, SERIAL_PORT);
+	a.op(DEX); a.branch(BNE, "pair");
+	a.imm(LDA_IMM, 0); a.abs(STA_ABS, SERIAL_PORT);
+	a.label("ack");  // and releases it once the byte is in
+	a.abs(LDA_ABS, SERIAL_PORT); a.imm(AND_IMM, 0x01); a.branch(BNE, "ack");
+	a.op(INY); a.branch(BNE, "byte");
+
+	a.abs(LDA_ABS, 0x0300); a.branch(BEQ, "done");  // follow the block chain
+	a.imm(STA_ZP, 0x06);
+	a.abs(LDA_ABS, 0x0301); a.imm(STA_ZP, 0x07);
+	a.jump(JMP, "read");
+	a.label("done");
+	a.imm(LDA_IMM, 0); a.abs(STA_ABS, SERIAL_PORT);
+	a.op(RTS);
+
+	a.link();
+	return a.code;
+} // transferRoutine
+
+
+// Disk image with one file of the given number of blocks, laid out from track 1 on.
+std::vector<uint8_t> testImage(int blocks)
+{
+	std::vector<uint8_t> image(D64Image::IMAGE_SIZE, 0);
+	D64Image view(image.data(), image.size());
+	int track = 1, sector = 0;
+
+	for(int i = 0; i < blocks; i++) {
+		uint8_t* data = const_cast<uint8_t*>(view.sector(track, sector));
+		int nextTrack = track, nextSector = sector + 1;
+		if(nextSector == D64Image::sectorsInTrack(track)) {
+			nextTrack = track == 17 ? 19 : track + 1;
+			nextSector = 0;
+		}
+
+		for(int j = 2; j < D64Image::SECTOR_SIZE; j++)
+			data[j] = uint8_t(i + j);
+		data[0] = i == blocks - 1 ? 0 : nextTrack;
+		data[1] = i == blocks - 1 ? 0xFF : nextSector;
+		track = nextTrack;
+		sector = nextSector;
+	}
+
+	return image;
+} // testImage
+
+} // unnamed namespace
+
+
+int main(int argc, char* argv[])
+{
+	int blocks = argc > 1 ? std::atoi(argv[1]) : 200;
+	int rounds = argc > 2 ? std::atoi(argv[2]) : 10;
+	const double linkBytesPerSec = 115200.0 / 10;
+
+	std::vector<uint8_t> image = testImage(blocks);
+	D64Image disk(image.data(), image.size());
+	std::vector<uint8_t> code = transferRoutine();
+	Drive1541 drive;
+	Drive1541::RunResult result = Drive1541::RUN_LIMIT;
+	uint64_t cycles = 0, traceBytes = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for(int r = 0; r < rounds; r++) {
+		drive.reset();
+		drive.setImage(&disk);
+		drive.memoryWrite(CODE_ADDR, code.data(), code.size());
+		drive.execute(CODE_ADDR);
+		do
+			result = drive.run(20000);
+		while(result == Drive1541::RUN_LIMIT);
+		cycles += drive.cycles();
+		traceBytes += drive.trace().bytes.size();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if(result != Drive1541::RUN_FINISHED) {
+		std::fprintf(stderr, "drive code did not finish (result %d)\n", result);
+		return 1;
+	}
+
+	double emulated = double(cycles) / Drive1541::CLOCK_HZ;
+	std::printf("%d blocks x %d rounds\n", blocks, rounds);
+	std::printf("emulated    %.3f s drive time in %.3f s\n", emulated, seconds);
+	std::printf("speed       %.1f MHz, %.0fx real time\n", cycles / seconds / 1e6, emulated / seconds);
+	// The Commodore's side of each handshake takes time the emulation does not see, so the link is compared per
+	// byte transferred rather than per drive second
+	double perByte = double(traceBytes) / (double(rounds) * blocks * (D64Image::SECTOR_SIZE));
+	std::printf("trace       %.0f bytes per drive second, %.1f per file byte\n", traceBytes / emulated, perByte);
+	std::printf("link        %.0f bytes/s at 115200 baud sustains %.0f file bytes/s\n",
+				linkBytesPerSec, linkBytesPerSec / perByte);
+	return 0;
+} // main
@@ -0,0 +1,67 @@
+#ifndef DRIVE_TRACE_H
+#define DRIVE_TRACE_H
+
+#include <cstdint>
+#include <vector>
+
+// Bit-level serial bus stream produced by the drive emulation, replayed by the Arduino on CLOCK/DATA.
+// It is sent in 'T' frames (last one 't'). One byte per event:
+//   00nnnnnn      delay n+1 us (n < 63)
+//   00111111 k    delay (k+1)*64 us
+//   01cdnnnn      after 2n us the drive pulls CLOCK (c) and DATA (d), a clear bit releases the line
+//   10v000ll      wait until line ll (0 CLOCK, 1 DATA, 2 ATN) is pulled (v=1) or released (v=0)
+//   11111111      end of drive code
+class DriveTrace
+{
+public:
+	enum {
+		OP_DELAY = 0x00,
+		OP_DELAY_LONG = 0x3F,
+		OP_OUT = 0x40,
+		OP_WAIT = 0x80,
+		OP_END = 0xFF,
+
+		OUT_CLOCK = 0x20,
+		OUT_DATA = 0x10,
+		OUT_DELAY_MAX = 30,
+		WAIT_PULLED = 0x20
+	};
+
+	void delay(uint64_t usecs)
+	{
+		while(usecs >= 64) {
+			uint64_t units = usecs / 64;
+			if(units > 256)
+				units = 256;
+			bytes.push_back(OP_DELAY_LONG);
+			bytes.push_back(uint8_t(units - 1));
+			usecs -= units * 64;
+		}
+		if(usecs)
+			bytes.push_back(uint8_t(OP_DELAY | (usecs - 1)));
+	}
+
+	// Line change after usecs, short delays ride along in the same byte (an odd microsecond is dropped).
+	void out(bool clock, bool data, uint64_t usecs)
+	{
+		if(usecs > OUT_DELAY_MAX) {
+			delay(usecs - OUT_DELAY_MAX);
+			usecs = OUT_DELAY_MAX;
+		}
+		bytes.push_back(uint8_t(OP_OUT | (clock ? OUT_CLOCK : 0) | (data ? OUT_DATA : 0) | (usecs / 2)));
+	}
+
+	void wait(uint8_t line, bool pulled)
+	{
+		bytes.push_back(uint8_t(OP_WAIT | (pulled ? WAIT_PULLED : 0) | line));
+	}
+
+	void end()
+	{
+		bytes.push_back(OP_END);
+	}
+
+	std::vector<uint8_t> bytes;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef HOST_PROTOCOL_H
+#define HOST_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Frames exchanged with the Arduino, see interface.cpp in the sketch. The first byte is the frame type.
+namespace HostProtocol {
+
+// Handshake lines
+const char HANDSHAKE_READY[] = "<CON>";
+const char HANDSHAKE_SEND[] = "<AOK>";
+const char HANDSHAKE_OK[] = "<END>";
+
+// Handshake mode flags, CBM::HostModes in cbmdefines.h
+enum Modes {
+	MODE_FRAMED = 0x01,      // blocks carry a sequence number and CRC-16
+	MODE_DRIVE_CODE = 0x02,  // unknown M-E drive code is run here and replayed from 'T' blocks
+	MODE_SECTORS = 0x04,     // 'S' / 'Y' whole sector frames
+	MODE_CHANNELS = 0x08,    // data channels stay open and are pulled with 'G'
+	MODE_EVENTS = 0x10,      // the sketch's event log comes in 'V' frames
+	MODE_RECORDS = 0x20,     // 'P' positions a relative file's channel on a record, implies MODE_CHANNELS
+	MODE_SNIFF = 0x40        // the Arduino only listens, every bus byte comes in a 'Z' frame
+};
+
+// Arduino to host
+enum Requests {
+	REQ_OPEN = 'O',         // 'O' len channel name, len counts the three header bytes
+	REQ_READ = 'R',         // next block of the open file or drive trace
+	REQ_LIST = 'L',         // next directory line
+	REQ_CLOSE = 'C',        // 'C', plus the channel in channel mode
+	REQ_GET = 'G',          // 'G' channel maxLen
+	REQ_POSITION = 'P',     // 'P' channel recordLo recordHi position maxLen, then as 'G'
+	REQ_SECTOR = 'S',       // 'S' channel track sector
+	REQ_WRITE_SECTOR = 'Y', // 'Y' channel track sector [seq] 256 bytes [crc]
+	REQ_WRITE = 'W',        // 'W' len [seq] data [crc], len counts the header bytes
+	REQ_WRITE_LAST = 'w',
+	REQ_NAK = 'N',          // 'N' seq, send the frame again
+	REQ_DEBUG = 'D',        // "D:" text CR LF
+	REQ_EVENTS = 'V',       // 'V' count, then count event records, see log_events.h
+	REQ_SNIFF = 'Z',        // 'Z' flags data time, the time in 4 bytes low first
+	REQ_ERROR = 'E'
+};
+
+// 'Z' frame flags, CBM::SniffFlags in cbmdefines.h
+enum SniffFlags {
+	SNIFF_ATN = 0x01,   // a bus command
+	SNIFF_EOI = 0x02,
+	SNIFF_CLOCK = 0x80  // no byte, the time is the ticks per second of the others
+};
+
+// Host to Arduino, data frames are type len [seq] data [crc]
+enum Replies {
+	REP_BLOCK = 'B',
+	REP_BLOCK_LAST = 'b',
+	REP_LINE = 'L',
+	REP_LINE_LAST = 'l',
+	REP_TRACE = 'T',
+	REP_TRACE_LAST = 't',
+	REP_SECTOR = 'S',       // 256 data bytes, the length byte is 0
+	REP_WRITE_READY = 'W',  // answer to an open on CHANNEL_SAVE, send the file in 'W' frames
+	REP_ERROR = 'X',        // 'X' code, never framed
+	REP_ACK = 'A',
+	REP_NAK = 'N'           // a 'W' or 'Y' frame arrived damaged, the Arduino sends it again
+};
+
+// Channel byte: secondary address, device number above 8 in the upper nibble, so only devices 8 to 23 fit
+enum Channels {
+	CHANNEL_LOAD = 0,
+	CHANNEL_SAVE = 1,
+	CHANNEL_COMMAND = 15,
+	FIRST_DEVICE = 8,
+	LAST_DEVICE = 23
+};
+
+// Bytes per block, as the Excel host sends them
+const size_t BLOCK_BYTES = 254;
+const size_t SECTOR_BYTES = 256;
+
+// CRC-16/XMODEM, the same as _crc_xmodem_update in avr-libc
+inline uint16_t crc16Update(uint16_t crc, uint8_t data)
+{
+	crc ^= uint16_t(data) << 8;
+	for(int i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021) : uint16_t(crc << 1);
+	return crc;
+}
+
+inline uint16_t crc16(const uint8_t* data, size_t len, uint16_t crc = 0)
+{
+	for(size_t i = 0; i < len; i++)
+		crc = crc16Update(crc, data[i]);
+	return crc;
+}
+
+inline uint8_t channelDevice(uint8_t channel) { return FIRST_DEVICE + (channel >> 4); }
+inline uint8_t channelNumber(uint8_t channel) { return channel & 0x0F; }
+
+} // namespace HostProtocol
+
+#endif
@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "archive.h"
+#include "image_cache.h"
+
+MappedFile::MappedFile(const std::string& path, const uint8_t* data, size_t size)
+	: m_path(path), m_name(path), m_data(data), m_size(size)
+{}
+
+
+MappedFile::~MappedFile()
+{
+	if(m_size and m_unpacked.empty())
+		munmap(const_cast<uint8_t*>(m_data), m_size);
+} // dtor
+
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return nullptr;
+
+	struct stat st;
+	void* data = MAP_FAILED;
+	if(fstat(fd, &st) == 0 and st.st_size > 0)
+		data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(data == MAP_FAILED)
+		return nullptr;
+	std::shared_ptr<MappedFile> file(new MappedFile(path, static_cast<const uint8_t*>(data), st.st_size));
+	if(not Archive::isArchiveName(path))
+		return file;
+
+	// Inflated from the mapping, which goes as soon as the image is out
+	std::vector<uint8_t> image;
+	std::string name;
+	if(not Archive::unpack(path, file->m_data, file->m_size, image, name) or image.empty())
+		return nullptr;
+	std::shared_ptr<MappedFile> unpacked(new MappedFile(path, nullptr, 0));
+	unpacked->m_name = name;
+	unpacked->m_unpacked.swap(image);
+	unpacked->m_data = unpacked->m_unpacked.data();
+	unpacked->m_size = unpacked->m_unpacked.size();
+	return unpacked;
+} // open
+
+
+ImageCache::ImageCache(size_t unpackedBytes)
+	: m_unpackedBytes(0), m_unpackedLimit(unpackedBytes)
+{}
+
+
+std::shared_ptr<const MappedFile> ImageCache::get(const std::string& path)
+{
+	auto it = m_files.find(path);
+	if(it != m_files.end()) {
+		if(it->second->unpacked())
+			m_unpacked.splice(m_unpacked.begin(), m_unpacked, std::find(m_unpacked.begin(), m_unpacked.end(), path));
+		return it->second;
+	}
+
+	std::shared_ptr<const MappedFile> file = MappedFile::open(path);
+	if(file) {
+		m_files[path] = file;
+		if(file->unpacked()) {
+			m_unpacked.push_front(path);
+			m_unpackedBytes += file->size();
+			trim();
+		}
+	}
+	return file;
+} // get
+
+
+void ImageCache::evict(const std::string& path)
+{
+	auto it = m_files.find(path);
+	if(it == m_files.end())
+		return;
+	if(it->second->unpacked()) {
+		m_unpacked.remove(path);
+		m_unpackedBytes -= it->second->size();
+	}
+	m_files.erase(it);
+} // evict
+
+
+void ImageCache::setUnpackedLimit(size_t bytes)
+{
+	m_unpackedLimit = bytes;
+	trim();
+} // setUnpackedLimit
+
+
+// Least recently used unpacked archives out until under the limit, keeping the one just unpacked
+void ImageCache::trim()
+{
+	while(m_unpackedBytes > m_unpackedLimit and m_unpacked.size() > 1)
+		evict(m_unpacked.back());
+} // trim
@@ -0,0 +1,71 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A file mapped read-only into memory, unmapped when the last user lets go of it. An archive (archive.h) is
+// unpacked instead, its image held in memory.
+class MappedFile
+{
+public:
+	~MappedFile();
+
+	// Null when the file cannot be opened or mapped, or is an archive without an image.
+	static std::shared_ptr<const MappedFile> open(const std::string& path);
+
+	const uint8_t* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	const std::string& path() const { return m_path; }
+
+	// The image's file name, which gives its type: the path, or for an archive the image in it
+	const std::string& name() const { return m_name; }
+	bool unpacked() const { return not m_unpacked.empty(); }
+
+private:
+	MappedFile(const std::string& path, const uint8_t* data, size_t size);
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::string m_path;
+	std::string m_name;
+	const uint8_t* m_data;
+	size_t m_size;
+	std::vector<uint8_t> m_unpacked;
+};
+
+// Images shared by all links. Each file is mapped once, however many links have it mounted. Unpacked archives take
+// real memory rather than page cache, so only the most recently used are kept, up to a limit in bytes; links that
+// have one mounted keep it until they let go. Not thread safe, the server runs all links from one thread.
+class ImageCache
+{
+public:
+	static const size_t DEFAULT_UNPACKED_BYTES = 64 << 20;
+
+	explicit ImageCache(size_t unpackedBytes = DEFAULT_UNPACKED_BYTES);
+
+	std::shared_ptr<const MappedFile> get(const std::string& path);
+
+	// Drop the cache's reference, the mapping goes once no link uses it.
+	void evict(const std::string& path);
+
+	void setUnpackedLimit(size_t bytes);
+
+	size_t size() const { return m_files.size(); }
+	size_t unpackedBytes() const { return m_unpackedBytes; }
+
+private:
+	void trim();
+
+	std::map<std::string, std::shared_ptr<const MappedFile>> m_files;
+	std::list<std::string> m_unpacked;  // paths of unpacked archives, most recently used first
+	size_t m_unpackedBytes;
+	size_t m_unpackedLimit;
+};
+
+#endif
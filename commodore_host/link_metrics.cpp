@@ -0,0 +1,138 @@
+#include <cstdio>
+#include "link_metrics.h"
+
+namespace {
+
+const uint64_t LINEAR_LIMIT = 2u << LatencyHistogram::SUB_BITS;  // values below are a bucket each
+const int FIRST_EXPORTED_EXPONENT = 4;   // 16 us, below the resolution of any serial link
+const int LAST_EXPORTED_EXPONENT = 26;   // 67 s
+
+const char* const STAGE_NAMES[LinkMetrics::STAGES] = { "host", "wait" };
+
+
+int highBit(uint64_t value)
+{
+	return 63 - __builtin_clzll(value);
+} // highBit
+
+
+// Label values may not hold '"', '\' or line ends unescaped
+std::string labelValue(const std::string& text)
+{
+	std::string value;
+	for(char c : text) {
+		if(c == '"' or c == '\\')
+			value += '\\';
+		value += c == '\n' ? 'n' : c;
+	}
+	return value;
+} // labelValue
+
+} // unnamed namespace
+
+
+LatencyHistogram::LatencyHistogram()
+	: m_buckets(), m_count(0), m_sum(0)
+{}
+
+
+size_t LatencyHistogram::bucketIndex(uint64_t micros)
+{
+	if(micros < LINEAR_LIMIT)
+		return size_t(micros);
+
+	int exponent = highBit(micros);
+	if(exponent > MAX_EXPONENT)
+		return BUCKETS - 1;
+	size_t sub = (micros >> (exponent - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+	return LINEAR_LIMIT + size_t(exponent - SUB_BITS - 1) * (1u << SUB_BITS) + sub;
+} // bucketIndex
+
+
+uint64_t LatencyHistogram::bucketLimit(size_t i)
+{
+	if(i < LINEAR_LIMIT)
+		return i;
+
+	int exponent = int((i - LINEAR_LIMIT) >> SUB_BITS) + SUB_BITS + 1;
+	uint64_t sub = (i - LINEAR_LIMIT) & ((1u << SUB_BITS) - 1);
+	uint64_t width = uint64_t(1) << (exponent - SUB_BITS);
+	return (((uint64_t(1) << SUB_BITS) + sub) << (exponent - SUB_BITS)) + width - 1;
+} // bucketLimit
+
+
+void LatencyHistogram::record(uint64_t micros)
+{
+	m_buckets[bucketIndex(micros)]++;
+	m_count++;
+	m_sum += micros;
+} // record
+
+
+uint64_t LatencyHistogram::percentile(double q) const
+{
+	uint64_t wanted = uint64_t(q * m_count + 0.5);
+	uint64_t seen = 0;
+	for(size_t i = 0; i < BUCKETS; i++) {
+		seen += m_buckets[i];
+		if(seen and seen >= wanted)
+			return bucketLimit(i);
+	}
+	return 0;
+} // percentile
+
+
+uint64_t LatencyHistogram::countBelow(uint64_t micros) const
+{
+	uint64_t below = 0;
+	for(size_t i = 0; i < BUCKETS and bucketLimit(i) < micros; i++)
+		below += m_buckets[i];
+	return below;
+} // countBelow
+
+
+std::string LinkMetrics::exposition(const std::vector<std::pair<std::string, const LinkMetrics*>>& links)
+{
+	std::string latency = "# HELP commodroid_latency_seconds Host time to answer a request (stage host), or time "
+		"from the last reply to a request that carries on a stream (stage wait).\n"
+		"# TYPE commodroid_latency_seconds histogram\n";
+	std::string counters = "# HELP commodroid_requests_total Requests from the Arduino.\n"
+		"# TYPE commodroid_requests_total counter\n";
+	std::string bytes = "# HELP commodroid_bytes_total Bytes of the requests (in) and of their replies (out).\n"
+		"# TYPE commodroid_bytes_total counter\n";
+	char line[256];
+
+	for(const auto& link : links)
+		for(const auto& entry : link.second->series()) {
+			char request[2] = { entry.first.first, 0 };
+			std::string labels = "link=\"" + labelValue(link.first) + "\",request=\"" + labelValue(request)
+				+ "\",format=\"" + labelValue(entry.first.second) + '"';
+			const Series& series = entry.second;
+
+			for(int stage = 0; stage < STAGES; stage++) {
+				const LatencyHistogram& histogram = series.latency[stage];
+				if(histogram.count() == 0)
+					continue;
+				std::string stageLabels = labels + ",stage=\"" + STAGE_NAMES[stage] + '"';
+				for(int exponent = FIRST_EXPORTED_EXPONENT; exponent <= LAST_EXPORTED_EXPONENT; exponent++) {
+					uint64_t limit = uint64_t(1) << exponent;
+					std::snprintf(line, sizeof(line), ",le=\"%g\"} %llu\n", limit / 1e6,
+						(unsigned long long)histogram.countBelow(limit));
+					latency += "commodroid_latency_seconds_bucket{" + stageLabels + line;
+				}
+				std::snprintf(line, sizeof(line), ",le=\"+Inf\"} %llu\n", (unsigned long long)histogram.count());
+				latency += "commodroid_latency_seconds_bucket{" + stageLabels + line;
+				std::snprintf(line, sizeof(line), "} %.6f\n", histogram.sum() / 1e6);
+				latency += "commodroid_latency_seconds_sum{" + stageLabels + line;
+				std::snprintf(line, sizeof(line), "} %llu\n", (unsigned long long)histogram.count());
+				latency += "commodroid_latency_seconds_count{" + stageLabels + line;
+			}
+
+			counters += "commodroid_requests_total{" + labels + "} " + std::to_string(series.requests) + '\n';
+			bytes += "commodroid_bytes_total{" + labels + ",direction=\"in\"} " + std::to_string(series.bytesIn) + '\n';
+			bytes += "commodroid_bytes_total{" + labels + ",direction=\"out\"} " + std::to_string(series.bytesOut)
+				+ '\n';
+		}
+
+	return latency + counters + bytes;
+} // exposition
@@ -0,0 +1,74 @@
+#ifndef LINK_METRICS_H
+#define LINK_METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Microseconds in buckets of 1/8 of a power of two, as an HDR histogram with 3 significant bits: within 12.5% from a
+// microsecond to hours, in a fixed array, so recording is a few instructions and no allocation.
+class LatencyHistogram
+{
+public:
+	static const int SUB_BITS = 3;
+	static const int MAX_EXPONENT = 35;  // about 9.5 hours, longer times go in the last bucket
+	static const size_t BUCKETS = (2u << SUB_BITS) + (MAX_EXPONENT - SUB_BITS) * (1u << SUB_BITS);
+
+	LatencyHistogram();
+
+	void record(uint64_t micros);
+
+	uint64_t count() const { return m_count; }
+	uint64_t sum() const { return m_sum; }
+	uint64_t bucket(size_t i) const { return m_buckets[i]; }
+
+	// Largest value of bucket i, and the value q (0 to 1) of the recorded ones are at or below, to bucket precision
+	static uint64_t bucketLimit(size_t i);
+	uint64_t percentile(double q) const;
+
+	// Recorded values below micros, exact at powers of two
+	uint64_t countBelow(uint64_t micros) const;
+
+private:
+	static size_t bucketIndex(uint64_t micros);
+
+	uint64_t m_buckets[BUCKETS];
+	uint64_t m_count;
+	uint64_t m_sum;
+};
+
+// What one link's requests cost, per request type and the format of the image they were for. HOST is the time from
+// a request arriving to its reply being ready; WAIT the time from the last reply to a request that carries on a
+// stream ('R', 'L', 'G'), the round trip through the link, the Arduino and the bus. Not thread safe.
+class LinkMetrics
+{
+public:
+	enum Stage {
+		HOST,
+		WAIT,
+		STAGES
+	};
+
+	struct Series {
+		LatencyHistogram latency[STAGES];
+		uint64_t requests = 0;
+		uint64_t bytesIn = 0;   // of the requests
+		uint64_t bytesOut = 0;  // of their replies
+	};
+
+	typedef std::pair<char, std::string> Key;  // request type, image format
+
+	Series& series(char request, const std::string& format) { return m_series[Key(request, format)]; }
+	const std::map<Key, Series>& series() const { return m_series; }
+
+	// Prometheus text format of the links' metrics, by link name. Buckets at powers of two of microseconds.
+	static std::string exposition(const std::vector<std::pair<std::string, const LinkMetrics*>>& links);
+
+private:
+	std::map<Key, Series> m_series;
+};
+
+#endif
@@ -0,0 +1,1153 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "d64_writer.h"
+#include "host_protocol.h"
+#include "link_session.h"
+#include "log_events.h"
+
+using namespace HostProtocol;
+
+namespace {
+
+// DOS status codes sent with 'X', see CBM::DOSStatus
+enum {
+	DOS_OK = 0,
+	DOS_WRITE_PROTECT_ON = 26,
+	DOS_SYNTAX_ERROR = 30,
+	DOS_RECORD_NOT_PRESENT = 50,
+	DOS_FILE_NOT_FOUND = 62,
+	DOS_FILE_TYPE_MISMATCH = 64,
+	DOS_ILLEGAL_TRACK_SECTOR = 66,
+	DOS_DRIVE_NOT_READY = 74,
+	EXCEL_NOT_FOUND = '1'  // what the Excel host sends, "X1"
+};
+
+// Most drive trace bytes per 'T' frame, and how much drive time M-E code may run before the trace is cut off
+const size_t TRACE_FRAME_BYTES = BLOCK_BYTES;
+const uint64_t TRACE_SLICE_CYCLES = 20000;
+const uint64_t TRACE_MAX_CYCLES = 60 * uint64_t(Drive1541::CLOCK_HZ);
+
+// Frames kept for resending, the Arduino has at most two in flight
+const size_t FRAMES_KEPT = 2;
+
+// Format strings of the sketch's events, by event number
+#define LOG_EVENT_FORMAT(name, format) format,
+const char* const EVENT_FORMATS[] = { LOG_EVENTS(LOG_EVENT_FORMAT) };
+#undef LOG_EVENT_FORMAT
+
+// M-R of the drive number at $e5c4 / $e5c6 in the 1541 ROM, answered the same way as the Excel host (Bruce Lee 2)
+const uint8_t DRIVE_NUMBER_BYTES[] = { 52, 177 };
+
+bool startsWith(const std::vector<uint8_t>& data, const char* text)
+{
+	size_t len = std::strlen(text);
+	return data.size() >= len and std::memcmp(data.data(), text, len) == 0;
+} // startsWith
+
+
+// File name with CR / LF removed and surrounding spaces trimmed
+std::string fileName(const std::vector<uint8_t>& name)
+{
+	std::string text;
+	for(uint8_t c : name)
+		if(c != '\r' and c != '\n')
+			text += char(c);
+
+	size_t first = text.find_first_not_of(' ');
+	if(first == std::string::npos)
+		return "";
+	return text.substr(first, text.find_last_not_of(' ') - first + 1);
+} // fileName
+
+
+// Last four characters in upper case
+std::string extension(const std::string& name)
+{
+	std::string ext = name.size() >= 4 ? name.substr(name.size() - 4) : "";
+	for(char& c : ext)
+		c = std::toupper(static_cast<unsigned char>(c));
+	return ext;
+} // extension
+
+
+// A name that picks an image from the media folder rather than a file on the mounted one, as the Excel host
+// does: "GAME.D64", or "GAM.*" for the first image starting GAM. Archives are picked by their own name too.
+bool selectsImage(const std::string& name)
+{
+	if(name.empty() or name[0] == '$' or name[0] == '*')
+		return false;
+
+	return Catalog::isImageName(name) or name.find(".*") != std::string::npos;
+} // selectsImage
+
+
+// Microseconds from start to end, 0 when end is not after start
+uint64_t micros(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	return end > start ? uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()) : 0;
+} // micros
+
+
+// The configuration with the mode flags other flags need added: record access positions open data channels.
+LinkConfig impliedModes(LinkConfig config)
+{
+	if(config.mode & MODE_RECORDS)
+		config.mode |= MODE_CHANNELS;
+	return config;
+} // impliedModes
+
+
+// Bytes of trace from pos for the next 'T' frame, at most TRACE_FRAME_BYTES. The frame ends just after the last WAIT
+// that fits, so the Arduino waits for the next frame while the drive waits for the Commodore, not in the middle of
+// timed line changes. Only a stretch with no WAIT in it is cut wherever the frame is full.
+size_t traceFrameLength(const std::vector<uint8_t>& trace, size_t pos)
+{
+	size_t limit = std::min(TRACE_FRAME_BYTES, trace.size() - pos);
+	size_t afterWait = 0;
+
+	for(size_t i = 0; i < limit; i++) {
+		uint8_t op = trace[pos + i];
+		if(op == DriveTrace::OP_DELAY_LONG)
+			i++;  // its count byte
+		else if((op & 0xC0) == DriveTrace::OP_WAIT)
+			afterWait = i + 1;
+	}
+	return afterWait ? afterWait : limit;
+} // traceFrameLength
+
+} // unnamed namespace
+
+
+LinkSession::LinkSession(const LinkConfig& config, ImageCache& cache, ReadAhead& readAhead, StreamCache& streams)
+	: m_config(impliedModes(config)), m_cache(cache), m_readAhead(readAhead), m_streams(streams), m_state(WAIT_READY), m_seq(0)
+	, m_dirPos(0), m_sniffRate(0), m_sniffLast(0), m_sniffWraps(0)
+{}
+
+
+void LinkSession::receive(const uint8_t* data, size_t len)
+{
+	const Clock::time_point arrived = Clock::now();
+	m_stats.bytesIn += len;
+	m_in.insert(m_in.end(), data, data + len);
+
+	size_t used = 0;
+	while(used < m_in.size()) {
+		if(m_state != READY) {
+			handshake();
+			if(m_state != READY)
+				return;
+			used = 0;
+			continue;
+		}
+
+		// An Arduino that was reset starts over with the handshake
+		if(m_in[used] == '<') {
+			size_t tokenLen = std::strlen(HANDSHAKE_READY);
+			size_t have = std::min(tokenLen, m_in.size() - used);
+			if(std::memcmp(&m_in[used], HANDSHAKE_READY, have) == 0) {
+				if(have < tokenLen)
+					break;
+				m_in.erase(m_in.begin(), m_in.begin() + used);
+				m_state = WAIT_READY;
+				log("link reset by the Arduino");
+				continue;
+			}
+		}
+
+		m_in.erase(m_in.begin(), m_in.begin() + used);
+		uint8_t request = m_in[0];
+		size_t replied = m_out.size();
+		used = handleFrame();
+		if(used == 0)  // incomplete frame, wait for more
+			return;
+		measure(request, used, m_out.size() - replied, arrived);
+	}
+
+	m_in.erase(m_in.begin(), m_in.begin() + std::min(used, m_in.size()));
+} // receive
+
+
+// Answer "<CON>" with the mode, devices and pins, then wait for "<END>".
+void LinkSession::handshake()
+{
+	std::string text(m_in.begin(), m_in.end());
+	size_t ready = text.find(HANDSHAKE_READY);
+	size_t ok = text.find(HANDSHAKE_OK);
+
+	if(ready != std::string::npos and (m_state == WAIT_READY or ready > ok or ok == std::string::npos)) {
+		// A single device goes by its number, several by a mask (bit 8 for device 8)
+		unsigned devices = 0;
+		for(const auto& image : m_config.images)
+			if(image.first >= FIRST_DEVICE and image.first <= LAST_DEVICE)
+				devices |= 1u << image.first;
+		if(m_config.images.size() == 1)
+			devices = m_config.images.begin()->first;
+		else if(devices == 0)
+			devices = FIRST_DEVICE;
+
+		std::string reply = std::string(HANDSHAKE_SEND) + std::to_string(m_config.mode) + '|' + std::to_string(devices)
+			+ '|' + m_config.pins + '\r';
+		m_out.insert(m_out.end(), reply.begin(), reply.end());
+		m_stats.bytesOut += reply.size();
+		m_state = WAIT_OK;
+		m_in.erase(m_in.begin(), m_in.begin() + ready + std::strlen(HANDSHAKE_READY));
+	}
+	else if(m_state == WAIT_OK and ok != std::string::npos) {
+		// Requests may follow straight after the handshake in the same read
+		m_state = READY;
+		m_in.erase(m_in.begin(), m_in.begin() + ok + std::strlen(HANDSHAKE_OK));
+		m_mounts.clear();
+		m_media.clear();
+		m_drives.clear();
+		m_channels.clear();
+		m_stream = Stream();
+		m_run = DriveRun();
+		m_lastLoad = Load();
+		m_staged = Load();
+		m_save = Save();
+		m_sniffRate = m_sniffLast = 0;
+		m_sniffWraps = 0;
+		m_replied = Clock::time_point();
+		log("connected");
+	}
+	else if(m_in.size() > 256)  // noise, keep only enough to find a token split across reads
+		m_in.erase(m_in.begin(), m_in.end() - 8);
+} // handshake
+
+
+// Time the requests that are answered, from when their bytes arrived. Frames that came in the same read count the
+// ones handled before them, as the Arduino waited for those too. A request that came in the same read as the reply
+// before it was sent ahead of that reply, it did not wait for it.
+void LinkSession::measure(uint8_t request, size_t in, size_t out, Clock::time_point arrived)
+{
+	switch(request) {
+		case REQ_OPEN: case REQ_READ: case REQ_LIST: case REQ_GET: case REQ_POSITION: case REQ_SECTOR:
+		case REQ_WRITE_SECTOR: case REQ_WRITE: case REQ_WRITE_LAST:
+			break;
+		default:
+			return;
+	}
+
+	LinkMetrics::Series& series = m_metrics.series(char(request), m_format);
+	series.requests++;
+	series.bytesIn += in;
+	series.bytesOut += out;
+
+	bool carriesOn = request == REQ_READ or request == REQ_LIST or request == REQ_GET;
+	if(carriesOn and m_replied != Clock::time_point() and arrived >= m_replied)
+		series.latency[LinkMetrics::WAIT].record(micros(m_replied, arrived));
+	if(out) {
+		m_replied = Clock::now();
+		series.latency[LinkMetrics::HOST].record(micros(arrived, m_replied));
+	}
+} // measure
+
+
+// Handle the frame at the start of m_in, returns the bytes it used or 0 when it is not all there yet.
+size_t LinkSession::handleFrame()
+{
+	const bool framed = m_config.mode & MODE_FRAMED;
+	const size_t have = m_in.size();
+	const uint8_t* in = m_in.data();
+
+	switch(in[0]) {
+		case REQ_OPEN: {
+			if(have < 2 or have < in[1])
+				return 0;
+			if(in[1] < 3)
+				return 1;
+			m_seq = 0;
+			size_t len = in[1];
+			handleOpen(in[2], std::vector<uint8_t>(in + 3, in + len));
+			return len;
+		}
+
+		case REQ_READ:
+			if(m_run.drive)
+				sendTrace();
+			else if(m_stream.open)
+				sendBlock(m_stream, BLOCK_BYTES);
+			return 1;
+
+		case REQ_LIST:
+			sendDirLine();
+			return 1;
+
+		case REQ_CLOSE:
+			if(m_config.mode & MODE_CHANNELS) {
+				if(have < 2)
+					return 0;
+				m_channels.erase(in[1]);
+			}
+			// The save channel's close is answered once the file is on disk, so the status read reports it
+			if(m_save.opened and (not (m_config.mode & MODE_CHANNELS) or in[1] == m_save.channel)) {
+				uint8_t result = m_save.active ? commitSave() : m_save.error;
+				m_save = Save();
+				if(framed and result)
+					sendError(result);
+				else if(framed)
+					m_out.push_back(REP_ACK), m_stats.bytesOut++;
+			}
+			// The Commodore is busy with what it loaded, time to read the next part of a multi-load
+			stageNextLoad();
+			return m_config.mode & MODE_CHANNELS ? 2 : 1;
+
+		case REQ_GET:
+			if(have < 3)
+				return 0;
+			m_seq = 0;
+			handleGet(in[1], in[2]);
+			return 3;
+
+		case REQ_POSITION:
+			if(have < 6)
+				return 0;
+			m_seq = 0;
+			handlePosition(in[1], uint16_t(in[2] | (in[3] << 8)), in[4], in[5]);
+			return 6;
+
+		case REQ_SECTOR:
+			if(have < 4)
+				return 0;
+			m_seq = 0;
+			handleSector(in[1], in[2], in[3]);
+			return 4;
+
+		case REQ_WRITE_SECTOR: {
+			size_t len = 4 + SECTOR_BYTES + (framed ? 3 : 0);
+			if(have < len)
+				return 0;
+			handleWriteSector(in, len);
+			return len;
+		}
+
+		case REQ_WRITE:
+		case REQ_WRITE_LAST: {
+			if(have < 2)
+				return 0;
+			size_t len = in[1] + (framed ? 2 : 0);
+			if(len < 2)
+				return 1;
+			if(have < len)
+				return 0;
+			handleWrite(in, len);
+			return len;
+		}
+
+		case REQ_NAK:
+			if(have < 2)
+				return 0;
+			resendFrom(in[1]);
+			return 2;
+
+		case REQ_DEBUG: {
+			const uint8_t* end = static_cast<const uint8_t*>(std::memchr(in, '\r', have));
+			if(end == nullptr)
+				return have > 512 ? have : 0;
+			log("debug: " + std::string(in + 1, end));
+			return end - in + 1;
+		}
+
+		case REQ_EVENTS: {
+			if(have < 2)
+				return 0;
+			size_t len = 2 + in[1] * LOG_RECORD_BYTES;
+			if(have < len)
+				return 0;
+			for(const uint8_t* rec = in + 2; rec < in + len; rec += LOG_RECORD_BYTES)
+				logEvent(rec);
+			return len;
+		}
+
+		case REQ_SNIFF:
+			if(have < 7)
+				return 0;
+			sniffed(in);
+			return 7;
+
+		case REQ_ERROR:
+			log("error reported by the Arduino");
+			return 1;
+
+		default:  // line ends and noise
+			return 1;
+	}
+} // handleFrame
+
+
+// 'O': files on channels 0, 2 and 8 are read from the start of the reply, like the Excel host, or all data channels
+// when they are pulled with 'G'. "$" is the directory. Channel 15 carries commands.
+void LinkSession::handleOpen(uint8_t channel, const std::vector<uint8_t>& rawName)
+{
+	uint8_t device = channelDevice(channel);
+	uint8_t chan = channelNumber(channel);
+	std::string name = fileName(rawName);
+
+	m_stats.opens++;
+	m_format = imageFormat(device);
+	m_run = DriveRun();
+
+	// Picking an image mounts it on the device and loads its first program
+	if(m_config.catalog and chan != CHANNEL_COMMAND and selectsImage(name)) {
+		size_t wild = name.find(".*");
+		const Catalog::Image* image = m_config.catalog->find(wild == std::string::npos ? name
+			: name.substr(0, wild) + '*');
+		if(image == nullptr) {
+			sendError(EXCEL_NOT_FOUND);
+			return;
+		}
+		m_mounts[device] = m_config.catalog->path(*image);
+		m_media.erase(device);
+		m_drives.erase(device);
+		name = "*";
+		m_format = imageFormat(device);
+		log("mounted " + image->name);
+	}
+
+	if(chan == CHANNEL_COMMAND) {
+		handleCommand(device, rawName);
+		return;
+	}
+	if(name.empty())
+		return;
+	if(chan == CHANNEL_SAVE) {
+		openSave(channel, name);
+		return;
+	}
+
+	Media* disk = media(device);
+	bool pulled = (m_config.mode & MODE_CHANNELS) and chan > CHANNEL_SAVE;
+	if(pulled) {
+		Stream& stream = m_channels[channel];
+		stream = Stream();
+		stream.open = disk and disk->readFile(name, stream.data);
+		// A relative file starts before its first record, the first 'G' moves on to it
+		if(not stream.open and disk and (m_config.mode & MODE_RECORDS))
+			stream.open = disk->openRecords(name, stream.records);
+		return;
+	}
+
+	if(chan != CHANNEL_LOAD and chan != 2 and chan != 8) {
+		sendError(EXCEL_NOT_FOUND);
+		return;
+	}
+	if(disk == nullptr) {
+		sendError(DOS_DRIVE_NOT_READY);
+		return;
+	}
+
+	const Catalog::Image* image = catalogImage(device);
+	if(name[0] == '$') {
+		std::string key = m_streams.key(disk->file(), StreamCache::LISTING, m_config.mode & MODE_FRAMED, "");
+		m_dir = m_streams.find(key);
+		if(not m_dir)
+			m_streams.insert(key, m_dir = frameListing(device, *disk));
+		m_dirPos = 0;
+		sendFrame(REP_LINE, 0, nullptr, 0);
+		return;
+	}
+
+	// The catalog knows every name on a disk or tape image, a plain name that is not there needs no search. A PRG
+	// file loads whatever the name.
+	bool plain = name.find_first_of("*,") == std::string::npos;
+	if(image and plain and not disk->anyName() and m_config.catalog->file(*image, name) == nullptr) {
+		sendError(EXCEL_NOT_FOUND);
+		return;
+	}
+
+	if(not loadFile(device, *disk, name)) {
+		sendError(EXCEL_NOT_FOUND);
+		return;
+	}
+	sendBlock(m_stream, BLOCK_BYTES);
+} // handleOpen
+
+
+// Open name for 'R', from the file read ahead if it is the one. Every load is recorded for the read-ahead.
+bool LinkSession::loadFile(uint8_t device, Media& disk, const std::string& name)
+{
+	std::string image = imagePath(device);
+	bool sameImage = m_lastLoad.device == device and m_lastLoad.image == image;
+	m_readAhead.record(image, sameImage ? m_lastLoad.name : "", name);
+
+	m_stream = Stream();
+	if(not m_staged.image.empty()) {
+		bool hit = m_staged.device == device and m_staged.image == image and m_staged.name == name;
+		(hit ? m_stats.stagedHits : m_stats.stagedMisses)++;
+		(hit ? m_readAhead.stats().hits : m_readAhead.stats().misses)++;
+		if(hit)
+			m_stream.data.swap(m_staged.data);
+		m_staged = Load();
+	}
+
+	// The frames of a file loaded before, on any link, go out as they are
+	std::string key = m_streams.key(disk.file(), StreamCache::FILE_BLOCKS, m_config.mode & MODE_FRAMED, name);
+	if(m_stream.data.empty())
+		m_stream.frames = m_streams.find(key);
+	if(not m_stream.frames) {
+		if(m_stream.data.empty() and not disk.readFile(name, m_stream.data))
+			return false;
+		m_streams.insert(key, m_stream.frames = frameFile(m_stream.data));
+		m_stream.data.clear();
+	}
+
+	m_lastLoad.device = device;
+	m_lastLoad.image = image;
+	m_lastLoad.name = name;
+	m_stream.open = true;
+	return true;
+} // loadFile
+
+
+// Read the file that usually follows the last load into memory, so its first block goes out without a search.
+void LinkSession::stageNextLoad()
+{
+	if(m_lastLoad.image.empty() or not m_staged.image.empty())
+		return;
+
+	std::string next = m_readAhead.predict(m_lastLoad.image, m_lastLoad.name);
+	Media* disk = media(m_lastLoad.device);
+	if(next.empty() or disk == nullptr or imagePath(m_lastLoad.device) != m_lastLoad.image)
+		return;
+
+	Load staged;
+	staged.device = m_lastLoad.device;
+	staged.image = m_lastLoad.image;
+	staged.name = next;
+	if(disk->readFile(next, staged.data)) {
+		m_staged = std::move(staged);
+		m_readAhead.stats().staged++;
+	}
+} // stageNextLoad
+
+
+// Open on CHANNEL_SAVE: "@0:NAME,P,W" and the like. Only D64 images take files, the rest are answered with write
+// protect on. The 'W' frames are only collected, the image is read again and written on the close.
+void LinkSession::openSave(uint8_t channel, const std::string& spec)
+{
+	uint8_t device = channelDevice(channel);
+	std::string name = spec;
+	m_save = Save();
+	m_save.channel = channel;
+	m_save.opened = true;
+
+	bool replace = not name.empty() and name[0] == '@';
+	if(replace)
+		name.erase(0, 1);
+	size_t colon = name.find(':');
+	if(colon != std::string::npos and colon <= 1)
+		name.erase(0, colon + 1);
+
+	// ",S" / ",P" / ",U" sets the type, ",W" the mode that a save has anyway
+	uint8_t type = D64Writer::PRG;
+	size_t comma = name.find(',');
+	for(size_t i = comma; i != std::string::npos and i + 1 < name.size(); i = name.find(',', i + 1))
+		switch(name[i + 1]) {
+			case 'S': type = D64Writer::SEQ; break;
+			case 'U': type = D64Writer::USR; break;
+			case 'P': type = D64Writer::PRG; break;
+		}
+	if(comma != std::string::npos)
+		name.erase(comma);
+	if(name.empty() or name.size() > 16 or name.find_first_of("*?") != std::string::npos) {
+		refuseSave(DOS_SYNTAX_ERROR, true);
+		return;
+	}
+
+	Media* disk = media(device);
+	std::string path = imagePath(device);
+	std::shared_ptr<const MappedFile> file = disk and disk->disk() ? m_cache.get(path) : nullptr;
+	if(not file or file->unpacked()) {  // an image in an archive is only ever read
+		refuseSave(disk ? DOS_WRITE_PROTECT_ON : DOS_DRIVE_NOT_READY, true);
+		return;
+	}
+
+	D64Writer writer(file->data(), file->size());
+	if(not writer.valid()) {
+		refuseSave(DOS_WRITE_PROTECT_ON, true);
+		return;
+	}
+	if(not replace and writer.exists(name)) {
+		refuseSave(D64Writer::FILE_EXISTS, true);
+		return;
+	}
+
+	m_save.image = path;
+	m_save.name = name;
+	m_save.type = type;
+	m_save.replace = replace;
+	m_save.room = writer.freeBlocks() + (replace ? writer.fileBlocks(name) : 0);
+	m_save.active = true;
+	m_out.push_back(REP_WRITE_READY);
+	m_stats.bytesOut++;
+} // openSave
+
+
+// 'W' / 'w': part of the file being saved. It is acknowledged as soon as it is in memory, the disk is written once
+// on the close. A frame that takes the file past the blocks free is answered with disk full, and the save dropped.
+void LinkSession::handleWrite(const uint8_t* frame, size_t len)
+{
+	const bool framed = m_config.mode & MODE_FRAMED;
+	const size_t header = framed ? 3 : 2;
+
+	if(framed) {
+		uint16_t crc = crc16(frame, len - 2);
+		if(frame[1] < header or frame[len - 2] != (crc >> 8) or frame[len - 1] != (crc & 0xFF)) {
+			m_out.push_back(REP_NAK), m_stats.bytesOut++;
+			return;
+		}
+	}
+
+	if(not m_save.active) {
+		log("save refused, no file open for saving");
+		if(framed)
+			sendError(m_save.error ? m_save.error : uint8_t(DOS_DRIVE_NOT_READY));
+		return;
+	}
+	if(framed and frame[2] == m_save.lastSeq) {
+		m_out.push_back(REP_ACK), m_stats.bytesOut++;
+		return;
+	}
+
+	size_t bytes = frame[1] > header ? frame[1] - header : 0;
+	if(D64Writer::blocksFor(m_save.data.size() + bytes) > m_save.room) {
+		log("save of " + m_save.name + " refused, disk full");
+		refuseSave(D64Writer::DISK_FULL, framed);
+		return;
+	}
+
+	if(framed) {
+		m_out.push_back(REP_ACK), m_stats.bytesOut++;
+		m_save.lastSeq = frame[2];
+	}
+	m_save.data.insert(m_save.data.end(), frame + header, frame + header + bytes);
+} // handleWrite
+
+
+// The save is refused with code, the close reports it again. send is false where the Arduino reads no reply.
+void LinkSession::refuseSave(uint8_t code, bool send)
+{
+	m_save.active = false;
+	m_save.error = code;
+	m_save.data.clear();
+	if(send)
+		sendError(code);
+} // refuseSave
+
+
+// Close of the save channel: add the file to the image as it is now, so a save another link made to it since the
+// open is kept, and write it back. The DOS status of the save, 0 when it is on disk.
+uint8_t LinkSession::commitSave()
+{
+	Save save = std::move(m_save);
+	m_save = Save();
+
+	uint8_t device = channelDevice(save.channel);
+	if(imagePath(device) != save.image) {
+		log("save of " + save.name + " dropped, the image was changed");
+		return DOS_DRIVE_NOT_READY;
+	}
+
+	std::shared_ptr<const MappedFile> file = MappedFile::open(save.image);
+	std::unique_ptr<D64Writer> disk(file ? new D64Writer(file->data(), file->size()) : nullptr);
+	file.reset();
+	if(not disk or not disk->valid()) {
+		log("save of " + save.name + " dropped, cannot read " + save.image);
+		return DOS_DRIVE_NOT_READY;
+	}
+
+	D64Writer::Result result = disk->addFile(save.name, save.type, save.data, save.replace);
+	if(result != D64Writer::SAVED) {
+		log("save of " + save.name + " failed: " + (result == D64Writer::DISK_FULL ? "disk full" : "file exists"));
+		return uint8_t(result);
+	}
+	if(not disk->writeTo(save.image)) {
+		int error = errno;
+		log("cannot write " + save.image + ": " + std::strerror(error));
+		return error == ENOSPC ? uint8_t(D64Writer::DISK_FULL) : uint8_t(DOS_WRITE_PROTECT_ON);
+	}
+
+	imageWritten(device, save.image);
+	m_stats.saves++;
+	log("saved " + save.name + ", " + std::to_string(save.data.size()) + " bytes to " + save.image);
+	return DOS_OK;
+} // commitSave
+
+
+// 'Y': a sector from U2 / B-W, written into the image the same way as a save, through a copy of the image as it is
+// now. In framed mode it is answered with 'A', or 'X' and a DOS status code.
+void LinkSession::handleWriteSector(const uint8_t* frame, size_t len)
+{
+	const bool framed = m_config.mode & MODE_FRAMED;
+	const size_t header = framed ? 5 : 4;
+	uint8_t device = channelDevice(frame[1]);
+	uint8_t track = frame[2], sector = frame[3];
+
+	if(framed) {
+		uint16_t crc = crc16(frame, len - 2);
+		if(frame[len - 2] != (crc >> 8) or frame[len - 1] != (crc & 0xFF)) {
+			m_out.push_back(REP_NAK), m_stats.bytesOut++;
+			return;
+		}
+	}
+
+	m_format = imageFormat(device);
+	Media* disk = media(device);
+	std::string path = imagePath(device);
+	std::shared_ptr<const MappedFile> file = disk and disk->disk() ? MappedFile::open(path) : nullptr;
+	uint8_t result = DOS_OK;
+	if(not file or file->unpacked())  // an image in an archive is only ever read
+		result = disk ? DOS_WRITE_PROTECT_ON : DOS_DRIVE_NOT_READY;
+	else {
+		D64Writer writer(file->data(), file->size());
+		file.reset();
+		if(not writer.valid())
+			result = DOS_WRITE_PROTECT_ON;
+		else if(not writer.writeSector(track, sector, frame + header))
+			result = DOS_ILLEGAL_TRACK_SECTOR;
+		else if(not writer.writeTo(path)) {
+			int error = errno;
+			log("cannot write " + path + ": " + std::strerror(error));
+			result = error == ENOSPC ? uint8_t(D64Writer::DISK_FULL) : uint8_t(DOS_WRITE_PROTECT_ON);
+		}
+		else
+			imageWritten(device, path);
+	}
+
+	if(result)
+		log("sector write to " + std::to_string(track) + "/" + std::to_string(sector) + " refused: " +
+			std::to_string(result));
+	if(framed and result)
+		sendError(result);
+	else if(framed)
+		m_out.push_back(REP_ACK), m_stats.bytesOut++;
+} // handleWriteSector
+
+
+// The image at path was written, the next access to the device maps it again
+void LinkSession::imageWritten(uint8_t device, const std::string& path)
+{
+	m_cache.evict(path);
+	m_media.erase(device);
+	m_drives.erase(device);
+	m_staged = Load();
+} // imageWritten
+
+
+// Command channel: drive memory commands go to the drive emulation, the rest is answered as the Excel host does.
+void LinkSession::handleCommand(uint8_t device, const std::vector<uint8_t>& cmd)
+{
+	const bool driveCode = m_config.mode & MODE_DRIVE_CODE;
+
+	if(startsWith(cmd, "M-R") and cmd.size() >= 5) {
+		uint16_t addr = cmd[3] | (cmd[4] << 8);
+		if((addr == 0xE5C4 or addr == 0xE5C6) and cmd.size() >= 6 and cmd[5] == 4) {
+			sendFrame(REP_BLOCK_LAST, sizeof(DRIVE_NUMBER_BYTES), DRIVE_NUMBER_BYTES, sizeof(DRIVE_NUMBER_BYTES));
+			return;
+		}
+		if(driveCode and addr < Drive1541::RAM_SIZE) {
+			uint8_t count = cmd.size() >= 6 and cmd[5] ? cmd[5] : 1;
+			std::vector<uint8_t> bytes;
+			for(uint8_t i = 0; i < count; i++)
+				bytes.push_back(drive(device).memoryRead(uint16_t(addr + i)));
+			sendFrame(REP_BLOCK_LAST, count, bytes.data(), bytes.size());
+		}
+	}
+	else if(startsWith(cmd, "M-W") and cmd.size() >= 6) {
+		if(driveCode) {
+			uint16_t addr = cmd[3] | (cmd[4] << 8);
+			size_t count = std::min<size_t>(cmd[5], cmd.size() - 6);
+			drive(device).memoryWrite(addr, cmd.data() + 6, count);
+		}
+	}
+	else if(startsWith(cmd, "M-E") and cmd.size() >= 5) {
+		if(driveCode) {
+			uint16_t addr = cmd[3] | (cmd[4] << 8);
+			Drive1541& d = drive(device);
+			d.execute(addr);
+			m_run.drive = &d;
+			log("running drive code at $" + std::to_string(addr));
+			sendTrace();
+		}
+	}
+	else if(startsWith(cmd, "S:"))
+		sendError(EXCEL_NOT_FOUND);
+} // handleCommand
+
+
+// 'G': the next part of a data channel's file.
+void LinkSession::handleGet(uint8_t channel, uint8_t maxLen)
+{
+	m_format = imageFormat(channelDevice(channel));
+	auto it = m_channels.find(channel);
+	if(it == m_channels.end() or not it->second.open) {
+		sendError(DOS_FILE_NOT_FOUND);
+		return;
+	}
+	Stream& stream = it->second;
+	if(stream.records.recordLength and stream.pos == stream.data.size()
+		and not seekRecord(stream, uint16_t(stream.record + 1), 1)) {
+		sendError(DOS_RECORD_NOT_PRESENT);
+		return;
+	}
+	sendBlock(stream, std::min<size_t>(maxLen, BLOCK_BYTES));
+} // handleGet
+
+
+// 'P': position a relative file's channel on a record, then send from there as 'G' does. Only the record is read,
+// from the image's sectors.
+void LinkSession::handlePosition(uint8_t channel, uint16_t record, uint8_t position, uint8_t maxLen)
+{
+	m_format = imageFormat(channelDevice(channel));
+	auto it = m_channels.find(channel);
+	if(it == m_channels.end() or not it->second.open) {
+		sendError(DOS_FILE_NOT_FOUND);
+		return;
+	}
+
+	Stream& stream = it->second;
+	if(stream.records.recordLength == 0) {
+		sendError(DOS_FILE_TYPE_MISMATCH);
+		return;
+	}
+	if(not seekRecord(stream, record ? record : 1, position ? position : 1)) {
+		sendError(DOS_RECORD_NOT_PRESENT);
+		return;
+	}
+	sendBlock(stream, std::min<size_t>(maxLen, BLOCK_BYTES));
+} // handlePosition
+
+
+bool LinkSession::seekRecord(Stream& stream, uint16_t record, uint8_t position)
+{
+	stream.pos = 0;
+	if(not stream.records.read(record, position, stream.data))
+		return false;
+	stream.record = record;
+	return true;
+} // seekRecord
+
+
+// 'S': a whole sector of the disk on the channel's device.
+void LinkSession::handleSector(uint8_t channel, uint8_t track, uint8_t sector)
+{
+	m_format = imageFormat(channelDevice(channel));
+	Media* disk = media(channelDevice(channel));
+	if(disk == nullptr or disk->disk() == nullptr) {
+		sendError(DOS_DRIVE_NOT_READY);
+		return;
+	}
+
+	const uint8_t* data = disk->disk()->sector(track, sector);
+	if(data == nullptr) {
+		sendError(DOS_ILLEGAL_TRACK_SECTOR);
+		return;
+	}
+	sendFrame(REP_SECTOR, 0, data, SECTOR_BYTES);
+} // handleSector
+
+
+// Next block of a file, 'b' when it holds the end of the file.
+void LinkSession::sendBlock(Stream& stream, size_t maxLen)
+{
+	if(stream.frames) {
+		if(stream.frame < stream.frames->count())
+			sendCached(*stream.frames, stream.frame++);
+		else
+			sendFrame(REP_BLOCK_LAST, 0, nullptr, 0);
+		if(stream.frame >= stream.frames->count())
+			stream.open = m_config.mode & MODE_CHANNELS;
+		return;
+	}
+
+	size_t len = std::min(maxLen, stream.data.size() - stream.pos);
+	bool last = stream.pos + len == stream.data.size();
+
+	sendFrame(last ? REP_BLOCK_LAST : REP_BLOCK, uint8_t(len), stream.data.data() + stream.pos, len);
+	stream.pos += len;
+	if(last)
+		stream.open = m_config.mode & MODE_CHANNELS;  // a channel answers 'G' after the end with an empty 'b'
+} // sendBlock
+
+
+// Next directory line, 'l' for the last one.
+void LinkSession::sendDirLine()
+{
+	if(not m_dir or m_dir->count() == 0) {
+		sendFrame(REP_LINE_LAST, 0, nullptr, 0);
+		return;
+	}
+
+	bool last = m_dirPos + 1 >= m_dir->count();
+	sendCached(*m_dir, m_dirPos);
+	m_dirPos = last ? 0 : m_dirPos + 1;
+} // sendDirLine
+
+
+// Next 'T' frame of the running drive code, run ahead far enough to fill it.
+void LinkSession::sendTrace()
+{
+	Drive1541& d = *m_run.drive;
+	std::vector<uint8_t>& trace = d.trace().bytes;
+
+	while(not m_run.finished and trace.size() - m_run.sent < TRACE_FRAME_BYTES) {
+		Drive1541::RunResult result = d.run(TRACE_SLICE_CYCLES);
+		if(result == Drive1541::RUN_LIMIT and d.cycles() < TRACE_MAX_CYCLES)
+			continue;
+
+		m_run.finished = true;
+		if(result != Drive1541::RUN_FINISHED) {
+			log(result == Drive1541::RUN_JAMMED ? "drive code jammed" : result == Drive1541::RUN_STALLED
+				? "drive code stalled" : "drive code ran too long");
+			d.trace().end();
+		}
+	}
+
+	size_t len = m_run.finished and trace.size() - m_run.sent <= TRACE_FRAME_BYTES ? trace.size() - m_run.sent
+		: traceFrameLength(trace, m_run.sent);
+	bool last = m_run.finished and m_run.sent + len == trace.size();
+	sendFrame(last ? REP_TRACE_LAST : REP_TRACE, uint8_t(len), trace.data() + m_run.sent, len);
+	m_run.sent += len;
+
+	// Drop what has gone out, long running code would otherwise keep it all
+	trace.erase(trace.begin(), trace.begin() + m_run.sent);
+	m_run.sent = 0;
+	if(last)
+		m_run = DriveRun();
+} // sendTrace
+
+
+// A file's 'B' / 'b' frames as sendBlock() sends them after the open, sequence numbers from 0.
+std::shared_ptr<const StreamCache::Frames> LinkSession::frameFile(const std::vector<uint8_t>& data) const
+{
+	std::shared_ptr<StreamCache::Frames> frames(new StreamCache::Frames);
+	size_t pos = 0;
+	do {
+		size_t len = std::min(BLOCK_BYTES, data.size() - pos);
+		bool last = pos + len == data.size();
+		frames->add(buildFrame(last ? REP_BLOCK_LAST : REP_BLOCK, uint8_t(len), uint8_t(frames->count()),
+			data.data() + pos, len));
+		pos += len;
+	} while(pos < data.size());
+	return frames;
+} // frameFile
+
+
+// The 'L' / 'l' frames of a listing, the block count in front of each line's text. They follow the empty 'L' that
+// answers the open, so the sequence numbers start at 1. The catalog has the lines of images in the media folder.
+std::shared_ptr<const StreamCache::Frames> LinkSession::frameListing(uint8_t device, Media& disk) const
+{
+	const Catalog::Image* image = catalogImage(device);
+	Catalog::Lines built;
+	if(image == nullptr)
+		for(const DirLine& line : disk.directory())
+			built.push_back(encodeDirLine(line));
+	const Catalog::Lines& lines = image ? *image->lines : built;
+
+	std::shared_ptr<StreamCache::Frames> frames(new StreamCache::Frames);
+	for(size_t i = 0; i < lines.size(); i++)
+		frames->add(buildFrame(i + 1 == lines.size() ? REP_LINE_LAST : REP_LINE, uint8_t(lines[i].size()),
+			uint8_t(i + 1), lines[i].data(), lines[i].size()));
+	return frames;
+} // frameListing
+
+
+// type arg [seq] data [crc]
+std::vector<uint8_t> LinkSession::buildFrame(uint8_t type, uint8_t arg, uint8_t seq, const uint8_t* data,
+	size_t len) const
+{
+	std::vector<uint8_t> frame = { type, arg };
+	if(m_config.mode & MODE_FRAMED)
+		frame.push_back(seq);
+	frame.insert(frame.end(), data, data + len);
+	if(m_config.mode & MODE_FRAMED) {
+		uint16_t crc = crc16(frame.data(), frame.size());
+		frame.push_back(crc >> 8);
+		frame.push_back(crc & 0xFF);
+	}
+	return frame;
+} // buildFrame
+
+
+void LinkSession::sendFrame(uint8_t type, uint8_t arg, const uint8_t* data, size_t len)
+{
+	std::vector<uint8_t> frame = buildFrame(type, arg, m_seq, data, len);
+	queueFrame(frame.data(), frame.size());
+} // sendFrame
+
+
+// Frame i of a cached stream. It was built for the sequence number it would have after the open, if another frame
+// went out in between it is built again with the right one.
+void LinkSession::sendCached(const StreamCache::Frames& frames, size_t i)
+{
+	const uint8_t* frame = frames.frame(i);
+	size_t len = frames.frameSize(i);
+	if((m_config.mode & MODE_FRAMED) and frame[2] != m_seq) {
+		sendFrame(frame[0], frame[1], frame + 3, len - 5);
+		return;
+	}
+	queueFrame(frame, len);
+	m_streams.stats().bytesServed += len;
+} // sendCached
+
+
+// Send a finished frame. The last frames are kept for a resend after a NAK.
+void LinkSession::queueFrame(const uint8_t* frame, size_t len)
+{
+	if(m_sentFrames.size() == FRAMES_KEPT)
+		m_sentFrames.pop_front();
+	m_sentFrames.emplace_back(frame, frame + len);
+	if(m_config.mode & MODE_FRAMED)
+		m_seq++;
+
+	m_out.insert(m_out.end(), frame, frame + len);
+	m_stats.bytesOut += len;
+	m_stats.frames++;
+} // queueFrame
+
+
+// 'N' seq: the frame with that sequence number and any sent after it, which the Arduino dropped with it. An Arduino
+// that asked for the second block of a load before reading the first can NAK a frame that is not the last.
+void LinkSession::resendFrom(uint8_t seq)
+{
+	size_t first = m_sentFrames.empty() ? 0 : m_sentFrames.size() - 1;
+	for(size_t i = 0; i < m_sentFrames.size(); i++)
+		if(m_sentFrames[i].size() > 2 and m_sentFrames[i][2] == seq) {
+			first = i;
+			break;
+		}
+
+	for(size_t i = first; i < m_sentFrames.size(); i++) {
+		m_out.insert(m_out.end(), m_sentFrames[i].begin(), m_sentFrames[i].end());
+		m_stats.bytesOut += m_sentFrames[i].size();
+		m_stats.resends++;
+	}
+} // resendFrom
+
+
+// 'X' and a DOS status code, never framed
+void LinkSession::sendError(uint8_t code)
+{
+	m_out.push_back(REP_ERROR);
+	m_out.push_back(code);
+	m_stats.bytesOut += 2;
+} // sendError
+
+
+Media* LinkSession::media(uint8_t device)
+{
+	auto it = m_media.find(device);
+	if(it != m_media.end())
+		return it->second.get();
+
+	std::string path = imagePath(device);
+	std::unique_ptr<Media> media;
+	if(not path.empty()) {
+		media = Media::create(m_cache.get(path));
+		if(not media)
+			log("cannot mount " + path);
+	}
+	return (m_media[device] = std::move(media)).get();
+} // media
+
+
+std::string LinkSession::imagePath(uint8_t device) const
+{
+	auto mount = m_mounts.find(device);
+	if(mount != m_mounts.end())
+		return mount->second;
+	auto image = m_config.images.find(device);
+	return image == m_config.images.end() ? "" : image->second;
+} // imagePath
+
+
+// Type of the image on the device for the metrics, "d64", "t64" or "prg" whether packed or not, "none" without one
+std::string LinkSession::imageFormat(uint8_t device)
+{
+	Media* disk = media(device);
+	if(disk == nullptr)
+		return "none";
+	std::string ext = extension(disk->file()->name());
+	for(char& c : ext)
+		c = std::tolower(static_cast<unsigned char>(c));
+	return ext.empty() ? "none" : ext.substr(1);
+} // imageFormat
+
+
+// The catalog's entry for the image on the device, if it is in the media folder
+const Catalog::Image* LinkSession::catalogImage(uint8_t device) const
+{
+	if(m_config.catalog == nullptr)
+		return nullptr;
+
+	std::string path = imagePath(device);
+	size_t slash = path.find_last_of('/');
+	if(slash == std::string::npos or path.substr(0, slash) != m_config.catalog->folder())
+		return nullptr;
+	return m_config.catalog->find(path.substr(slash + 1));
+} // catalogImage
+
+
+Drive1541& LinkSession::drive(uint8_t device)
+{
+	std::unique_ptr<Drive1541>& d = m_drives[device];
+	if(not d) {
+		d.reset(new Drive1541());
+		Media* disk = media(device);
+		d->setImage(disk ? disk->disk() : nullptr);
+	}
+	return *d;
+} // drive
+
+
+// One record of a 'V' frame: event, two arguments and the Arduino's milliseconds, each little endian
+void LinkSession::logEvent(const uint8_t* rec)
+{
+	unsigned a = rec[1] | (rec[2] << 8);
+	unsigned b = rec[3] | (rec[4] << 8);
+	unsigned time = rec[5] | (rec[6] << 8);
+	char text[128];
+
+	if(rec[0] < LOG_EVENT_COUNT)
+		std::snprintf(text, sizeof(text), EVENT_FORMATS[rec[0]], a, b);
+	else
+		std::snprintf(text, sizeof(text), "event %u: %u %u", rec[0], a, b);
+	log("[" + std::to_string(time) + "] " + text);
+} // logEvent
+
+
+// 'Z' frame: a byte the Arduino saw on the bus, or the rate of its timer. The 32 bit times wrap after hours at most.
+void LinkSession::sniffed(const uint8_t* frame)
+{
+	uint32_t time = frame[3] | (frame[4] << 8) | (frame[5] << 16) | (uint32_t(frame[6]) << 24);
+
+	if(frame[1] & SNIFF_CLOCK) {
+		m_sniffRate = time;
+		m_sniffLast = 0;
+		m_sniffWraps = 0;
+		log("sniffing, timer at " + std::to_string(time) + " Hz");
+		return;
+	}
+
+	if(time < m_sniffLast)
+		m_sniffWraps += uint64_t(1) << 32;
+	m_sniffLast = time;
+	m_stats.sniffed++;
+
+	if(m_sniffer) {
+		uint64_t ticks = m_sniffWraps + time;
+		SniffEvent event = { m_sniffRate ? ticks * 1000000 / m_sniffRate : ticks, frame[2],
+			bool(frame[1] & SNIFF_ATN), bool(frame[1] & SNIFF_EOI) };
+		m_sniffer(event);
+	}
+} // sniffed
+
+
+void LinkSession::log(const std::string& text)
+{
+	if(m_log)
+		m_log(text);
+} // log
@@ -0,0 +1,198 @@
+#ifndef LINK_SESSION_H
+#define LINK_SESSION_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "catalog.h"
+#include "drive1541.h"
+#include "image_cache.h"
+#include "link_metrics.h"
+#include "media.h"
+#include "read_ahead.h"
+#include "stream_cache.h"
+
+// What the handshake tells the Arduino, and the image mounted on each device.
+struct LinkConfig
+{
+	uint8_t mode = 0;                        // HostProtocol::Modes
+	std::string pins = "9|18|19|20";         // atn|clock|data|reset, and |srq for C128 burst mode
+	std::map<uint8_t, std::string> images;   // device number, image path
+	const Catalog* catalog = nullptr;        // media folder, for LOAD"NAME.D64" and ready made listings
+};
+
+// Protocol state machine for one Arduino link, the part of the Excel host's PROGRAM_LOADER that answers the
+// Arduino, plus the frames added since. It does no I/O: bytes from the link go into receive(), the replies collect
+// in output() for the caller to write.
+class LinkSession
+{
+public:
+	enum State {
+		WAIT_READY,  // waiting for the Arduino's "<CON>"
+		WAIT_OK,     // handshake sent, waiting for "<END>"
+		READY
+	};
+
+	struct Stats {
+		uint64_t bytesIn = 0;
+		uint64_t bytesOut = 0;
+		uint64_t frames = 0;      // data frames sent
+		uint64_t resends = 0;     // frames sent again after a NAK
+		uint64_t opens = 0;
+		uint64_t stagedHits = 0;    // loads answered from the file read ahead on the last close
+		uint64_t stagedMisses = 0;  // files read ahead for nothing
+		uint64_t sniffed = 0;       // bus bytes in sniffer mode
+		uint64_t saves = 0;         // files written to an image
+	};
+
+	// A byte seen on the bus in sniffer mode (MODE_SNIFF), timed from when the Arduino started sniffing.
+	struct SniffEvent {
+		uint64_t micros;
+		uint8_t data;
+		bool atn;  // a bus command
+		bool eoi;
+	};
+
+	typedef std::function<void(const std::string&)> Logger;
+	typedef std::function<void(const SniffEvent&)> Sniffer;
+
+	LinkSession(const LinkConfig& config, ImageCache& cache, ReadAhead& readAhead, StreamCache& streams);
+
+	void setLogger(Logger logger) { m_log = logger; }
+	void setSniffer(Sniffer sniffer) { m_sniffer = sniffer; }
+
+	void receive(const uint8_t* data, size_t len);
+
+	// Bytes to send to the Arduino, the caller erases what it has written.
+	std::vector<uint8_t>& output() { return m_out; }
+
+	State state() const { return m_state; }
+	const Stats& stats() const { return m_stats; }
+	const LinkMetrics& metrics() const { return m_metrics; }
+
+private:
+	// A file opened for reading and how far it has been sent. A relative file holds one record in data at a time.
+	// A load goes out from its cached frames instead of data.
+	struct Stream {
+		std::vector<uint8_t> data;
+		size_t pos = 0;
+		bool open = false;
+		RecordFile records;
+		uint16_t record = 0;  // in data, 0 before the first
+		std::shared_ptr<const StreamCache::Frames> frames;
+		size_t frame = 0;
+	};
+
+	// The last file loaded, or the one read ahead for the next load
+	struct Load {
+		uint8_t device = 0;
+		std::string image;
+		std::string name;
+		std::vector<uint8_t> data;
+	};
+
+	// A file being saved. The 'W' frames collect in data and the image is written once, on the close.
+	struct Save {
+		uint8_t channel = 0;
+		std::string image;
+		std::string name;
+		uint8_t type = 0;
+		bool replace = false;
+		std::vector<uint8_t> data;
+		int lastSeq = -1;  // of the last frame taken, a frame sent again after a lost 'A' is not added twice
+		int room = 0;      // blocks free for the file when it was opened
+		bool opened = false;  // an open on the save channel was asked for, its close is answered
+		bool active = false;  // and the frames are taken
+		uint8_t error = 0;    // DOS status the save was refused with
+	};
+
+	// Drive code started with M-E, streamed as 'T' frames.
+	struct DriveRun {
+		Drive1541* drive = nullptr;
+		size_t sent = 0;
+		bool finished = false;
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	void handshake();
+	size_t handleFrame();
+	void measure(uint8_t request, size_t in, size_t out, Clock::time_point arrived);
+	void handleOpen(uint8_t channel, const std::vector<uint8_t>& name);
+	void openSave(uint8_t channel, const std::string& name);
+	void handleWrite(const uint8_t* frame, size_t len);
+	void refuseSave(uint8_t code, bool send);
+	uint8_t commitSave();
+	void handleWriteSector(const uint8_t* frame, size_t len);
+	void imageWritten(uint8_t device, const std::string& path);
+	void handleCommand(uint8_t device, const std::vector<uint8_t>& cmd);
+	void handleGet(uint8_t channel, uint8_t maxLen);
+	void handlePosition(uint8_t channel, uint16_t record, uint8_t position, uint8_t maxLen);
+	bool seekRecord(Stream& stream, uint16_t record, uint8_t position);
+	void handleSector(uint8_t channel, uint8_t track, uint8_t sector);
+	bool loadFile(uint8_t device, Media& disk, const std::string& name);
+	void stageNextLoad();
+	void sendBlock(Stream& stream, size_t maxLen);
+	void sendDirLine();
+	void sendTrace();
+
+	std::shared_ptr<const StreamCache::Frames> frameFile(const std::vector<uint8_t>& data) const;
+	std::shared_ptr<const StreamCache::Frames> frameListing(uint8_t device, Media& disk) const;
+	std::vector<uint8_t> buildFrame(uint8_t type, uint8_t arg, uint8_t seq, const uint8_t* data, size_t len) const;
+	void sendFrame(uint8_t type, uint8_t arg, const uint8_t* data, size_t len);
+	void sendCached(const StreamCache::Frames& frames, size_t i);
+	void queueFrame(const uint8_t* frame, size_t len);
+	void sendError(uint8_t code);
+	void resendFrom(uint8_t seq);
+
+	Media* media(uint8_t device);
+	const Catalog::Image* catalogImage(uint8_t device) const;
+	std::string imagePath(uint8_t device) const;
+	std::string imageFormat(uint8_t device);
+	Drive1541& drive(uint8_t device);
+	void logEvent(const uint8_t* rec);
+	void sniffed(const uint8_t* frame);
+	void log(const std::string& text);
+
+	const LinkConfig m_config;
+	ImageCache& m_cache;
+	ReadAhead& m_readAhead;
+	StreamCache& m_streams;
+	Logger m_log;
+	Sniffer m_sniffer;
+	State m_state;
+	Stats m_stats;
+	LinkMetrics m_metrics;
+	std::string m_format;         // of the image the last open or channel request was for
+	Clock::time_point m_replied;  // when the last reply was ready
+
+	std::vector<uint8_t> m_in;
+	std::vector<uint8_t> m_out;
+	std::deque<std::vector<uint8_t>> m_sentFrames;
+	uint8_t m_seq;
+
+	std::map<uint8_t, std::string> m_mounts;  // images picked from the catalog by name, over m_config.images
+	std::map<uint8_t, std::unique_ptr<Media>> m_media;
+	std::map<uint8_t, std::unique_ptr<Drive1541>> m_drives;
+	Stream m_stream;                      // 'R' stream of the last open
+	std::map<uint8_t, Stream> m_channels; // data channels in channel mode
+	std::shared_ptr<const StreamCache::Frames> m_dir;  // 'L' frames of the listing being sent
+	size_t m_dirPos;
+	DriveRun m_run;
+	Load m_lastLoad;
+	Load m_staged;
+	Save m_save;
+
+	// sniffer timer: ticks per second, the last time seen and the wraps of its 32 bits
+	uint32_t m_sniffRate;
+	uint32_t m_sniffLast;
+	uint64_t m_sniffWraps;
+};
+
+#endif
@@ -0,0 +1,417 @@
+// Load test for the host daemon. Each link is a pty pair: the server gets the slave end as if it were an Arduino's
+// serial port, and a thread on the master end plays the Arduino. It does the handshake, then loads the parts of a
+// multi-load D64 in order over and over with 'O', 'R' and 'C', checking every framed block, and times each request
+// to its reply. Before that it saves files into a blank D64 with D64Writer and checks the BAM, the directory chain
+// and the sector interleave of the image it wrote.
+//
+//   load_test [links] [seconds] [blocks per part]
+//
+// A pty has no baud rate, so the latencies are the server's own, not the serial link's.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <pty.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "d64_image.h"
+#include "d64_writer.h"
+#include "host_protocol.h"
+#include "image_cache.h"
+#include "media.h"
+#include "serial_port.h"
+#include "server.h"
+
+using namespace HostProtocol;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const int REPLY_MSECS = 2000;
+const int PARTS = 3;
+
+std::string partName(int part)
+{
+	return "PART" + std::to_string(part + 1);
+} // partName
+
+
+// D64 with PARTS PRG files of the given number of blocks each
+std::vector<uint8_t> testImage(int blocks)
+{
+	std::vector<uint8_t> image(D64Image::IMAGE_SIZE, 0);
+	D64Image view(image.data(), image.size());
+	uint8_t* bam = const_cast<uint8_t*>(view.sector(18, 0));
+	uint8_t* dir = const_cast<uint8_t*>(view.sector(18, 1));
+	int track = 1, sector = 0;
+
+	bam[0] = 18, bam[1] = 1;
+	std::memset(bam + 0x90, 0xA0, 16);
+	std::memcpy(bam + 0x90, "LOAD TEST", 9);
+	dir[0] = 0, dir[1] = 0xFF;
+
+	for(int part = 0; part < PARTS; part++) {
+		uint8_t* entry = dir + 32 * part;
+		std::string name = partName(part);
+		entry[2] = 0x82, entry[3] = uint8_t(track), entry[4] = uint8_t(sector);
+		std::memset(entry + 5, 0xA0, 16);
+		std::memcpy(entry + 5, name.data(), name.size());
+		entry[30] = uint8_t(blocks), entry[31] = uint8_t(blocks >> 8);
+
+		for(int i = 0; i < blocks; i++) {
+			uint8_t* data = const_cast<uint8_t*>(view.sector(track, sector));
+			int nextTrack = track, nextSector = sector + 1;
+			if(nextSector == D64Image::sectorsInTrack(track)) {
+				nextTrack = track == 17 ? 19 : track + 1;
+				nextSector = 0;
+			}
+
+			for(int j = 2; j < D64Image::SECTOR_SIZE; j++)
+				data[j] = uint8_t(part + i + j);
+			data[0] = i == blocks - 1 ? 0 : nextTrack;
+			data[1] = i == blocks - 1 ? 0xFF : nextSector;
+			track = nextTrack;
+			sector = nextSector;
+		}
+	}
+
+	return image;
+} // testImage
+
+
+// Formatted D64 without files: every sector free but the BAM and the first directory sector
+std::vector<uint8_t> blankImage()
+{
+	std::vector<uint8_t> image(D64Image::IMAGE_SIZE, 0);
+	D64Image view(image.data(), image.size());
+	uint8_t* bam = const_cast<uint8_t*>(view.sector(18, 0));
+	uint8_t* dir = const_cast<uint8_t*>(view.sector(18, 1));
+
+	bam[0] = 18, bam[1] = 1, bam[2] = 0x41;
+	for(int track = 1; track <= D64Image::TRACKS; track++) {
+		int sectors = D64Image::sectorsInTrack(track);
+		uint8_t* entry = bam + 4 * track;
+		for(int s = 0; s < sectors; s++)
+			if(track != 18 or s > 1)
+				entry[1 + s / 8] |= 1 << (s % 8), entry[0]++;
+	}
+	std::memset(bam + 0x90, 0xA0, 27);
+	std::memcpy(bam + 0x90, "SAVE TEST", 9);
+	dir[1] = 0xFF;
+	return image;
+} // blankImage
+
+
+// Save files with D64Writer, write the image out and read it back: the first file takes three blocks ten sectors
+// apart on track 17, the second fills the gaps after them, and the ninth file starts a directory sector three
+// sectors on from the first.
+bool checkWriter(const std::string& path, std::string& why)
+{
+	const int FILES = 9;
+	std::vector<uint8_t> blank = blankImage();
+	D64Writer writer(blank.data(), blank.size());
+	std::vector<std::vector<uint8_t>> files;
+	for(int i = 0; i < FILES; i++) {
+		files.emplace_back(i == 0 ? 600 : i == 1 ? 300 : 10 + i);
+		for(size_t j = 0; j < files.back().size(); j++)
+			files.back()[j] = uint8_t(i * 31 + j);
+		if(writer.addFile("FILE" + std::to_string(i), D64Writer::PRG, files.back(), false) != D64Writer::SAVED) {
+			why = "cannot save FILE" + std::to_string(i);
+			return false;
+		}
+	}
+	if(writer.addFile("FILE0", D64Writer::PRG, files[0], false) != D64Writer::FILE_EXISTS) {
+		why = "saved over FILE0 without @";
+		return false;
+	}
+	if(not writer.writeTo(path)) {
+		why = path + ": " + std::strerror(errno);
+		return false;
+	}
+
+	std::shared_ptr<const MappedFile> file = MappedFile::open(path);
+	std::unique_ptr<Media> media = file ? Media::create(file) : nullptr;
+	if(not media or not media->disk()) {
+		why = "cannot read the saved image back";
+		return false;
+	}
+	for(int i = 0; i < FILES; i++) {
+		std::vector<uint8_t> data;
+		if(not media->readFile("FILE" + std::to_string(i), data) or data != files[i]) {
+			why = "FILE" + std::to_string(i) + " does not read back";
+			return false;
+		}
+	}
+
+	const D64Image& disk = *media->disk();
+	const uint8_t* bam = disk.sector(18, 0);
+	const uint8_t* dir = disk.sector(18, 1);
+	const uint8_t* entry = dir + 32;
+	int track = dir[3], sector = dir[4];
+	std::vector<int> chain;
+	for(int hops = 0; track and hops < 4; hops++) {
+		chain.push_back(track * 100 + sector);
+		const uint8_t* block = disk.sector(track, sector);
+		track = block[0], sector = block[1];
+	}
+	if(chain != std::vector<int>{ 1700, 1710, 1720 } or entry[3] != 17 or entry[4] != 1) {
+		why = "files not laid out ten sectors apart from track 17";
+		return false;
+	}
+	if(dir[0] != 18 or dir[1] != 4 or (bam[4 * 18 + 1] & (1 << 4)) or disk.sector(18, 4)[2] != 0x82) {
+		why = "directory not continued on 18/4";
+		return false;
+	}
+	int free = 0;
+	for(int t = 1; t <= D64Image::TRACKS; t++)
+		free += t == 18 ? 0 : bam[4 * t];
+	if(free != 664 - 3 - 2 - (FILES - 2) or writer.freeBlocks() != free) {
+		why = "BAM has " + std::to_string(free) + " blocks free";
+		return false;
+	}
+	return true;
+} // checkWriter
+
+
+struct LinkResult {
+	std::vector<double> latencies;  // msecs per block
+	uint64_t bytes = 0;
+	uint64_t errors = 0;
+	std::string failure;
+};
+
+
+// The Arduino's end of one link
+class FakeArduino
+{
+public:
+	FakeArduino(int fd, LinkResult& result) : m_fd(fd), m_result(result) {}
+
+	bool handshake()
+	{
+		send("<CON>\r", 6);
+		std::string reply;
+		uint8_t c = 0;
+		while(c != '\r') {
+			if(not receive(&c, 1))
+				return fail("no handshake reply");
+			reply += char(c);
+		}
+		if(reply.compare(0, 5, HANDSHAKE_SEND) != 0)
+			return fail("bad handshake reply " + reply);
+		send("<END>\r", 6);
+		return true;
+	}
+
+	// Load a file once, as the sketch does for LOAD"NAME",8, then close it
+	bool load(const std::string& name, size_t expected)
+	{
+		std::vector<uint8_t> open = { REQ_OPEN, uint8_t(3 + name.size()), CHANNEL_LOAD };
+		open.insert(open.end(), name.begin(), name.end());
+		uint8_t seq = 0;
+		size_t total = 0;
+		uint8_t type = 0;
+
+		send(open.data(), open.size());
+		do {
+			if(total) {
+				uint8_t read = REQ_READ;
+				send(&read, 1);
+			}
+			auto start = Clock::now();
+			uint8_t len = 0;
+			if(not frame(type, len, seq))
+				return false;
+			m_result.latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+			total += len;
+		} while(type == REP_BLOCK);
+
+		uint8_t close = REQ_CLOSE;
+		send(&close, 1);
+		m_result.bytes += total;
+		if(total != expected)
+			return fail("loaded " + std::to_string(total) + " bytes, expected " + std::to_string(expected));
+		return true;
+	}
+
+private:
+	// type len seq data crc
+	bool frame(uint8_t& type, uint8_t& len, uint8_t& seq)
+	{
+		uint8_t buf[2 + 1 + 255 + 2];
+		if(not receive(buf, 2))
+			return fail("no reply");
+		type = buf[0];
+		len = buf[1];
+		if(type == REP_ERROR)
+			return fail("error " + std::to_string(len));
+		if(type != REP_BLOCK and type != REP_BLOCK_LAST)
+			return fail("unexpected frame " + std::to_string(type));
+		if(not receive(buf + 2, 1 + len + 2))
+			return fail("short frame");
+
+		uint16_t crc = uint16_t(buf[3 + len] << 8 | buf[4 + len]);
+		if(buf[2] != seq or crc16(buf, 3 + len) != crc) {
+			m_result.errors++;
+			return fail("bad frame");
+		}
+		seq++;
+		return true;
+	}
+
+	void send(const void* data, size_t len)
+	{
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		while(len) {
+			ssize_t done = ::write(m_fd, p, len);
+			if(done <= 0)
+				return;
+			p += done;
+			len -= size_t(done);
+		}
+	}
+
+	bool receive(uint8_t* data, size_t len)
+	{
+		while(len) {
+			pollfd pfd = { m_fd, POLLIN, 0 };
+			if(poll(&pfd, 1, REPLY_MSECS) <= 0)
+				return false;
+			ssize_t got = ::read(m_fd, data, len);
+			if(got <= 0)
+				return false;
+			data += got;
+			len -= size_t(got);
+		}
+		return true;
+	}
+
+	bool fail(const std::string& why)
+	{
+		if(m_result.failure.empty())
+			m_result.failure = why;
+		return false;
+	}
+
+	int m_fd;
+	LinkResult& m_result;
+};
+
+
+double percentile(std::vector<double>& sorted, double p)
+{
+	if(sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+} // percentile
+
+} // unnamed namespace
+
+
+int main(int argc, char* argv[])
+{
+	int links = argc > 1 ? std::atoi(argv[1]) : 16;
+	double seconds = argc > 2 ? std::atof(argv[2]) : 5;
+	int blocks = argc > 3 ? std::atoi(argv[3]) : 100;
+
+	char imagePath[] = "/tmp/commodroid_load_XXXXXX.d64";
+	int imageFd = mkstemps(imagePath, 4);
+	std::vector<uint8_t> image = testImage(blocks);
+	if(imageFd < 0 or write(imageFd, image.data(), image.size()) != ssize_t(image.size())) {
+		std::perror("test image");
+		return 1;
+	}
+	close(imageFd);
+
+	char savePath[] = "/tmp/commodroid_save_XXXXXX.d64";
+	int saveFd = mkstemps(savePath, 4);
+	std::string why = "no temporary file";
+	bool saved = saveFd >= 0 and checkWriter(savePath, why);
+	if(saveFd >= 0) {
+		close(saveFd);
+		unlink(savePath);
+	}
+	std::printf("D64 save round trip: %s\n", saved ? "ok" : why.c_str());
+
+	LinkConfig config;
+	config.mode = MODE_FRAMED;
+	config.images[FIRST_DEVICE] = imagePath;
+
+	Server server;
+	std::vector<int> masters;
+	for(int i = 0; i < links; i++) {
+		int master, slave;
+		char name[64];
+		if(openpty(&master, &slave, name, nullptr, nullptr) < 0) {
+			std::perror("openpty");
+			return 1;
+		}
+		int fd = openSerialPort(name);
+		close(slave);
+		if(fd < 0 or server.addLink(fd, name, config) < 0) {
+			std::perror(name);
+			return 1;
+		}
+		masters.push_back(master);
+	}
+
+	std::thread serverThread([&server] { server.run(); });
+
+	const size_t fileBytes = size_t(blocks) * (D64Image::SECTOR_SIZE - 2);
+	std::vector<LinkResult> results(links);
+	std::vector<std::thread> arduinos;
+	auto end = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+	for(int i = 0; i < links; i++)
+		arduinos.emplace_back([&, i] {
+			FakeArduino arduino(masters[i], results[i]);
+			if(not arduino.handshake())
+				return;
+			for(int part = 0; Clock::now() < end; part = (part + 1) % PARTS)
+				if(not arduino.load(partName(part), fileBytes))
+					return;
+		});
+
+	for(auto& t : arduinos)
+		t.join();
+	server.stop();
+	serverThread.join();
+	for(int fd : masters)
+		close(fd);
+	unlink(imagePath);
+
+	bool ok = saved;
+	std::vector<double> all;
+	std::printf("%d links, %.1f s, %d parts of %d blocks, image mapped %zu time(s)\n", links, seconds, PARTS, blocks,
+		server.cache().size());
+	std::printf("link  blocks   p50 ms   p95 ms   p99 ms   max ms     KB/s  errors\n");
+	for(int i = 0; i < links; i++) {
+		LinkResult& r = results[i];
+		std::vector<double>& lat = r.latencies;
+		std::sort(lat.begin(), lat.end());
+		all.insert(all.end(), lat.begin(), lat.end());
+		std::printf("%4d %7zu %8.3f %8.3f %8.3f %8.3f %8.1f %7llu", i, lat.size(), percentile(lat, 0.5),
+			percentile(lat, 0.95), percentile(lat, 0.99), lat.empty() ? 0 : lat.back(), r.bytes / seconds / 1024,
+			(unsigned long long)r.errors);
+		if(not r.failure.empty()) {
+			std::printf("  %s", r.failure.c_str());
+			ok = false;
+		}
+		std::printf("\n");
+	}
+
+	std::sort(all.begin(), all.end());
+	std::printf(" all %7zu %8.3f %8.3f %8.3f %8.3f\n", all.size(), percentile(all, 0.5), percentile(all, 0.95),
+		percentile(all, 0.99), all.empty() ? 0 : all.back());
+
+	const ReadAhead::Stats& ahead = server.readAhead().stats();
+	std::printf("read-ahead: %llu staged, %llu hits, %llu misses\n", (unsigned long long)ahead.staged,
+		(unsigned long long)ahead.hits, (unsigned long long)ahead.misses);
+	return ok ? 0 : 1;
+} // main
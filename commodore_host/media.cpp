@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <cctype>
+#include "media.h"
+
+namespace {
+
+const int DIR_TRACK = 18;
+const int DIR_SECTOR = 1;
+const size_t DISK_NAME_OFFSET = 0x90;
+const size_t ENTRY_BYTES = 32;
+const size_t NAME_BYTES = 16;
+const size_t RECORD_LENGTH_OFFSET = 23;  // in a relative file's directory entry
+const size_t BLOCK_DATA_BYTES = 254;
+const size_t MAX_DIR_ENTRIES = 145;  // directory listings are capped, as in the Excel host
+
+const size_t T64_ENTRIES_OFFSET = 34;
+const size_t T64_NAME_OFFSET = 40;
+const size_t T64_DIR_OFFSET = 64;
+
+const char* const FILE_TYPES[] = { "DEL", "SEQ", "PRG", "USR", "REL" };
+
+enum FileTypes {
+	TYPE_SEQ = 1,
+	TYPE_PRG = 2,
+	TYPE_REL = 4
+};
+
+std::string upper(std::string text)
+{
+	for(char& c : text)
+		c = std::toupper(static_cast<unsigned char>(c));
+	return text;
+} // upper
+
+
+// PETSCII name with the shifted space padding removed
+std::string entryName(const uint8_t* bytes)
+{
+	std::string name;
+	for(size_t i = 0; i < NAME_BYTES; i++)
+		if(bytes[i] != 0xA0)
+			name += char(bytes[i]);
+	return name;
+} // entryName
+
+} // unnamed namespace
+
+
+std::vector<uint8_t> encodeDirLine(const DirLine& line)
+{
+	size_t textLen = std::min<size_t>(line.text.size(), 255 - 2);  // the frame's length byte
+	std::vector<uint8_t> body(2 + textLen);
+	body[0] = uint8_t(line.blocks & 0xFF);
+	body[1] = uint8_t(line.blocks >> 8);
+	std::copy(line.text.begin(), line.text.begin() + textLen, body.begin() + 2);
+	return body;
+} // encodeDirLine
+
+
+std::unique_ptr<Media> Media::create(std::shared_ptr<const MappedFile> file)
+{
+	if(not file)
+		return nullptr;
+
+	std::string name = upper(file->name());
+	std::string ext = name.size() >= 4 ? name.substr(name.size() - 4) : "";
+	if(ext == ".D64")
+		return std::unique_ptr<Media>(new D64Media(file));
+	if(ext == ".T64")
+		return std::unique_ptr<Media>(new T64Media(file));
+	if(ext == ".PRG")
+		return std::unique_ptr<Media>(new PrgMedia(file));
+	return nullptr;
+} // create
+
+
+bool Media::readFile(const std::string& name, std::vector<uint8_t>& data) const
+{
+	if(findFile(name, data))
+		return true;
+
+	size_t comma = name.find(',');
+	return comma != std::string::npos and findFile(name.substr(0, comma), data);
+} // readFile
+
+
+bool Media::openRecords(const std::string& name, RecordFile& file) const
+{
+	if(findRecords(name, file))
+		return true;
+
+	size_t comma = name.find(',');  // e.g. ",L," and the record length
+	return comma != std::string::npos and findRecords(name.substr(0, comma), file);
+} // openRecords
+
+
+bool RecordFile::read(uint16_t record, uint8_t position, std::vector<uint8_t>& data) const
+{
+	data.clear();
+	if(record == 0 or record > records() or position == 0 or position > recordLength)
+		return false;
+
+	size_t start = size_t(record - 1) * recordLength;
+	for(size_t at = start + position - 1; at < start + recordLength; at++)
+		data.push_back(blocks[at / BLOCK_DATA_BYTES][2 + at % BLOCK_DATA_BYTES]);
+
+	// The rest of a record is zero filled, the drive stops at the last byte written
+	while(data.size() > 1 and data.back() == 0)
+		data.pop_back();
+	return true;
+} // read
+
+
+bool Media::nameMatches(const std::string& pattern, const std::string& name)
+{
+	if(pattern == "*" or pattern == name)
+		return true;
+
+	size_t star = pattern.find('*');
+	return star != std::string::npos and name.compare(0, star, pattern, 0, star) == 0;
+} // nameMatches
+
+
+// Block count, padded to line up the names, the quoted name and the file type
+std::string Media::fileLine(uint16_t blocks, const std::string& name, uint8_t type)
+{
+	std::string count = std::to_string(blocks);
+	std::string line(count.size() < 4 ? 4 - count.size() : 0, ' ');
+	line += '"' + name + '"' + ' ';
+	if(type < sizeof(FILE_TYPES) / sizeof(FILE_TYPES[0]))
+		line += FILE_TYPES[type];
+	return line;
+} // fileLine
+
+
+// Disk name in reverse video and quotes
+std::string Media::headerLine(const std::string& name)
+{
+	return std::string("\x12\"") + name + '"';
+} // headerLine
+
+
+D64Media::D64Media(std::shared_ptr<const MappedFile> file)
+	: Media(file), m_disk(file->data(), file->size())
+{}
+
+
+std::vector<const uint8_t*> D64Media::entries() const
+{
+	std::vector<const uint8_t*> list;
+	int track = DIR_TRACK, sector = DIR_SECTOR;
+
+	// The directory track has 19 sectors, more links than that is a loop
+	for(int hops = 0; track and hops < D64Image::sectorsInTrack(DIR_TRACK); hops++) {
+		const uint8_t* block = m_disk.sector(track, sector);
+		if(block == nullptr)
+			break;
+		for(size_t i = 0; i < D64Image::SECTOR_SIZE and list.size() < MAX_DIR_ENTRIES; i += ENTRY_BYTES)
+			if(block[i + 2])  // deleted entries have no file type
+				list.push_back(block + i);
+		track = block[0];
+		sector = block[1];
+	}
+
+	return list;
+} // entries
+
+
+std::vector<DirLine> D64Media::directory() const
+{
+	std::vector<DirLine> lines;
+	const uint8_t* bam = m_disk.sector(DIR_TRACK, 0);
+
+	if(bam == nullptr)
+		return lines;
+
+	lines.push_back({ 0, headerLine(entryName(bam + DISK_NAME_OFFSET)) });
+	for(const MediaFile& file : files())
+		lines.push_back({ file.blocks, fileLine(file.blocks, file.name, file.type) });
+	return lines;
+} // directory
+
+
+std::vector<MediaFile> D64Media::files() const
+{
+	std::vector<MediaFile> list;
+	for(const uint8_t* entry : entries())
+		list.push_back({ entryName(entry + 5), uint16_t(entry[30] | (entry[31] << 8)), uint8_t(entry[2] & 7) });
+	return list;
+} // files
+
+
+bool D64Media::findFile(const std::string& name, std::vector<uint8_t>& data) const
+{
+	for(const uint8_t* entry : entries()) {
+		uint8_t type = entry[2] & 7;
+		if((type == TYPE_PRG or type == TYPE_SEQ) and nameMatches(name, entryName(entry + 5)))
+			return readChain(entry[3], entry[4], data);
+	}
+	return false;
+} // findFile
+
+
+// The data chain of a relative file is walked once, records are then read from the sectors it points to.
+bool D64Media::findRecords(const std::string& name, RecordFile& file) const
+{
+	for(const uint8_t* entry : entries()) {
+		if((entry[2] & 7) != TYPE_REL or entry[RECORD_LENGTH_OFFSET] == 0 or not nameMatches(name, entryName(entry + 5)))
+			continue;
+
+		file = RecordFile();
+		file.recordLength = entry[RECORD_LENGTH_OFFSET];
+		file.image = m_file;
+		int track = entry[3], sector = entry[4];
+		for(int hops = 0; hops < 768; hops++) {  // a disk has at most 768 sectors, more links than that is a loop
+			const uint8_t* block = m_disk.sector(track, sector);
+			if(block == nullptr)
+				return false;
+			file.blocks.push_back(block);
+
+			if(block[0] == 0) {  // last block, the sector link is the index of its last byte
+				file.size += block[1] >= 2 ? block[1] - 1 : 0;
+				return true;
+			}
+			file.size += BLOCK_DATA_BYTES;
+			track = block[0];
+			sector = block[1];
+		}
+		return false;
+	}
+	return false;
+} // findRecords
+
+
+bool D64Media::readChain(int track, int sector, std::vector<uint8_t>& data) const
+{
+	data.clear();
+
+	// A disk has at most 768 sectors, more links than that is a loop
+	for(int hops = 0; hops < 768; hops++) {
+		const uint8_t* block = m_disk.sector(track, sector);
+		if(block == nullptr)
+			return false;
+
+		if(block[0] == 0) {  // last block, the sector link is the index of its last byte
+			if(block[1] >= 2)
+				data.insert(data.end(), block + 2, block + block[1] + 1);
+			return true;
+		}
+
+		data.insert(data.end(), block + 2, block + D64Image::SECTOR_SIZE);
+		track = block[0];
+		sector = block[1];
+	}
+
+	return false;
+} // readChain
+
+
+std::vector<const uint8_t*> T64Media::entries() const
+{
+	std::vector<const uint8_t*> list;
+	const uint8_t* tape = m_file->data();
+	size_t size = m_file->size();
+
+	if(size < T64_DIR_OFFSET)
+		return list;
+
+	size_t count = tape[T64_ENTRIES_OFFSET] | (tape[T64_ENTRIES_OFFSET + 1] << 8);
+	for(size_t i = 0; i < count and list.size() < MAX_DIR_ENTRIES; i++) {
+		size_t offset = T64_DIR_OFFSET + i * ENTRY_BYTES;
+		if(offset + ENTRY_BYTES > size)
+			break;
+		if(tape[offset] and tape[offset + 1])  // used entry with a file type
+			list.push_back(tape + offset);
+	}
+
+	return list;
+} // entries
+
+
+// Program bytes without the load address, from the start and end addresses of the entry
+size_t T64Media::fileSize(const uint8_t* entry)
+{
+	int start = entry[2] | (entry[3] << 8);
+	int end = entry[4] | (entry[5] << 8);
+	return end > start ? end - start : 0;
+} // fileSize
+
+
+std::vector<DirLine> T64Media::directory() const
+{
+	std::vector<DirLine> lines;
+
+	if(m_file->size() < T64_DIR_OFFSET)
+		return lines;
+
+	lines.push_back({ 0, headerLine(entryName(m_file->data() + T64_NAME_OFFSET)) });
+	for(const MediaFile& file : files())
+		lines.push_back({ file.blocks, fileLine(file.blocks, file.name, file.type) });
+	return lines;
+} // directory
+
+
+std::vector<MediaFile> T64Media::files() const
+{
+	std::vector<MediaFile> list;
+	for(const uint8_t* entry : entries())
+		list.push_back({ entryName(entry + 16), uint16_t((fileSize(entry) + 2 + 253) / 254), uint8_t(entry[1] & 7) });
+	return list;
+} // files
+
+
+bool T64Media::findFile(const std::string& name, std::vector<uint8_t>& data) const
+{
+	for(const uint8_t* entry : entries()) {
+		uint8_t type = entry[1] & 7;
+		if((type != TYPE_PRG and type != TYPE_SEQ) or not nameMatches(name, entryName(entry + 16)))
+			continue;
+
+		size_t offset = entry[8] | (entry[9] << 8) | (entry[10] << 16) | (size_t(entry[11]) << 24);
+		size_t size = fileSize(entry);
+		if(offset > m_file->size())
+			return false;
+		size = std::min(size, m_file->size() - offset);
+
+		data.assign(entry + 2, entry + 4);  // load address
+		data.insert(data.end(), m_file->data() + offset, m_file->data() + offset + size);
+		return true;
+	}
+	return false;
+} // findFile
+
+
+std::vector<DirLine> PrgMedia::directory() const
+{
+	const std::string& file = m_file->name();
+	std::string name = upper(file.substr(file.find_last_of('/') + 1));
+
+	return { { uint16_t((m_file->size() + 255) / 256), name } };
+} // directory
+
+
+std::vector<MediaFile> PrgMedia::files() const
+{
+	DirLine line = directory().front();
+	return { { line.text, line.blocks, TYPE_PRG } };
+} // files
+
+
+bool PrgMedia::findFile(const std::string&, std::vector<uint8_t>& data) const
+{
+	data.assign(m_file->data(), m_file->data() + m_file->size());
+	return true;
+} // findFile
@@ -0,0 +1,146 @@
+#ifndef MEDIA_H
+#define MEDIA_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "d64_image.h"
+#include "image_cache.h"
+
+// A line of the directory listing as sent in 'L' frames: the block count, then the text.
+struct DirLine
+{
+	uint16_t blocks;
+	std::string text;
+};
+
+// Body of an 'L' frame for the line: block count, low byte first, then the text.
+std::vector<uint8_t> encodeDirLine(const DirLine& line);
+
+// A program or data file on the media, by its PETSCII name.
+struct MediaFile
+{
+	std::string name;
+	uint16_t blocks;
+	uint8_t type;  // CBM file type, 2 for PRG
+};
+
+// A relative file on a disk image, read a record at a time straight from the mapped sectors.
+struct RecordFile
+{
+	uint8_t recordLength = 0;
+	std::shared_ptr<const MappedFile> image;  // keeps the sectors mapped
+	std::vector<const uint8_t*> blocks;  // sectors of the data chain
+	size_t size = 0;                     // data bytes in the chain
+
+	size_t records() const { return recordLength ? size / recordLength : 0; }
+
+	// Record number record (from 1) from byte position (from 1) up to its last non-zero byte, as the drive sends it.
+	// False when there is no such record.
+	bool read(uint16_t record, uint8_t position, std::vector<uint8_t>& data) const;
+};
+
+
+// A mounted D64, T64 or PRG file, or one of them in an archive, read the same way as the Excel host's D64_DRIVER,
+// T64_DRIVER and PRG_DRIVER.
+class Media
+{
+public:
+	virtual ~Media() {}
+
+	// Media for the file, chosen by its extension. Null for other files.
+	static std::unique_ptr<Media> create(std::shared_ptr<const MappedFile> file);
+
+	// Program bytes, load address first. Names match exactly or with a trailing '*', and "*" is the first program.
+	// When nothing matches, anything after a comma (e.g. ",S") is dropped and the name tried again.
+	bool readFile(const std::string& name, std::vector<uint8_t>& data) const;
+
+	// A relative file, matched by name the same way. Only disk images have them.
+	bool openRecords(const std::string& name, RecordFile& file) const;
+
+	// Header line first, then one line per file.
+	virtual std::vector<DirLine> directory() const = 0;
+
+	// The files listed in directory(), in the same order.
+	virtual std::vector<MediaFile> files() const = 0;
+
+	// Sectors for 'S' frames and the drive emulation, null when the media is not a disk.
+	virtual const D64Image* disk() const { return nullptr; }
+
+	// Whether every name loads the same file, so there is no need to look a name up first.
+	virtual bool anyName() const { return false; }
+
+	const std::string& path() const { return m_file->path(); }
+	const std::shared_ptr<const MappedFile>& file() const { return m_file; }
+
+protected:
+	explicit Media(std::shared_ptr<const MappedFile> file) : m_file(file) {}
+
+	virtual bool findFile(const std::string& name, std::vector<uint8_t>& data) const = 0;
+	virtual bool findRecords(const std::string& /*name*/, RecordFile& /*file*/) const { return false; }
+
+	static bool nameMatches(const std::string& pattern, const std::string& name);
+	static std::string fileLine(uint16_t blocks, const std::string& name, uint8_t type);
+	static std::string headerLine(const std::string& name);
+
+	std::shared_ptr<const MappedFile> m_file;
+};
+
+
+class D64Media : public Media
+{
+public:
+	explicit D64Media(std::shared_ptr<const MappedFile> file);
+
+	std::vector<DirLine> directory() const override;
+	std::vector<MediaFile> files() const override;
+	const D64Image* disk() const override { return &m_disk; }
+
+	// Bytes of the file starting at track / sector, following the sector links.
+	bool readChain(int track, int sector, std::vector<uint8_t>& data) const;
+
+protected:
+	bool findFile(const std::string& name, std::vector<uint8_t>& data) const override;
+	bool findRecords(const std::string& name, RecordFile& file) const override;
+
+private:
+	// Directory entries in use, 32 bytes each
+	std::vector<const uint8_t*> entries() const;
+
+	D64Image m_disk;
+};
+
+
+class T64Media : public Media
+{
+public:
+	explicit T64Media(std::shared_ptr<const MappedFile> file) : Media(file) {}
+
+	std::vector<DirLine> directory() const override;
+	std::vector<MediaFile> files() const override;
+
+protected:
+	bool findFile(const std::string& name, std::vector<uint8_t>& data) const override;
+
+private:
+	std::vector<const uint8_t*> entries() const;
+	static size_t fileSize(const uint8_t* entry);
+};
+
+
+// A PRG file is a single program, whatever name is asked for.
+class PrgMedia : public Media
+{
+public:
+	explicit PrgMedia(std::shared_ptr<const MappedFile> file) : Media(file) {}
+
+	std::vector<DirLine> directory() const override;
+	std::vector<MediaFile> files() const override;
+	bool anyName() const override { return true; }
+
+protected:
+	bool findFile(const std::string& name, std::vector<uint8_t>& data) const override;
+};
+
+#endif
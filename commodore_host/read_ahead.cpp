@@ -0,0 +1,30 @@
+#include "read_ahead.h"
+
+namespace {
+
+// Patterns kept before starting over, enough for a large library without letting a long running server grow
+const size_t MAX_PATTERNS = 65536;
+
+} // unnamed namespace
+
+
+void ReadAhead::record(const std::string& image, const std::string& previous, const std::string& name)
+{
+	if(m_next.size() >= MAX_PATTERNS and m_next.find(Key(image, previous)) == m_next.end())
+		m_next.clear();
+	m_next[Key(image, previous)][name]++;
+} // record
+
+
+std::string ReadAhead::predict(const std::string& image, const std::string& previous) const
+{
+	auto it = m_next.find(Key(image, previous));
+	if(it == m_next.end())
+		return "";
+
+	const std::pair<const std::string, unsigned>* best = nullptr;
+	for(const auto& next : it->second)
+		if(best == nullptr or next.second > best->second)
+			best = &next;
+	return best->first;
+} // predict
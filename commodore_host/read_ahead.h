@@ -0,0 +1,39 @@
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+// Which file tends to be loaded after which, per image. Multi-load games open their parts in the same order every
+// time, so once a sequence has been seen the next part can be read into memory while the Commodore is still busy
+// with the last one. Shared by all links, so one player's run teaches the others. Not thread safe.
+class ReadAhead
+{
+public:
+	struct Stats {
+		uint64_t staged = 0;  // files read ahead
+		uint64_t hits = 0;    // loads answered from a staged file
+		uint64_t misses = 0;  // staged files thrown away because another was loaded
+	};
+
+	// name was loaded from image, after previous ("" for the first load since the image was mounted).
+	void record(const std::string& image, const std::string& previous, const std::string& name);
+
+	// The file most often loaded after previous, "" when there is no pattern yet.
+	std::string predict(const std::string& image, const std::string& previous) const;
+
+	Stats& stats() { return m_stats; }
+	const Stats& stats() const { return m_stats; }
+	size_t patterns() const { return m_next.size(); }
+
+private:
+	typedef std::pair<std::string, std::string> Key;  // image, previous file
+
+	std::map<Key, std::map<std::string, unsigned>> m_next;
+	Stats m_stats;
+};
+
+#endif
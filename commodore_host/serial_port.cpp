@@ -0,0 +1,37 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include "serial_port.h"
+
+int openSerialPort(const std::string& device)
+{
+	int fd = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0)
+		return -1;
+
+	termios tio;
+	if(tcgetattr(fd, &tio) < 0) {
+		int err = errno;
+		::close(fd);
+		errno = err;
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~CRTSCTS;
+	cfsetispeed(&tio, B115200);
+	cfsetospeed(&tio, B115200);
+	// VMIN 1 so an empty non-blocking read is EAGAIN rather than 0, which would look like a hangup
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	if(tcsetattr(fd, TCSANOW, &tio) < 0) {
+		int err = errno;
+		::close(fd);
+		errno = err;
+		return -1;
+	}
+
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+} // openSerialPort
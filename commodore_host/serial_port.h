@@ -0,0 +1,10 @@
+#ifndef SERIAL_PORT_H
+#define SERIAL_PORT_H
+
+#include <string>
+
+// Open a serial device (or pty) raw, 8N1, non-blocking, at the Arduino sketch's 115200 baud. Returns the file
+// descriptor, or -1 with errno set.
+int openSerialPort(const std::string& device);
+
+#endif
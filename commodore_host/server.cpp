@@ -0,0 +1,285 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "server.h"
+
+namespace {
+
+const int MAX_EVENTS = 64;
+const int POLL_MSECS = 100;  // how often run() looks at m_stop
+const size_t READ_BYTES = 4096;
+const uint64_t WATCH_EVENT = 1ull << 63;  // epoll data of watched descriptors, over the link index
+
+
+// Bus commands by name, with the device or channel
+std::string busCommand(uint8_t cmd)
+{
+	const char* name = nullptr;
+	unsigned arg = cmd & 0x1F;
+
+	if(cmd == 0x3F)
+		return "UNLISTEN";
+	if(cmd == 0x5F)
+		return "UNTALK";
+	switch(cmd & 0xE0) {
+		case 0x20: name = "LISTEN"; break;
+		case 0x40: name = "TALK"; break;
+		case 0x60: name = "DATA", arg = cmd & 0x0F; break;
+		case 0xE0: name = (cmd & 0x10) ? "OPEN" : "CLOSE", arg = cmd & 0x0F; break;
+		default: return "";
+	}
+	return std::string(name) + ' ' + std::to_string(arg);
+} // busCommand
+
+} // unnamed namespace
+
+
+Server::Server()
+	: m_epoll(epoll_create1(EPOLL_CLOEXEC)), m_stop(false), m_metricsInterval(0)
+{}
+
+
+Server::~Server()
+{
+	for(auto& link : m_links)
+		if(not link->closed)
+			::close(link->fd);
+	if(m_epoll >= 0)
+		::close(m_epoll);
+} // dtor
+
+
+int Server::addLink(int fd, const std::string& name, const LinkConfig& config)
+{
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = m_links.size();
+	if(m_epoll < 0 or epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+
+	std::unique_ptr<Link> link(new Link{ m_links.size(), fd, name,
+		std::unique_ptr<LinkSession>(new LinkSession(config, m_cache, m_readAhead, m_streams)), false, false });
+	link->session->setLogger([name](const std::string& text) {
+		std::printf("%s: %s\n", name.c_str(), text.c_str());
+	});
+	m_links.push_back(std::move(link));
+	return int(m_links.size() - 1);
+} // addLink
+
+
+// One line per byte: link, microseconds since the Arduino started sniffing, ATN or DATA, the byte in hex, then
+// EOI and for bus commands what they are, e.g. "ttyACM0 1234567 ATN 28 LISTEN 8".
+bool Server::traceLink(int link, const std::string& path)
+{
+	std::shared_ptr<std::FILE> file(std::fopen(path.c_str(), "a"), [](std::FILE* f) { if(f) std::fclose(f); });
+	if(not file)
+		return false;
+	std::setvbuf(file.get(), nullptr, _IOLBF, 0);
+
+	std::string name = m_links[link]->name;
+	m_links[link]->session->setSniffer([file, name](const LinkSession::SniffEvent& event) {
+		std::fprintf(file.get(), "%s %llu %s %02X%s%s%s\n", name.c_str(), (unsigned long long)event.micros,
+			event.atn ? "ATN" : "DATA", event.data, event.eoi ? " EOI" : "", event.atn ? " " : "",
+			event.atn ? busCommand(event.data).c_str() : "");
+	});
+	return true;
+} // traceLink
+
+
+bool Server::watch(int fd, std::function<void()> handler)
+{
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = WATCH_EVENT | m_watches.size();
+	if(m_epoll < 0 or epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return false;
+
+	m_watches.push_back(handler);
+	return true;
+} // watch
+
+
+void Server::setMetricsFile(const std::string& path, unsigned interval)
+{
+	m_metricsPath = path;
+	m_metricsInterval = std::chrono::seconds(interval);
+	m_metricsDue = std::chrono::steady_clock::now() + m_metricsInterval;
+} // setMetricsFile
+
+
+bool Server::writeMetrics() const
+{
+	std::vector<std::pair<std::string, const LinkMetrics*>> links;
+	for(const auto& link : m_links)
+		links.emplace_back(link->name, &link->session->metrics());
+	std::string text = LinkMetrics::exposition(links);
+
+	std::string temp = m_metricsPath + ".tmp";
+	{
+		std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+		if(not out or not out.write(text.data(), text.size()).flush())
+			return false;
+	}
+	return std::rename(temp.c_str(), m_metricsPath.c_str()) == 0;
+} // writeMetrics
+
+
+bool Server::run()
+{
+	epoll_event events[MAX_EVENTS];
+
+	while(not m_stop) {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if(not m_metricsPath.empty() and now >= m_metricsDue) {
+			if(not writeMetrics())
+				std::perror(m_metricsPath.c_str());
+			m_metricsDue = now + m_metricsInterval;
+		}
+
+		int count = epoll_wait(m_epoll, events, MAX_EVENTS, POLL_MSECS);
+		if(count < 0) {
+			if(errno == EINTR)
+				continue;
+			std::perror("epoll_wait");
+			return false;
+		}
+
+		for(int i = 0; i < count; i++) {
+			if(events[i].data.u64 & WATCH_EVENT) {
+				m_watches[events[i].data.u64 & ~WATCH_EVENT]();
+				continue;
+			}
+
+			Link& link = *m_links[events[i].data.u64];
+			if(link.closed)
+				continue;
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				readLink(link);
+			if(not link.closed and (events[i].events & EPOLLOUT))
+				writeLink(link);
+		}
+	}
+
+	if(not m_metricsPath.empty() and not writeMetrics())
+		std::perror(m_metricsPath.c_str());
+	return true;
+} // run
+
+
+// Feed what the link has to its session, then try to send the replies straight away. Most replies fit the
+// driver's buffer, so EPOLLOUT is only needed for long ones.
+void Server::readLink(Link& link)
+{
+	uint8_t buf[READ_BYTES];
+
+	for(;;) {
+		ssize_t got = ::read(link.fd, buf, sizeof(buf));
+		if(got > 0) {
+			link.session->receive(buf, size_t(got));
+			continue;
+		}
+		if(got < 0 and errno == EINTR)
+			continue;
+		if(got < 0 and (errno == EAGAIN or errno == EWOULDBLOCK))
+			break;
+		closeLink(link, got == 0 ? "closed" : std::strerror(errno));
+		return;
+	}
+
+	writeLink(link);
+} // readLink
+
+
+void Server::writeLink(Link& link)
+{
+	std::vector<uint8_t>& out = link.session->output();
+	size_t sent = 0;
+
+	while(sent < out.size()) {
+		ssize_t done = ::write(link.fd, out.data() + sent, out.size() - sent);
+		if(done > 0) {
+			sent += size_t(done);
+			continue;
+		}
+		if(done < 0 and errno == EINTR)
+			continue;
+		if(done < 0 and (errno == EAGAIN or errno == EWOULDBLOCK))
+			break;
+		closeLink(link, std::strerror(errno));
+		return;
+	}
+
+	out.erase(out.begin(), out.begin() + sent);
+	updateEvents(link);
+} // writeLink
+
+
+void Server::closeLink(Link& link, const char* why)
+{
+	std::printf("%s: %s\n", link.name.c_str(), why);
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, link.fd, nullptr);
+	::close(link.fd);
+	link.closed = true;
+} // closeLink
+
+
+// Ask for EPOLLOUT only while there are replies waiting, a writable serial port would otherwise wake us forever.
+void Server::updateEvents(Link& link)
+{
+	bool pending = not link.session->output().empty();
+	if(pending == link.writing)
+		return;
+
+	epoll_event ev = {};
+	ev.events = pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.u64 = link.index;
+	if(epoll_ctl(m_epoll, EPOLL_CTL_MOD, link.fd, &ev) == 0)
+		link.writing = pending;
+} // updateEvents
+
+
+void Server::printStats() const
+{
+	for(const auto& link : m_links) {
+		const LinkSession::Stats& stats = link->session->stats();
+		std::printf("%s: %llu bytes in, %llu out, %llu frames, %llu resends, %llu opens, read-ahead %llu hits %llu misses\n",
+			link->name.c_str(), (unsigned long long)stats.bytesIn, (unsigned long long)stats.bytesOut,
+			(unsigned long long)stats.frames, (unsigned long long)stats.resends, (unsigned long long)stats.opens,
+			(unsigned long long)stats.stagedHits, (unsigned long long)stats.stagedMisses);
+		if(stats.sniffed)
+			std::printf("%s: %llu bus bytes sniffed\n", link->name.c_str(), (unsigned long long)stats.sniffed);
+		if(stats.saves)
+			std::printf("%s: %llu files saved\n", link->name.c_str(), (unsigned long long)stats.saves);
+	}
+
+	// Milliseconds at the median and the 99th percentile, host time and the wait for the Arduino's next request
+	for(const auto& link : m_links)
+		for(const auto& entry : link->session->metrics().series()) {
+			const LinkMetrics::Series& series = entry.second;
+			const LatencyHistogram& host = series.latency[LinkMetrics::HOST];
+			const LatencyHistogram& wait = series.latency[LinkMetrics::WAIT];
+			std::printf("%s: '%c' %s %llu requests, host p50 %.3f p99 %.3f ms", link->name.c_str(), entry.first.first,
+				entry.first.second.c_str(), (unsigned long long)series.requests, host.percentile(0.5) / 1e3,
+				host.percentile(0.99) / 1e3);
+			if(wait.count())
+				std::printf(", wait p50 %.3f p99 %.3f ms", wait.percentile(0.5) / 1e3, wait.percentile(0.99) / 1e3);
+			std::printf("\n");
+		}
+
+	const ReadAhead::Stats& ahead = m_readAhead.stats();
+	uint64_t loads = ahead.hits + ahead.misses;
+	std::printf("read-ahead: %zu patterns, %llu files staged, %llu hits, %llu misses (%.0f%% hit rate)\n",
+		m_readAhead.patterns(), (unsigned long long)ahead.staged, (unsigned long long)ahead.hits,
+		(unsigned long long)ahead.misses, loads ? 100.0 * ahead.hits / loads : 0.0);
+
+	const StreamCache::Stats& streams = m_streams.stats();
+	uint64_t finds = streams.hits + streams.spillHits + streams.misses;
+	std::printf("stream cache: %zu streams, %zu bytes, %llu hits, %llu from spill, %llu misses (%.0f%% hit rate), "
+		"%llu evicted, %llu bytes served\n", m_streams.size(), m_streams.bytes(), (unsigned long long)streams.hits,
+		(unsigned long long)streams.spillHits, (unsigned long long)streams.misses,
+		finds ? 100.0 * (streams.hits + streams.spillHits) / finds : 0.0, (unsigned long long)streams.evictions,
+		(unsigned long long)streams.bytesServed);
+} // printStats
@@ -0,0 +1,79 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "image_cache.h"
+#include "link_session.h"
+#include "read_ahead.h"
+#include "stream_cache.h"
+
+// Serves any number of Arduino links from one thread with epoll. Each link is a file descriptor (serial port or pty)
+// with its own LinkSession. Mounted images come from one ImageCache, so links sharing a disk share its mapping, and
+// the frames of the files they load from one StreamCache.
+class Server
+{
+public:
+	Server();
+	~Server();
+
+	// Takes ownership of fd, which must be non-blocking. Returns the link index, or -1 when epoll refuses the fd.
+	int addLink(int fd, const std::string& name, const LinkConfig& config);
+
+	// Write the bus bytes the link sees in sniffer mode to a text file, appending. False if it cannot be opened.
+	bool traceLink(int link, const std::string& path);
+
+	// Write the links' latency histograms and byte counts to path every interval seconds while serving, and once
+	// more when run() returns. Prometheus text format, written to a temporary file and renamed.
+	void setMetricsFile(const std::string& path, unsigned interval);
+	bool writeMetrics() const;
+
+	// Call handler from the server's thread whenever fd is readable, e.g. the catalog's inotify descriptor.
+	bool watch(int fd, std::function<void()> handler);
+
+	// Serve until stop() is called from another thread or a signal handler. Returns false if epoll fails.
+	bool run();
+	void stop() { m_stop = true; }
+
+	size_t links() const { return m_links.size(); }
+	const LinkSession& session(size_t link) const { return *m_links[link]->session; }
+	ImageCache& cache() { return m_cache; }
+	const ReadAhead& readAhead() const { return m_readAhead; }
+	StreamCache& streams() { return m_streams; }
+
+	// Per link, read-ahead and stream cache counters, and latency percentiles per link and request, one line each
+	void printStats() const;
+
+private:
+	struct Link {
+		size_t index;  // epoll data, m_links[index]
+		int fd;
+		std::string name;
+		std::unique_ptr<LinkSession> session;
+		bool writing;  // EPOLLOUT is armed
+		bool closed;
+	};
+
+	void readLink(Link& link);
+	void writeLink(Link& link);
+	void closeLink(Link& link, const char* why);
+	void updateEvents(Link& link);
+
+	int m_epoll;
+	std::atomic<bool> m_stop;
+	ImageCache m_cache;
+	ReadAhead m_readAhead;
+	StreamCache m_streams;
+	std::vector<std::unique_ptr<Link>> m_links;
+	std::vector<std::function<void()>> m_watches;
+	std::string m_metricsPath;
+	std::chrono::seconds m_metricsInterval;
+	std::chrono::steady_clock::time_point m_metricsDue;
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+#include "stream_cache.h"
+
+namespace {
+
+const char SPILL_MAGIC[] = "CDFS1";
+const char SPILL_EXTENSION[] = ".frames";
+const size_t HASH_MEMO_PRUNE = 64;  // image hashes remembered before the ones of unmapped images are dropped
+const uint32_t SPILL_MAX_BYTES = 16 << 20;  // larger than any stream, a spill file saying more is damaged
+
+// FNV-1a, 64 bits
+uint64_t hash64(const uint8_t* data, size_t len, uint64_t hash = 14695981039346656037ull)
+{
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 1099511628211ull;
+	return hash;
+} // hash64
+
+
+std::string hex(uint64_t value)
+{
+	char text[17];
+	std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+	return text;
+} // hex
+
+
+void putNumber(std::ofstream& out, uint64_t value)
+{
+	for(int i = 0; i < 4; i++)
+		out.put(char(value >> (8 * i)));
+} // putNumber
+
+
+uint32_t getNumber(std::ifstream& in)
+{
+	uint32_t value = 0;
+	for(int i = 0; i < 4; i++)
+		value |= uint32_t(uint8_t(in.get())) << (8 * i);
+	return value;
+} // getNumber
+
+} // unnamed namespace
+
+
+void StreamCache::Frames::add(const std::vector<uint8_t>& frame)
+{
+	bytes.insert(bytes.end(), frame.begin(), frame.end());
+	ends.push_back(uint32_t(bytes.size()));
+} // add
+
+
+StreamCache::StreamCache(size_t memoryBytes)
+	: m_limit(memoryBytes), m_bytes(0)
+{}
+
+
+bool StreamCache::setSpillFolder(const std::string& folder)
+{
+	if(not folder.empty() and ::mkdir(folder.c_str(), 0755) != 0 and errno != EEXIST)
+		return false;
+	m_spill = folder;
+	return true;
+} // setSpillFolder
+
+
+void StreamCache::setMemoryLimit(size_t bytes)
+{
+	m_limit = bytes;
+	trim();
+} // setMemoryLimit
+
+
+// The image hash goes first, so the same title under another file name shares the entry and a changed image
+// misses without being told about.
+std::string StreamCache::key(const std::shared_ptr<const MappedFile>& image, Kind kind, bool framed,
+	const std::string& name)
+{
+	auto it = m_hashes.find(image.get());
+	if(it == m_hashes.end() or it->second.first.lock() != image) {
+		if(m_hashes.size() >= HASH_MEMO_PRUNE)
+			for(auto old = m_hashes.begin(); old != m_hashes.end();)
+				old = old->second.first.expired() ? m_hashes.erase(old) : std::next(old);
+		uint64_t hash = hash64(image->data(), image->size());
+		it = m_hashes.insert_or_assign(image.get(), std::make_pair(std::weak_ptr<const MappedFile>(image), hash)).first;
+	}
+
+	return hex(it->second.second) + char(kind) + (framed ? 'F' : 'P') + name;
+} // key
+
+
+std::shared_ptr<const StreamCache::Frames> StreamCache::find(const std::string& key)
+{
+	auto it = m_byKey.find(key);
+	if(it != m_byKey.end()) {
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		m_stats.hits++;
+		return it->second->frames;
+	}
+
+	std::shared_ptr<const Frames> frames = unspill(key);
+	if(frames) {
+		m_stats.spillHits++;
+		add(key, frames, true);
+		return frames;
+	}
+
+	m_stats.misses++;
+	return nullptr;
+} // find
+
+
+void StreamCache::insert(const std::string& key, std::shared_ptr<const Frames> frames)
+{
+	auto it = m_byKey.find(key);
+	if(it != m_byKey.end()) {
+		m_bytes -= it->second->frames->bytes.size();
+		m_entries.erase(it->second);
+		m_byKey.erase(it);
+	}
+	add(key, frames, false);
+} // insert
+
+
+// A stream larger than the whole limit would only push the others out, it goes straight to the spill folder.
+void StreamCache::add(const std::string& key, std::shared_ptr<const Frames> frames, bool spilled)
+{
+	if(frames->bytes.size() > m_limit) {
+		if(not spilled and not m_spill.empty())
+			spill(Entry{ key, frames, false });
+		m_stats.evictions++;
+		return;
+	}
+
+	m_entries.push_front(Entry{ key, frames, spilled });
+	m_byKey[key] = m_entries.begin();
+	m_bytes += frames->bytes.size();
+	trim();
+} // add
+
+
+// Down to the memory limit, the least recently used first
+void StreamCache::trim()
+{
+	while(m_bytes > m_limit and not m_entries.empty()) {
+		const Entry& entry = m_entries.back();
+		if(not entry.spilled and not m_spill.empty())
+			spill(entry);
+		m_bytes -= entry.frames->bytes.size();
+		m_byKey.erase(entry.key);
+		m_entries.pop_back();
+		m_stats.evictions++;
+	}
+} // trim
+
+
+std::string StreamCache::spillPath(const std::string& key) const
+{
+	return m_spill + '/' + hex(hash64(reinterpret_cast<const uint8_t*>(key.data()), key.size())) + SPILL_EXTENSION;
+} // spillPath
+
+
+// Magic, the key, the frame ends and the bytes, counts little endian. Written to a temporary file and renamed, so a
+// crash never leaves half a stream.
+bool StreamCache::spill(const Entry& entry) const
+{
+	std::string path = spillPath(entry.key);
+	std::string temp = path + ".tmp";
+	{
+		std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+		if(not out)
+			return false;
+
+		const Frames& frames = *entry.frames;
+		out.write(SPILL_MAGIC, sizeof(SPILL_MAGIC));
+		putNumber(out, entry.key.size());
+		out.write(entry.key.data(), entry.key.size());
+		putNumber(out, frames.count());
+		for(uint32_t end : frames.ends)
+			putNumber(out, end);
+		out.write(reinterpret_cast<const char*>(frames.bytes.data()), frames.bytes.size());
+		if(not out.flush())
+			return false;
+	}
+	return std::rename(temp.c_str(), path.c_str()) == 0;
+} // spill
+
+
+std::shared_ptr<const StreamCache::Frames> StreamCache::unspill(const std::string& key) const
+{
+	if(m_spill.empty())
+		return nullptr;
+	std::ifstream in(spillPath(key), std::ios::binary);
+	if(not in)
+		return nullptr;
+
+	char magic[sizeof(SPILL_MAGIC)] = {};
+	in.read(magic, sizeof(magic));
+	std::string stored(getNumber(in) & 0xFFFF, '\0');
+	in.read(&stored[0], stored.size());
+	if(not in or std::string(magic, sizeof(magic)) != std::string(SPILL_MAGIC, sizeof(SPILL_MAGIC)) or stored != key)
+		return nullptr;  // another key with the same file name hash
+
+	std::shared_ptr<Frames> frames(new Frames);
+	uint32_t count = getNumber(in);
+	for(uint32_t i = 0; i < count and in; i++) {
+		uint32_t end = getNumber(in);
+		if(end < (i ? frames->ends.back() : 0))
+			return nullptr;
+		frames->ends.push_back(end);
+	}
+	if(not in or (count and frames->ends.back() > SPILL_MAX_BYTES))
+		return nullptr;
+	frames->bytes.resize(count ? frames->ends.back() : 0);
+	in.read(reinterpret_cast<char*>(frames->bytes.data()), frames->bytes.size());
+	return in ? frames : nullptr;
+} // unspill
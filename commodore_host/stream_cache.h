@@ -0,0 +1,88 @@
+#ifndef STREAM_CACHE_H
+#define STREAM_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "image_cache.h"
+
+// The frames of whole loads and listings, as they go to the Arduino after an open, keyed by a hash of the image's
+// contents and the name asked for. A popular title is read from its image and framed once, later loads of it on any
+// link copy the finished frames out. Entries beyond the memory limit are dropped least recently used first, and
+// written to the spill folder when there is one, so they come back without touching the image. Not thread safe.
+class StreamCache
+{
+public:
+	// Frames in the order they are sent, sequence numbers from 0 when framed
+	struct Frames {
+		std::vector<uint8_t> bytes;
+		std::vector<uint32_t> ends;  // end of each frame in bytes
+
+		size_t count() const { return ends.size(); }
+		const uint8_t* frame(size_t i) const { return bytes.data() + (i ? ends[i - 1] : 0); }
+		size_t frameSize(size_t i) const { return ends[i] - (i ? ends[i - 1] : 0); }
+		void add(const std::vector<uint8_t>& frame);
+	};
+
+	struct Stats {
+		uint64_t hits = 0;        // streams found in memory
+		uint64_t spillHits = 0;   // streams read back from the spill folder
+		uint64_t misses = 0;      // streams built from the image
+		uint64_t evictions = 0;
+		uint64_t bytesServed = 0; // frame bytes sent from cached streams
+	};
+
+	enum Kind {
+		FILE_BLOCKS = 'B',
+		LISTING = 'L'
+	};
+
+	static const size_t DEFAULT_MEMORY_BYTES = 16 << 20;
+
+	explicit StreamCache(size_t memoryBytes = DEFAULT_MEMORY_BYTES);
+
+	// Folder for entries pushed out of memory, "" for none. It is created when missing, false if it cannot be.
+	bool setSpillFolder(const std::string& folder);
+	void setMemoryLimit(size_t bytes);
+
+	// Key of the stream of name on the image, or of its listing. The image is hashed once per mapping.
+	std::string key(const std::shared_ptr<const MappedFile>& image, Kind kind, bool framed, const std::string& name);
+
+	// The stream for key, null when it has to be built.
+	std::shared_ptr<const Frames> find(const std::string& key);
+	void insert(const std::string& key, std::shared_ptr<const Frames> frames);
+
+	Stats& stats() { return m_stats; }
+	const Stats& stats() const { return m_stats; }
+	size_t size() const { return m_entries.size(); }
+	size_t bytes() const { return m_bytes; }
+
+private:
+	struct Entry {
+		std::string key;
+		std::shared_ptr<const Frames> frames;
+		bool spilled;  // a copy is in the spill folder
+	};
+
+	std::string spillPath(const std::string& key) const;
+	bool spill(const Entry& entry) const;
+	std::shared_ptr<const Frames> unspill(const std::string& key) const;
+	void add(const std::string& key, std::shared_ptr<const Frames> frames, bool spilled);
+	void trim();
+
+	size_t m_limit;
+	size_t m_bytes;
+	std::string m_spill;
+	std::list<Entry> m_entries;  // most recently used first
+	std::unordered_map<std::string, std::list<Entry>::iterator> m_byKey;
+	std::map<const MappedFile*, std::pair<std::weak_ptr<const MappedFile>, uint64_t>> m_hashes;
+	Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+// Compile-time board profiles. Everything that differs between the supported boards is declared once here, and the
+// sketch picks the profile for the MCU it is built for as Board. Adding a board means adding one profile: a section
+// of pin macros for the Epyx assembler (which cannot see C++) and a struct with the same members as the others.
+//
+// The Epyx pin macros are AVR pin names, see the README on how to find them for other board pins. Data and clock
+// must share one port, ATN may sit on another. IEC_OBIT_ATN_LINES is the ATN bit when ATN shares the data/clock
+// port, otherwise 0.
+
+#include <avr/io.h>
+
+#if defined(__AVR_ATmega328P__)
+
+// Uno and Nano: hardware serial through a USB bridge, all bus lines on port D (board pins 2 to 5)
+#define BOARD_USB_TRANSPORT 0
+#define IEC_INPUT_ATN           PIND
+#define IEC_OPIN_ATN            PD2  //pin 2
+#define IEC_INPUT_LINES         PIND
+#define IEC_OUTPUT_LINES        PORTD
+#define IEC_OPIN_CLOCK          PD3  //pin 3
+#define IEC_OPIN_DATA           PD4  //pin 4
+#define IEC_OPIN_SRQ            PD5  //pin 5
+#define IEC_OBIT_ATN_LINES      _BV(IEC_OPIN_ATN)
+
+#elif defined(__AVR_ATmega2560__)
+
+// Mega: hardware serial through a USB bridge, bus lines on port A (board pins 22 to 25)
+#define BOARD_USB_TRANSPORT 0
+#define IEC_INPUT_ATN           PINA
+#define IEC_OPIN_ATN            PA0  //pin 22
+#define IEC_INPUT_LINES         PINA
+#define IEC_OUTPUT_LINES        PORTA
+#define IEC_OPIN_CLOCK          PA1  //pin 23
+#define IEC_OPIN_DATA           PA2  //pin 24
+#define IEC_OPIN_SRQ            PA3  //pin 25
+#define IEC_OBIT_ATN_LINES      _BV(IEC_OPIN_ATN)
+
+#else
+
+// Pro Micro and Leonardo (ATmega32U4): native USB, ATN on port B, the other lines on port F
+#ifdef USBCON
+#define BOARD_USB_TRANSPORT 1
+#else
+#define BOARD_USB_TRANSPORT 0
+#endif
+#define IEC_INPUT_ATN           PINB
+#define IEC_OPIN_ATN            PB5  //pin 9
+#define IEC_INPUT_LINES         PINF
+#define IEC_OUTPUT_LINES        PORTF
+#define IEC_OPIN_CLOCK          PF7  //pin 18
+#define IEC_OPIN_DATA           PF6  //pin 19
+#define IEC_OPIN_SRQ            PF5  //pin 20
+#define IEC_OBIT_ATN_LINES      0
+
+#endif
+
+#define IEC_OBIT_ATN   _BV(IEC_OPIN_ATN)
+#define IEC_OBIT_DATA  _BV(IEC_OPIN_DATA)
+#define IEC_OBIT_CLOCK _BV(IEC_OPIN_CLOCK)
+#define IEC_OBIT_SRQ   _BV(IEC_OPIN_SRQ)
+
+#ifndef __ASSEMBLER__
+
+#include <Arduino.h>
+
+// Largest host frame: type, length, sequence number, a 254 byte block and the CRC.
+#define BOARD_FRAME_BYTES (254 + 5)
+
+// Members every profile has:
+//   USB_TRANSPORT         native USB CDC, the host holds bytes back until the sketch reads them. Otherwise a
+//                         serial port through a USB bridge, which drops bytes that arrive while interrupts are off
+//   RX_BUFFER_BYTES       bytes the transport holds for the sketch
+//   BLOCK_BUFFERS         host blocks the look-ahead buffer holds at most (HostLink), if the arena has the room
+//   PREFETCH              ask the host for the next block before the current one goes on the bus, and for the
+//                         second block of a file while the Commodore turns the bus around. Needs USB_TRANSPORT
+//   CHANNEL_SLOTS         data channels (2-14) open at once, their read-ahead sized from the arena (interface.h)
+//   LOG_RING_EVENTS       events the log holds until the next idle point, a power of two
+//   STACK_RESERVE_BYTES   stack kept clear below the memory arena (memory.h)
+//   EPYX_*_PIN            board pins the Epyx assembler is built for, checked against the pins the host sets
+
+struct BoardUno {
+	enum {
+		USB_TRANSPORT = false,
+		RX_BUFFER_BYTES = SERIAL_RX_BUFFER_SIZE,
+		BLOCK_BUFFERS = 1,
+		PREFETCH = false,
+		CHANNEL_SLOTS = 2,
+		LOG_RING_EVENTS = 8,
+		STACK_RESERVE_BYTES = 320,
+		EPYX_ATN_PIN = 2,
+		EPYX_CLOCK_PIN = 3,
+		EPYX_DATA_PIN = 4
+	};
+};
+
+struct BoardMega {
+	enum {
+		USB_TRANSPORT = false,
+		RX_BUFFER_BYTES = SERIAL_RX_BUFFER_SIZE,
+		BLOCK_BUFFERS = 1,
+		PREFETCH = false,
+		CHANNEL_SLOTS = 4,
+		LOG_RING_EVENTS = 32,
+		STACK_RESERVE_BYTES = 384,
+		EPYX_ATN_PIN = 22,
+		EPYX_CLOCK_PIN = 23,
+		EPYX_DATA_PIN = 24
+	};
+};
+
+struct BoardProMicro {
+	enum {
+		USB_TRANSPORT = BOARD_USB_TRANSPORT,
+#if BOARD_USB_TRANSPORT
+		RX_BUFFER_BYTES = USB_EP_SIZE,
+#else
+		RX_BUFFER_BYTES = SERIAL_RX_BUFFER_SIZE,
+#endif
+		BLOCK_BUFFERS = 2,
+		PREFETCH = BOARD_USB_TRANSPORT,
+		CHANNEL_SLOTS = 4,
+		LOG_RING_EVENTS = 32,
+		STACK_RESERVE_BYTES = 384,
+		EPYX_ATN_PIN = 9,
+		EPYX_CLOCK_PIN = 18,
+		EPYX_DATA_PIN = 19
+	};
+};
+
+#if defined(__AVR_ATmega328P__)
+typedef BoardUno Board;
+#elif defined(__AVR_ATmega2560__)
+typedef BoardMega Board;
+#else
+typedef BoardProMicro Board;
+#endif
+
+static_assert((Board::LOG_RING_EVENTS & (Board::LOG_RING_EVENTS - 1)) == 0, "LOG_RING_EVENTS must be a power of two");
+static_assert(not Board::PREFETCH or (Board::USB_TRANSPORT and Board::BLOCK_BUFFERS >= 2),
+		"prefetching needs the USB transport and room for two blocks");
+
+#endif // __ASSEMBLER__
+
+#endif
@@ -6,6 +6,9 @@ namespace CBM {
 // Largest Serial byte buffer request from / to arduino.
 #define MAX_BYTES_PER_REQUEST 256
 
+// Bytes in a disk sector, the size of the direct access buffer.
+#define SECTOR_BYTES 256
+
 // Device OPEN channels.
 // Special channels.
 enum IECChannels {
@@ -14,6 +17,42 @@ enum IECChannels {
 	CMD_CHANNEL = 15
 };
 
+// DOS status codes served on the command channel.
+enum DOSStatus {
+	DOS_OK = 0,
+	DOS_READ_ERROR = 20,
+	DOS_WRITE_PROTECT_ON = 26,
+	DOS_SYNTAX_ERROR = 30,
+	DOS_SYNTAX_LONG_LINE = 32,
+	DOS_RECORD_NOT_PRESENT = 50,
+	DOS_FILE_NOT_FOUND = 62,
+	DOS_FILE_EXISTS = 63,
+	DOS_FILE_TYPE_MISMATCH = 64,
+	DOS_ILLEGAL_TRACK_SECTOR = 66,
+	DOS_NO_CHANNEL = 70,
+	DOS_DISK_FULL = 72,
+	DOS_VERSION = 73,
+	DOS_DRIVE_NOT_READY = 74
+};
+
+// Host handshake mode flags, the first field of the handshake line.
+enum HostModes {
+	HOST_MODE_FRAMED = 0x01,  // Blocks carry a sequence number and CRC-16, a bad block is re-requested
+	HOST_MODE_DRIVE_CODE = 0x02,  // Host runs unknown M-E drive code and returns its serial bus activity in 'T' blocks
+	HOST_MODE_SECTORS = 0x04,  // Host reads and writes whole sectors with 'S' and 'Y' frames
+	HOST_MODE_CHANNELS = 0x08,  // Data channels stay open on the host, which streams into them on 'G' requests
+	HOST_MODE_EVENTS = 0x10,  // Host decodes the event log, sent in 'V' frames while the bus is idle
+	HOST_MODE_RECORDS = 0x20,  // P commands on relative files are sent as 'P' frames, the host answers with the record. Implies HOST_MODE_CHANNELS
+	HOST_MODE_SNIFF = 0x40  // Drive nothing, pass every byte on the bus to the host in 'Z' frames
+};
+
+// Flags of a 'Z' frame in sniffer mode.
+enum SniffFlags {
+	SNIFF_ATN = 0x01,  // sent under ATN, a bus command
+	SNIFF_EOI = 0x02,  // the last byte, signalled with EOI
+	SNIFF_CLOCK = 0x80  // no byte, the time field is the timer ticks per second of the others
+};
+
 } // namespace CBM
 
 #endif // CBMDEFINES_H
@@ -1,5 +1,7 @@
 #include "iec_driver.h"
+#include "host_link.h"
 #include "interface.h"
+#include "log.h"
 
 #define DEFAULT_BAUD_RATE 115200
 #define SERIAL_TIMEOUT_MSECS 1000
@@ -9,11 +11,14 @@
 #define HANDSHAKE_OK "<END>\r"
 
 #define CONNECT_BLINKS 2
+#define MAX_DEVICE_NUMBER 30
 
 static IEC iec(8);
-static Interface iface(iec);
+static HostLink host;
+static Interface iface(iec, host);
 
-unsigned mode, deviceNumber, atnPin, clockPin, dataPin, resetPin;
+unsigned mode, atnPin, clockPin, dataPin, resetPin, srqPin;
+unsigned long deviceNumber;  // or a mask, 32 bits as it may have bits up to 30
 
 void setup()
 {
@@ -24,9 +29,21 @@ void setup()
   Serial.setTimeout(SERIAL_TIMEOUT_MSECS);
 
   connectMediaHost();
-  iec.setDeviceNumber(deviceNumber);
-  iec.setPins(atnPin, clockPin, dataPin, resetPin);
-  iec.init();
+  //A small value is the device number, anything bigger a mask of the devices to answer for (bit 8 for device 8...).
+  //Only devices 8 to 23 are answered, see IEC::setDeviceMask
+  if(deviceNumber <= MAX_DEVICE_NUMBER)
+    iec.setDeviceNumber(deviceNumber);
+  else
+    iec.setDeviceMask(deviceNumber);
+  iec.setPins(atnPin, clockPin, dataPin, resetPin, srqPin);
+  if(not (mode bitand CBM::HOST_MODE_SNIFF))  //init() drives the lines for a moment, a sniffer must not touch them
+    iec.init();
+  host.begin();
+  host.setTimeout(SERIAL_TIMEOUT_MSECS);
+  Log(LOG_AHEAD_BUFFER, host.aheadSize());
+  iface.begin();
+  Log(LOG_CHANNEL_BUFFERS, CHANNEL_SLOTS, iface.channelBufferSize());
+  iface.setMode(mode);
 
 } // setup
 
@@ -42,7 +59,7 @@ void loop()
 //Establish connection with the media host
 static void connectMediaHost()
 {
-  char tempBuffer[64];
+  char tempBuffer[40];  // longest line is 34 characters, "255|4294967295|255|255|255|255|255" with a device mask and SRQ
 
   //Initial handshake
   while (true) {
@@ -63,9 +80,12 @@ static void connectMediaHost()
 
   //Receive the pins and other assignments from the media host
   while (true) {
-    if(Serial.readBytesUntil('\r', tempBuffer, sizeof(tempBuffer))) {
-      sscanf_P(tempBuffer, (PGM_P)F("%u|%u|%u|%u|%u|%u"),
-              &mode, &deviceNumber, &atnPin, &clockPin, &dataPin, &resetPin);
+    size_t length = Serial.readBytesUntil('\r', tempBuffer, sizeof(tempBuffer) - 1);
+    if(length) {
+      tempBuffer[length] = '\0';
+      //The SRQ pin is optional, without it there is no C128 burst mode
+      sscanf_P(tempBuffer, (PGM_P)F("%u|%lu|%u|%u|%u|%u|%u"),
+              &mode, &deviceNumber, &atnPin, &clockPin, &dataPin, &resetPin, &srqPin);
       break;
     }
   }
@@ -0,0 +1,109 @@
+#include <Arduino.h>
+#include "epyxfastload.h"
+
+// C64 cycles from the first to the last clock edge of a byte the cartridge sends in the gijoe protocol, at full speed:
+// asm_gijoe_receive times the 7 intervals between the 8 edges, taken as 14 cycles a bit. That is the nominal rate, it
+// is not counted from the cartridge's send loop, which is not at hand. The LOG_EPYX_TIMING event has the AVR cycles
+// measured, so it can be checked against a machine of known clock.
+#define EPYX_GIJOE_BYTE_CYCLES 98
+
+// How far the clock from the gijoe timing may be off PAL or NTSC, in parts per thousand. They are 38 apart, so up to
+// 18 still tells them apart, and covers a cycle miscounted in EPYX_GIJOE_BYTE_CYCLES (10) on top of the 9 AVR cycle
+// polling of the edges (under 6 at 16 MHz).
+#define EPYX_CLOCK_TOLERANCE 18
+
+// C64 cycles per bit pair slot of the cartridge's receive loop, and the final hold.
+#define EPYX_SLOT_CYCLES 10
+#define EPYX_HOLD_CYCLES 20
+
+uint8_t epyx_delays[EPYX_DELAY_SLOTS];
+uint16_t gijoe_min_span;
+
+namespace {
+
+// Timer1 setup while not timing
+byte timerA, timerB;
+
+// AVR cycles of asm_epyxcart_send_byte around the table delays (see epyxfastload.S)
+const byte CALL_TO_OUT = 8 + RCALL_OFFSET;  // rcall epyx_bitpair to its out
+const byte RETURN = 4 + RET_OFFSET;  // out to the end of the ret
+const byte PAIR_PREP[EPYX_DELAY_SLOTS - 1] = { 2, 1, 2, 1 };  // instructions ahead of each bit pair's delay
+
+byte delayCount(long cycles)
+{
+	return constrain((cycles - EPYX_TABLE_DELAY_CYCLES + 1) / 3, 1, 255);  // nearest
+} // delayCount
+
+byte delayCountUp(long cycles)
+{
+	return constrain((cycles - EPYX_TABLE_DELAY_CYCLES + 2) / 3, 1, 255);  // at least cycles
+} // delayCountUp
+
+bool near(unsigned long hz, unsigned long nominal)
+{
+	unsigned long off = hz > nominal ? hz - nominal : nominal - hz;
+	return off < nominal / 1000 * EPYX_CLOCK_TOLERANCE;
+} // near
+
+} // unnamed namespace
+
+
+void epyxSetTiming(unsigned long c64Hz)
+{
+	// A slot in AVR cycles, in 1/16 cycle steps. The bit pairs go out at whole multiples of it after DATA went high,
+	// each delay rounded to the nearest count, taking up the rounding of the delays before.
+	const long slot16 = 16L * EPYX_SLOT_CYCLES * (F_CPU / 1000) / (c64Hz / 1000);
+	long target16 = 0, at = 0;
+
+	for(byte pair = 0; pair < EPYX_DELAY_SLOTS - 1; pair++) {
+		target16 += slot16;
+		long fixed = (pair ? RETURN : 0) + PAIR_PREP[pair] + CALL_TO_OUT;
+		byte count = delayCount((target16 + 8) / 16 + PAIR_PREP[0] - at - fixed);
+		epyx_delays[pair] = count;
+		at += fixed + EPYX_TABLE_DELAY_CYCLES + 3 * count;
+	}
+
+	// The hold is a minimum, round up, both the cycles and the count
+	long hold = (slot16 * EPYX_HOLD_CYCLES / EPYX_SLOT_CYCLES + 15) / 16 - RETURN;
+	epyx_delays[EPYX_DELAY_SLOTS - 1] = delayCountUp(hold + 2);
+} // epyxSetTiming
+
+
+void epyxBeginTiming()
+{
+	// Free running at the CPU clock, it wraps after 4 ms at 16 MHz, well above a byte
+	timerA = TCCR1A;
+	timerB = TCCR1B;
+	TCCR1A = 0;
+	TCCR1B = _BV(CS10);
+	gijoe_min_span = 0xFFFF;
+} // epyxBeginTiming
+
+
+word epyxEndTiming()
+{
+	TCCR1A = timerA;
+	TCCR1B = timerB;
+	return gijoe_min_span == 0xFFFF ? 0 : gijoe_min_span;
+} // epyxEndTiming
+
+
+EpyxTiming epyxCalibrate(word gijoeCycles)
+{
+	EpyxTiming timing = EPYX_TIMING_GENERIC;
+
+	if(gijoeCycles) {
+		unsigned long hz = F_CPU / gijoeCycles * EPYX_GIJOE_BYTE_CYCLES;
+		if(near(hz, EPYX_CLOCK_PAL))
+			timing = EPYX_TIMING_PAL;
+		else if(near(hz, EPYX_CLOCK_NTSC))
+			timing = EPYX_TIMING_NTSC;
+	}
+
+	switch(timing) {
+		case EPYX_TIMING_PAL: epyxSetTiming(EPYX_CLOCK_PAL); break;
+		case EPYX_TIMING_NTSC: epyxSetTiming(EPYX_CLOCK_NTSC); break;
+		default: epyxSetTiming(EPYX_CLOCK_GENERIC); break;
+	}
+	return timing;
+} // epyxCalibrate
@@ -1,29 +1,86 @@
-//Mixed board pin to AVR chip pin mappings across port B and F
-# define IEC_INPUT_B            PINB
-# define IEC_OUTPUT_B           PORTB
-# define IEC_OPIN_ATN           PB5  //pin 9
-
-# define IEC_INPUT_F            PINF
-# define IEC_OUTPUT_F           PORTF
-# define IEC_OPIN_SRQ           PF5  //pin 20
-# define IEC_OPIN_DATA          PF6  //pin 19
-# define IEC_OPIN_CLOCK         PF7  //pin 18
-
-# define IEC_OBIT_ATN   _BV(IEC_OPIN_ATN)
-# define IEC_OBIT_DATA  _BV(IEC_OPIN_DATA)
-# define IEC_OBIT_CLOCK _BV(IEC_OPIN_CLOCK)
-# define IEC_OBIT_SRQ   _BV(IEC_OPIN_SRQ)
+//Board pin to AVR chip pin mappings come from the board profile (board.h)
+#include "board.h"
 
+//The assembler delays are counted in cycles of F_CPU. The assembler cannot read F_CPU's long suffix, so it gets the
+//same value without one. A delay that does not come out in whole cycles or that the code around it already takes
+//longer than fails the build (delay_05us in epyxfastload.S)
+#if F_CPU == 8000000L
+# define CONFIG_MCU_FREQ 8000000
+#elif F_CPU == 12000000L
+# define CONFIG_MCU_FREQ 12000000
+#elif F_CPU == 16000000L
 # define CONFIG_MCU_FREQ 16000000
+#elif F_CPU == 20000000L
+# define CONFIG_MCU_FREQ 20000000
+#else
+# error "No Epyx fastload timing for this F_CPU, add it to epyxfastload.h"
+#endif
+
+// RCALL and RET each take an additional cycle on MCUs with >128kB
+// program memory (and therefore a 22 bit PC).
+// These are defined as offset to the (16 bit PC) base value instead of
+// absolute cycles because that simplifies delay cycle calculation.
+#ifndef __AVR_3_BYTE_PC__
+#  define RCALL_OFFSET  0
+#  define RET_OFFSET    0
+#else
+#  define RCALL_OFFSET  1
+#  define RET_OFFSET    1
+#endif
+
+//The send delays come from a table, one per bit pair and the final hold, so they can follow the C64's clock.
+//A table delay takes 3 cycles per count plus this
+# define EPYX_DELAY_SLOTS 5
+# define EPYX_TABLE_DELAY_CYCLES (8 + RCALL_OFFSET + RET_OFFSET)
+
+//gijoe receive: how long a clock edge is waited for, and the results of asm_gijoe_receive
+# define GIJOE_TIMEOUT_US 325000
+# define GIJOE_OK 0
+# define GIJOE_TIMEOUT 1
+# define GIJOE_ATN 2
 
 #ifdef __ASSEMBLER__
 
 .global asm_epyxcart_send_byte
+.global asm_gijoe_receive
 
 #endif
 
 #ifndef __ASSEMBLER__
 
 extern "C" uint8_t asm_epyxcart_send_byte(uint8_t byte);
+extern "C" uint8_t epyx_delays[EPYX_DELAY_SLOTS];
+
+//Receive count bytes using the gijoe protocol into buf, or nowhere when buf is NULL, XORing them into checksum.
+//Interrupts must be off. Returns GIJOE_OK, GIJOE_TIMEOUT when the C64 stopped or GIJOE_ATN when it pulled ATN
+extern "C" uint8_t asm_gijoe_receive(uint8_t* buf, uint16_t count, uint8_t* checksum);
+
+//Shortest time, in AVR cycles on Timer1, from the first to the last clock edge of a byte asm_gijoe_receive read
+//between epyxBeginTiming() and epyxEndTiming()
+extern "C" uint16_t gijoe_min_span;
+
+//C64 clocks the send delays are computed for. Generic is the 10 us slots of a nominal 1 MHz machine, between PAL and
+//NTSC and what the cartridge was tested with on PAL before the timing was measured
+# define EPYX_CLOCK_GENERIC 1000000UL
+# define EPYX_CLOCK_PAL     985248UL
+# define EPYX_CLOCK_NTSC    1022727UL
+
+enum EpyxTiming {
+	EPYX_TIMING_GENERIC = 0,
+	EPYX_TIMING_PAL = 1,
+	EPYX_TIMING_NTSC = 2
+};
+
+//Set the send delays for a C64 running at c64Hz
+void epyxSetTiming(unsigned long c64Hz);
+
+//Time the gijoe bytes received in between on Timer1, free running at F_CPU meanwhile. epyxEndTiming() returns the
+//AVR cycles a byte took at full speed (bytes the C64 slowed down, e.g. on a badline, only take longer), 0 for none
+void epyxBeginTiming();
+word epyxEndTiming();
+
+//Pick the send delays from the AVR cycles a gijoe byte took, generic when the C64 clock they give is neither PAL
+//nor NTSC
+EpyxTiming epyxCalibrate(word gijoeCycles);
 
 #endif
\ No newline at end of file
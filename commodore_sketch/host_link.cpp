@@ -0,0 +1,243 @@
+#include "host_link.h"
+#include "memory.h"
+
+#define DEFAULT_TIMEOUT_MSECS 1000
+
+HostLink::HostLink()
+	: m_timeout(DEFAULT_TIMEOUT_MSECS), m_ahead(NULL), m_aheadSize(0), m_aheadPos(0), m_aheadEnd(0)
+#ifdef HOSTLINK_USB_ENDPOINT
+	, m_peek(-1), m_txLen(0)
+#endif
+{}
+
+
+void HostLink::begin()
+{
+	m_aheadSize = min(Memory::arenaFree(), word(HOSTLINK_AHEAD_MAX_BYTES));
+	m_ahead = static_cast<byte*>(Memory::arenaAlloc(m_aheadSize));
+	if(m_ahead == NULL)
+		m_aheadSize = 0;
+} // begin
+
+
+void HostLink::setTimeout(unsigned long msecs)
+{
+	m_timeout = msecs;
+#ifndef HOSTLINK_USB_ENDPOINT
+	Serial.setTimeout(msecs);
+#endif
+} // setTimeout
+
+
+int HostLink::available()
+{
+	return (m_aheadEnd - m_aheadPos) + linkAvailable();
+} // available
+
+
+int HostLink::peek()
+{
+	return m_aheadPos < m_aheadEnd ? m_ahead[m_aheadPos] : linkPeek();
+} // peek
+
+
+int HostLink::read()
+{
+	if(m_aheadPos == m_aheadEnd)
+		return linkRead();
+
+	byte data = m_ahead[m_aheadPos++];
+	if(m_aheadPos == m_aheadEnd)
+		m_aheadPos = m_aheadEnd = 0;
+	return data;
+} // read
+
+
+size_t HostLink::readBytes(void* buf, size_t len)
+{
+	byte* dst = static_cast<byte*>(buf);
+	size_t count = min(len, size_t(m_aheadEnd - m_aheadPos));
+
+	memmove(dst, m_ahead + m_aheadPos, count);
+	m_aheadPos += count;
+	if(m_aheadPos == m_aheadEnd)
+		m_aheadPos = m_aheadEnd = 0;
+
+	return count < len ? count + linkReadBytes(dst + count, len - count) : count;
+} // readBytes
+
+
+word HostLink::drain()
+{
+	while(m_aheadEnd < m_aheadSize and linkAvailable() > 0) {
+		int data = linkRead();
+		if(data < 0)
+			break;
+		m_ahead[m_aheadEnd++] = data;
+	}
+	return m_aheadEnd - m_aheadPos;
+} // drain
+
+
+#ifdef HOSTLINK_USB_ENDPOINT
+
+int HostLink::linkAvailable()
+{
+	if(m_txLen)  // a request may still be waiting in the packet buffer
+		flush();
+	return USB_Available(CDC_RX) + (m_peek >= 0 ? 1 : 0);
+} // linkAvailable
+
+
+int HostLink::linkPeek()
+{
+	if(m_peek < 0)
+		m_peek = linkRead();
+	return m_peek;
+} // linkPeek
+
+
+int HostLink::linkRead()
+{
+	byte data;
+
+	if(m_peek >= 0) {
+		data = m_peek;
+		m_peek = -1;
+		return data;
+	}
+
+	return USB_Recv(CDC_RX, &data, 1) == 1 ? data : -1;
+} // linkRead
+
+
+// Whole bulk packets are copied from the endpoint FIFO straight into the caller's buffer.
+size_t HostLink::linkReadBytes(byte* dst, size_t len)
+{
+	size_t count = 0;
+	unsigned long start = millis();
+
+	if(m_txLen)  // a request may still be waiting in the packet buffer
+		flush();
+
+	if(len and m_peek >= 0) {
+		dst[count++] = m_peek;
+		m_peek = -1;
+	}
+
+	while(count < len) {
+		int n = USB_Recv(CDC_RX, dst + count, len - count);
+		if(n > 0) {
+			count += n;
+			start = millis();
+		}
+		else if(millis() - start >= m_timeout)
+			break;
+	}
+
+	return count;
+} // linkReadBytes
+
+
+void HostLink::write(byte data)
+{
+	m_txBuf[m_txLen++] = data;
+	if(m_txLen == sizeof(m_txBuf))
+		sendPacket();
+} // write
+
+
+void HostLink::write(const void* buf, size_t len)
+{
+	const byte* src = static_cast<const byte*>(buf);
+
+	while(len--)
+		write(*src++);
+} // write
+
+
+// Room in the endpoint's bank, less the bytes gathered for it
+int HostLink::availableForWrite()
+{
+	int space = USB_SendSpace(CDC_TX) - m_txLen;
+	return space > 0 ? space : 0;
+} // availableForWrite
+
+
+void HostLink::flush()
+{
+	sendPacket();
+	USB_Flush(CDC_TX);
+} // flush
+
+
+void HostLink::push()
+{
+	flush();  // a packet is handed to the USB controller, nothing waits for the host
+} // push
+
+
+void HostLink::sendPacket()
+{
+	if(m_txLen) {
+		USB_Send(CDC_TX, m_txBuf, m_txLen);
+		m_txLen = 0;
+	}
+} // sendPacket
+
+#else
+
+int HostLink::linkAvailable()
+{
+	return Serial.available();
+} // linkAvailable
+
+
+int HostLink::linkPeek()
+{
+	return Serial.peek();
+} // linkPeek
+
+
+int HostLink::linkRead()
+{
+	return Serial.read();
+} // linkRead
+
+
+size_t HostLink::linkReadBytes(byte* buf, size_t len)
+{
+	return Serial.readBytes(reinterpret_cast<char*>(buf), len);
+} // linkReadBytes
+
+
+void HostLink::write(byte data)
+{
+	Serial.write(data);
+} // write
+
+
+void HostLink::write(const void* buf, size_t len)
+{
+	Serial.write(static_cast<const byte*>(buf), len);
+} // write
+
+
+int HostLink::availableForWrite()
+{
+	return Serial.availableForWrite();
+} // availableForWrite
+
+
+void HostLink::flush()
+{
+	Serial.flush();
+} // flush
+
+
+void HostLink::push()
+{
+	// Serial sends from its transmit buffer by interrupt, flush() would wait for the last byte
+} // push
+
+#endif
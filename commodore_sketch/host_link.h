@@ -0,0 +1,79 @@
+#ifndef HOST_LINK_H
+#define HOST_LINK_H
+
+#include <Arduino.h>
+#include "board.h"
+
+// On boards with native USB (Board::USB_TRANSPORT) the host link goes straight to the USB CDC bulk endpoints instead
+// of through the Serial class. Comment out to use Serial on these boards as well.
+#if BOARD_USB_TRANSPORT && defined(CDC_ENABLED)
+#define HOSTLINK_USB_ENDPOINT
+#endif
+
+// Most the look-ahead buffer takes from the memory arena: room for bytes the host sends before they are asked for,
+// e.g. the first blocks after an 'O', moved out of the serial buffer while the Arduino waits for the Commodore.
+// Boards with less RAM get what is free.
+#define HOSTLINK_AHEAD_MAX_BYTES (Board::BLOCK_BUFFERS * BOARD_FRAME_BYTES)
+
+// Byte transport between the Arduino and the media host.
+// Writes are gathered into full USB packets until flush() is called, so a whole frame goes out in one packet.
+// Reads take the bytes held by drain() first.
+class HostLink
+{
+public:
+	HostLink();
+
+	// Take the look-ahead buffer from the memory arena, call once from setup().
+	void begin();
+
+	void setTimeout(unsigned long msecs);
+
+	// Bytes the look-ahead buffer holds.
+	word aheadSize() const { return m_aheadSize; }
+
+	// Number of received bytes that can be read without waiting.
+	int available();
+	// Next received byte without removing it, -1 if none.
+	int peek();
+	// Read one received byte, -1 if none.
+	int read();
+	// Read len bytes, waiting up to the timeout. Returns the number of bytes read.
+	size_t readBytes(void* buf, size_t len);
+
+	// Move received bytes into the look-ahead buffer while there is room, returns the number held there.
+	word drain();
+	// Byte at offset i of the look-ahead buffer, -1 if not received yet.
+	int ahead(word i) const { return i < m_aheadEnd - m_aheadPos ? m_ahead[m_aheadPos + i] : -1; }
+
+	void write(byte data);
+	void write(const void* buf, size_t len);
+	// Bytes that can be written without waiting for the transport.
+	int availableForWrite();
+	// Push any gathered bytes out to the host now.
+	void flush();
+	// Hand gathered bytes to the transport without waiting for them to go out, for when the bus must not wait.
+	void push();
+
+private:
+	int linkAvailable();
+	int linkPeek();
+	int linkRead();
+	size_t linkReadBytes(byte* buf, size_t len);
+
+	unsigned long m_timeout;
+
+	byte* m_ahead;
+	word m_aheadSize;
+	word m_aheadPos;  // next byte to read
+	word m_aheadEnd;
+
+#ifdef HOSTLINK_USB_ENDPOINT
+	void sendPacket();
+
+	int m_peek;
+	byte m_txLen;
+	byte m_txBuf[USB_EP_SIZE];
+#endif
+};
+
+#endif
@@ -15,10 +15,48 @@ using namespace CBM;
 #define TIMING_NO_EOI       20  // delay before bits        (us)
 #define TIMING_EOI_WAIT     200 // delay to signal EOI      (us)
 #define TIMING_EOI_THRESH   20  // threshold for EOI detect (*10 us approx)
+#define TIMING_EOI_POLL     10  // EOI detect poll delay    (us)
 #define TIMING_STABLE_WAIT  20  // line stabilization       (us)
 #define TIMING_ATN_PREDELAY 50  // delay required in atn    (us)
 #define TIMING_ATN_DELAY    100 // delay required after atn (us)
 #define TIMING_FNF_DELAY    100 // delay after fnf?         (us)
+#define TIMING_TIMEOUT_POLL 2   // timeoutWait poll delay  (us)
+#define TIMING_TIMEOUT      65000UL // timeoutWait polls before it gives up
+#define TIMING_FAST_BIT     4   // SRQ low and high time in burst mode (us)
+#define SNIFF_PRESCALE      64  // Timer1 clock divider in sniffer mode, 4 us ticks at 16 MHz
+
+// The timings above were tuned at 16 MHz, the only clock the sketch is tested at, together with the time the pin
+// calls around them take there. On other clocks those calls take longer or shorter, so the loops make up the
+// difference and keep their 16 MHz period; at 16 MHz every delay and count below is the one above. The cycle counts
+// are the least a call to readPIN() (pinMode() and digitalRead()) and writePIN() take.
+#define CYCLES_PER_US       (F_CPU / 1000000UL)
+#define TUNED_CYCLES_PER_US 16UL
+#define READ_PIN_CYCLES     64
+#define WRITE_PIN_CYCLES    48
+#define READ_PIN_US         (READ_PIN_CYCLES / CYCLES_PER_US)
+#define TUNED_READ_PIN_US   (READ_PIN_CYCLES / TUNED_CYCLES_PER_US)
+
+// Microseconds a pin call takes longer than at 16 MHz, negative on a faster part
+#define READ_PIN_EXTRA_US   (long(READ_PIN_US) - long(TUNED_READ_PIN_US))
+#define WRITE_PIN_EXTRA_US  (long(WRITE_PIN_CYCLES / CYCLES_PER_US) - long(WRITE_PIN_CYCLES / TUNED_CYCLES_PER_US))
+
+// EOI detect: the CLOCK poll takes as long as at 16 MHz, so TIMING_EOI_THRESH polls are the same time.
+#define EOI_POLL_DELAY_US   (TIMING_EOI_POLL - READ_PIN_EXTRA_US)
+
+// timeoutWait: the 16 MHz poll period where the delay can make up for readPIN(), otherwise fewer of the longer polls.
+#define TIMEOUT_POLL_US     (TIMING_TIMEOUT_POLL > READ_PIN_EXTRA_US ? TIMING_TIMEOUT_POLL - READ_PIN_EXTRA_US : 0)
+#define TIMEOUT             (TIMING_TIMEOUT * (TIMING_TIMEOUT_POLL + TUNED_READ_PIN_US) / (TIMEOUT_POLL_US + READ_PIN_US))
+
+// Half a bit is two pin writes and a delay.
+#define BIT_DELAY_US        (TIMING_BIT - 2 * WRITE_PIN_EXTRA_US)
+
+static_assert(F_CPU % 1000000UL == 0, "F_CPU must be a whole number of MHz");
+static_assert(CYCLES_PER_US >= 8, "the IEC and Epyx timing needs at least 8 MHz");
+static_assert(EOI_POLL_DELAY_US >= 2, "readPIN() takes too long for the EOI detect at this F_CPU");
+static_assert(TIMEOUT <= 0xFFFF, "timeoutWait count does not fit its counter at this F_CPU");
+static_assert(BIT_DELAY_US >= 20, "pin writes take more of the bit time than the listener allows at this F_CPU");
+static_assert(F_CPU != 16000000UL or (EOI_POLL_DELAY_US == TIMING_EOI_POLL and TIMEOUT == TIMING_TIMEOUT
+		and TIMEOUT_POLL_US == TIMING_TIMEOUT_POLL and BIT_DELAY_US == TIMING_BIT), "16 MHz must keep the tuned timing");
 
 // Version 0.5 equivalent timings: 70, 5, 200, 20, 20, 50, 100, 100
 
@@ -37,13 +75,11 @@ using namespace CBM;
 #define DEFAULT_CLOCK_PIN 4
 #define DEFAULT_RESET_PIN 7
 
-// See timeoutWait below.
-#define TIMEOUT  65000
-
 IEC::IEC(byte deviceNumber) :
-	m_state(noFlags), m_deviceNumber(deviceNumber),
+	m_state(noFlags), m_deviceMask(1UL << deviceNumber),
 	m_atnPin(DEFAULT_ATN_PIN), m_dataPin(DEFAULT_DATA_PIN),
-	m_clockPin(DEFAULT_CLOCK_PIN), m_resetPin(DEFAULT_RESET_PIN)
+	m_clockPin(DEFAULT_CLOCK_PIN), m_resetPin(DEFAULT_RESET_PIN), m_srqPin(0), m_fastClock(true),
+	m_sniffOverflows(0)
 #ifdef DEBUGLINES
 ,m_lastMillis(0)
 #endif
@@ -65,7 +101,7 @@ byte IEC::timeoutWait(byte waitBit, boolean whileHigh)
 		if(c)
 			return false;
 
-		delayMicroseconds(2); // The aim is to make the loop at least 3 us
+		delayMicroseconds(TIMEOUT_POLL_US);
 		t++;
 	}
 
@@ -106,8 +142,8 @@ byte IEC::receiveByte(void)
 
 	// Record how long CLOCK is high, more than 200 us means EOI
 	byte n = 0;
-	while(readCLOCK() and (n < 20)) {
-		delayMicroseconds(10);  // this loop should cycle in about 10 us...
+	while(readCLOCK() and (n < TIMING_EOI_THRESH)) {
+		delayMicroseconds(EOI_POLL_DELAY_US);  // this loop should cycle in about 10 us...
 		n++;
 	}
 
@@ -191,9 +227,9 @@ boolean IEC::sendByte(byte data, boolean signalEOI)
 		// set data
 		writeDATA((data bitand 1) ? false : true);
 
-		delayMicroseconds(TIMING_BIT);
+		delayMicroseconds(BIT_DELAY_US);
 		writeCLOCK(false);
-		delayMicroseconds(TIMING_BIT);
+		delayMicroseconds(BIT_DELAY_US);
 
 		data >>= 1;
 	}
@@ -213,31 +249,6 @@ boolean IEC::sendByte(byte data, boolean signalEOI)
 	return true;
 } // sendByte
 
-//Semi-fastload protocol "gijoe" read byte
-int16_t IEC::gijoe_read_byte(void) {
-  uint8_t i;
-  uint8_t value = 0;
-  char buffer[80];
-
-  for (i=0;i<4;i++) {
-
-	value >>= 1;
-	if(timeoutWait(m_clockPin, true))  //Wait until clock becomes low/false (wait while high/true)
-		return -1;
-	if (readDATA() == false)
-		value |= 0x80;
-
-	value >>= 1;
-	if(timeoutWait(m_clockPin, false))  //Wait until clock becomes high/true (wait while low/false)
-		return -1;
-	if (readDATA() == false)
-		value |= 0x80;
-
-  }
-
-  return value;
-}
-
 void IEC::setClock(boolean state)
 {
 	writeCLOCK(state);
@@ -258,6 +269,11 @@ byte IEC::getData()
 	return readDATA();
 } // getData
 
+byte IEC::getClock()
+{
+	return readCLOCK();
+} // getClock
+
 // IEC turnaround
 boolean IEC::turnAround(void)
 {
@@ -320,7 +336,11 @@ IEC::ATNCheck IEC::checkATN(ATNCmd& cmd)
 			return ATN_ERROR;
     }
 
-		if(c == (ATN_CODE_LISTEN bitor m_deviceNumber)) {
+		if((c bitand ~ATN_DEVICE_MASK) == ATN_CODE_LISTEN and servesDevice(c bitand ATN_DEVICE_MASK)) {
+			cmd.device = c bitand ATN_DEVICE_MASK;
+			if(m_srqPin)
+				shiftFast(0, false);  // tell a C128 we do burst mode
+
 			// Okay, we will listen.
 			// Get the first cmd byte, the cmd code
 			c = (ATNCommand)receiveByte();
@@ -348,8 +368,9 @@ IEC::ATNCheck IEC::checkATN(ATNCmd& cmd)
 						break;
 
 					if(i >= ATN_CMD_MAX_LENGTH) {
-						// Buffer is going to overflow, this is an error condition
-						// FIXME: here we should propagate the error type being overflow so that reading error channel can give right code out.
+						// Buffer is going to overflow, this is an error condition.
+						// The overflow flag lets the error channel report it.
+						m_state = errorFlag bitor overflowFlag;
 						return ATN_ERROR;
 					}
 					cmd.str[i++] = c;
@@ -357,7 +378,11 @@ IEC::ATNCheck IEC::checkATN(ATNCmd& cmd)
 				ret = ATN_CMD;
 			}
 		}
-		else if (c == (ATN_CODE_TALK bitor m_deviceNumber)) {
+		else if ((c bitand ~ATN_DEVICE_MASK) == ATN_CODE_TALK and servesDevice(c bitand ATN_DEVICE_MASK)) {
+			cmd.device = c bitand ATN_DEVICE_MASK;
+			if(m_srqPin)
+				shiftFast(0, false);
+
 			// Okay, we will talk soon, record cmd string while ATN is active
 			// First byte is cmd code, that we CAN at least expect. All else depends on ATN.
 			c = (ATNCommand)receiveByte();
@@ -374,8 +399,9 @@ IEC::ATNCheck IEC::checkATN(ATNCmd& cmd)
           }
 
 					if(i >= ATN_CMD_MAX_LENGTH) {
-						// Buffer is going to overflow, this is an error condition
-						// FIXME: here we should propagate the error type being overflow so that reading error channel can give right code out.
+						// Buffer is going to overflow, this is an error condition.
+						// The overflow flag lets the error channel report it.
+						m_state = errorFlag bitor overflowFlag;
 						return ATN_ERROR;
 					}
 					cmd.str[i++] = c;
@@ -459,6 +485,137 @@ boolean IEC::sendFNF()
 } // sendFNF
 
 
+boolean IEC::hasFastSerial() const
+{
+	return m_srqPin != 0;
+} // hasFastSerial
+
+
+// Burst mode starts after the command that asked for it, the C128 toggles CLOCK from here for each byte.
+void IEC::beginFast()
+{
+	writeDATA(false);
+	m_fastClock = readCLOCK();
+} // beginFast
+
+
+// Burst mode send: wait for the C128 to toggle CLOCK, then shift the byte out.
+boolean IEC::sendFast(byte data)
+{
+	m_state = noFlags;
+
+	// timeoutWait releases the lines and sets the error flag when the C128 is gone
+	if(timeoutWait(m_clockPin, m_fastClock))
+		return false;
+	m_fastClock = not m_fastClock;
+
+	shiftFast(data, true);
+	return true;
+} // sendFast
+
+
+void IEC::endFast()
+{
+	writeDATA(false);
+	writeSRQ(false);
+} // endFast
+
+
+void IEC::beginSniff()
+{
+	// Free running, the overflows are counted as the sniffer polls
+	TCCR1A = 0;
+	TCCR1B = _BV(CS11) | _BV(CS10);
+	TIFR1 = _BV(TOV1);
+	m_sniffOverflows = 0;
+} // beginSniff
+
+
+unsigned long IEC::sniffTicksPerSecond()
+{
+	return F_CPU / SNIFF_PRESCALE;
+} // sniffTicksPerSecond
+
+
+unsigned long IEC::sniffTime()
+{
+	word ticks = TCNT1;
+	if(TIFR1 bitand _BV(TOV1)) {
+		TIFR1 = _BV(TOV1);
+		m_sniffOverflows++;
+		ticks = TCNT1;  // read again, it may have wrapped after the first read
+	}
+	return (static_cast<unsigned long>(m_sniffOverflows) << 16) bitor ticks;
+} // sniffTime
+
+
+// Wait for a line to go to level (true == released) without touching the bus, false on timeout.
+boolean IEC::sniffWait(byte pin, boolean level)
+{
+	for(word t = 0; t < TIMEOUT; t++) {
+		if(readPIN(pin) == level)
+			return true;
+		sniffTime();  // keep up with the overflows
+		delayMicroseconds(TIMEOUT_POLL_US);
+	}
+	return false;
+} // sniffWait
+
+
+// Between bytes the talker holds CLOCK, it releases it when it has the next one.
+boolean IEC::sniffReady()
+{
+	return sniffWait(m_clockPin, false) and sniffWait(m_clockPin, true);
+} // sniffReady
+
+
+// The rest of a byte as receiveByte() sees it, with the listener's part played by whoever listens.
+boolean IEC::sniffByte(byte& data, byte& flags, unsigned long& time)
+{
+	// Listeners release DATA when they are ready for the byte
+	if(not sniffWait(m_dataPin, true))
+		return false;
+	time = sniffTime();
+	flags = readATN() ? 0 : SNIFF_ATN;
+
+	// The talker holding back the first bit for more than 200 us is EOI, a listener acknowledges it on DATA
+	byte n = 0;
+	while(readCLOCK() and (n < TIMING_EOI_THRESH)) {
+		delayMicroseconds(EOI_POLL_DELAY_US);
+		n++;
+	}
+	if(n >= TIMING_EOI_THRESH)
+		flags or_eq SNIFF_EOI;
+
+	// Eight bits, LSB first, valid while CLOCK is released
+	data = 0;
+	for(n = 0; n < 8; n++) {
+		if(not sniffWait(m_clockPin, false) or not sniffWait(m_clockPin, true))
+			return false;
+		data >>= 1;
+		data or_eq (readDATA() ? (1 << 7) : 0);
+	}
+
+	return true;
+} // sniffByte
+
+
+// Clock a byte out on SRQ, MSB first, the C128's CIA shifts DATA in on the rising edge. DATA is high for a 1. The
+// ATN acknowledge in burst mode is these eight clocks alone, without touching DATA.
+void IEC::shiftFast(byte data, boolean driveData)
+{
+	for(byte i = 0; i < 8; i++) {
+		writeSRQ(true);
+		if(driveData)
+			writeDATA(not (data bitand 0x80));
+		data <<= 1;
+		delayMicroseconds(TIMING_FAST_BIT);
+		writeSRQ(false);
+		delayMicroseconds(TIMING_FAST_BIT);
+	}
+} // shiftFast
+
+
 // Set all IEC_signal lines in the correct mode
 //
 boolean IEC::init()
@@ -476,6 +633,8 @@ boolean IEC::init()
 	pinMode(m_dataPin, INPUT);
 	pinMode(m_clockPin, INPUT);
 	pinMode(m_resetPin, INPUT);
+	if(m_srqPin)
+		pinMode(m_srqPin, INPUT);
 
 #ifdef DEBUGLINES
 	m_lastMillis = millis();
@@ -523,27 +682,54 @@ void IEC::testOUTPUTS()
 #endif
 
 
+// Lowest device number answered
 byte IEC::deviceNumber() const
 {
-	return m_deviceNumber;
+	byte device = 0;
+	while(device < ATN_DEVICE_MASK and not servesDevice(device))
+		device++;
+	return device;
 } // deviceNumber
 
 
 void IEC::setDeviceNumber(const byte deviceNumber)
 {
-	m_deviceNumber = deviceNumber;
+	m_deviceMask = 1UL << constrain(deviceNumber, byte(DEFAULT_IEC_DEVICE), byte(LAST_IEC_DEVICE));
 } // setDeviceNumber
 
 
-void IEC::setPins(byte atn, byte clock, byte data, byte reset)
+unsigned long IEC::deviceMask() const
+{
+	return m_deviceMask;
+} // deviceMask
+
+
+void IEC::setDeviceMask(const unsigned long deviceMask)
+{
+	const unsigned long answered = ((1UL << (LAST_IEC_DEVICE + 1)) - 1) bitand ~((1UL << DEFAULT_IEC_DEVICE) - 1);
+
+	m_deviceMask = deviceMask bitand answered;
+	if(not m_deviceMask)
+		setDeviceNumber(DEFAULT_IEC_DEVICE);
+} // setDeviceMask
+
+
+void IEC::setPins(byte atn, byte clock, byte data, byte reset, byte srq)
 {
 	m_atnPin = atn;
 	m_clockPin = clock;
 	m_dataPin = data;
 	m_resetPin = reset;
+	m_srqPin = srq;
 } // setPins
 
 
+boolean IEC::usesPins(byte atn, byte clock, byte data) const
+{
+	return m_atnPin == atn and m_clockPin == clock and m_dataPin == data;
+} // usesPins
+
+
 IEC::IECState IEC::state() const
 {
 	return static_cast<IECState>(m_state);
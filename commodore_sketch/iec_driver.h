@@ -15,7 +15,8 @@ public:
 		noFlags   = 0,
 		eoiFlag   = (1 << 0),   // might be set by Iec_receive
 		atnFlag   = (1 << 1),   // might be set by Iec_receive
-		errorFlag = (1 << 2)  // If this flag is set, something went wrong
+		errorFlag = (1 << 2),  // If this flag is set, something went wrong
+		overflowFlag = (1 << 3)  // Set with errorFlag when a command string was too long for the ATN command buffer
 	};
 
 	// Return values for checkATN:
@@ -36,19 +37,23 @@ public:
 		ATN_CODE_CLOSE = 0xE0,
 		ATN_CODE_OPEN = 0xF0,
 		ATN_CODE_UNLISTEN = 0x3F,
-		ATN_CODE_UNTALK = 0x5F
+		ATN_CODE_UNTALK = 0x5F,
+		ATN_DEVICE_MASK = 0x1F
 	};
 
 	// ATN command struct maximum command length:
 	enum {
 		ATN_CMD_MAX_LENGTH = 40
 	};
-	// default device number listening unless explicitly stated in ctor:
+	// default device number listening unless explicitly stated in ctor, and the last of the 16 devices that can be
+	// answered, as the host's channel byte has a nibble for the device (interface.cpp):
 	enum {
-		DEFAULT_IEC_DEVICE = 8
+		DEFAULT_IEC_DEVICE = 8,
+		LAST_IEC_DEVICE = 23
 	};
 
 	typedef struct _tagATNCMD {
+		byte device;  // device number the LISTEN or TALK was for
 		byte code;
 		byte str[ATN_CMD_MAX_LENGTH];
 		byte strLen;
@@ -84,19 +89,39 @@ public:
 	//
 	byte receive();
 
+	// Devices answered on the bus, bit n set for device n. Setting a device number answers for that one only. Devices
+	// outside DEFAULT_IEC_DEVICE to LAST_IEC_DEVICE are not answered: a number is moved into the range, a mask with
+	// none of them left answers for DEFAULT_IEC_DEVICE.
 	byte deviceNumber() const;
 	void setDeviceNumber(const byte deviceNumber);
-	void setPins(byte atn, byte clock, byte data, byte reset);
+	unsigned long deviceMask() const;
+	void setDeviceMask(const unsigned long deviceMask);
+	void setPins(byte atn, byte clock, byte data, byte reset, byte srq = 0);
+	// Whether the bus is on these pins, e.g. the ones the Epyx assembler is built for (board.h)
+	boolean usesPins(byte atn, byte clock, byte data) const;
 	IECState state() const;
 
+	// C128 fast serial (burst mode), when the host set an SRQ pin. Bytes are clocked out on DATA with SRQ as the
+	// shift clock, one each time the C128 toggles CLOCK. beginFast() takes the CLOCK state to toggle from.
+	boolean hasFastSerial() const;
+	void beginFast();
+	boolean sendFast(byte data);
+	void endFast();
+
+	// Sniffer mode: decode the bus without driving it. sniffReady() waits for a talker to release CLOCK with a byte to
+	// send, sniffByte() then decodes it, with CBM::SniffFlags and the time it started in Timer1 ticks. Both return
+	// false when nothing came or the byte was cut short. sniffByte() needs interrupts off.
+	void beginSniff();
+	boolean sniffReady();
+	boolean sniffByte(byte& data, byte& flags, unsigned long& time);
+	static unsigned long sniffTicksPerSecond();
+
 	//Needed for epyx fastload
 	void setClock(boolean state);
 	void setData(boolean state);
 	byte getATN();
 	byte getData();
-
-	//Read byte using gijoe protocol
-	int16_t gijoe_read_byte(void);
+	byte getClock();
 
 #ifdef DEBUGLINES
 	unsigned long m_lastMillis;
@@ -110,6 +135,9 @@ private:
 	boolean sendByte(byte data, boolean signalEOI);
 	boolean turnAround(void);
 	boolean undoTurnAround(void);
+	void shiftFast(byte data, boolean driveData);
+	boolean sniffWait(byte pin, boolean level);
+	unsigned long sniffTime();
 
 	// false = LOW, true == HIGH
 	inline boolean readPIN(byte pinNumber)
@@ -134,6 +162,11 @@ private:
 		return readPIN(m_clockPin);
 	}
 
+	inline boolean servesDevice(byte device) const
+	{
+		return (m_deviceMask >> device) bitand 1;
+	}
+
 	inline boolean readRESET()
 	{
 		return !readPIN(m_resetPin);
@@ -161,14 +194,26 @@ private:
 		writePIN(m_clockPin, state);
 	}
 
+	inline void writeSRQ(boolean state)
+	{
+		writePIN(m_srqPin, state);
+	}
+
 	// communication must be reset
 	byte m_state;
-	byte m_deviceNumber;
+	unsigned long m_deviceMask;
 
 	byte m_atnPin;
 	byte m_dataPin;
 	byte m_clockPin;
 	byte m_resetPin;
+	byte m_srqPin;  // 0 when there is none, no burst mode then
+
+	// CLOCK as last seen in burst mode, the next byte goes out when it changes
+	boolean m_fastClock;
+
+	// Timer1 overflows since beginSniff(), the upper half of the sniffer's times
+	word m_sniffOverflows;
 };
 
 #endif
@@ -1,8 +1,10 @@
 #include <string.h>
+#include <util/crc16.h>
 #include "interface.h"
 #include "atomic.h"
 #include "epyxfastload.h"
 #include "log.h"
+#include "memory.h"
 
 //Retrieve programs to fastload using serial or included binary rom file
 #define USE_SERIAL
@@ -15,21 +17,349 @@ INCBIN(ROMFile, "Pengo.prg");
 
 using namespace CBM;
 
+// Number of times a framed block is re-requested from the host before giving up.
+#define HOST_BLOCK_RETRIES 5
+
+// How long a status read waits for the host to answer a forwarded command channel command.
+#define HOST_REPLY_WAIT_MSECS 250
+
+// 1541 RAM, the addresses a host with a drive emulation answers M-R for.
+#define DRIVE_RAM_SIZE 0x0800
+
+// Channel number of a free channel slot or when no direct access buffer is open.
+#define NO_CHANNEL 0xFF
+
+// Size of the Epyx cartridge's stage 2 loader, and the bytes of it in the checksum (the rest is junk).
+#define EPYX_STAGE2_BYTES 256
+#define EPYX_STAGE2_CHECKED 237
+
+// epyxReceiveLoader error, after the GIJOE_ ones
+#define EPYX_NAME_TOO_LONG 3
+
+// C128 burst commands are "U0" and a command byte, its low five bits are the command. Fastload is followed by the name.
+#define BURST_CMD_MASK 0x1F
+#define BURST_CMD_FASTLOAD 0x1F
+
+// Burst fastload status byte ahead of each block: a whole block, the last one (a byte count follows) or an error.
+#define BURST_STATUS_OK 0x00
+#define BURST_STATUS_ERROR 0x02
+#define BURST_STATUS_EOI 0x1F
+
+// How long replayed drive code waits for the Commodore to change a bus line.
+#define DRIVE_WAIT_MSECS 2000
+
+// How often the idle loop logs a new stack high-water mark at most.
+#define RAM_CHECK_MSECS 1000
+
 namespace {
 
 // Buffer for incoming and outgoing serial bytes and other stuff.
 char serCmdIOBuf[MAX_BYTES_PER_REQUEST];
 
+// Direct access buffer, a sector read with U1 / B-R or written with U2 / B-W.
+byte sectorBuf[SECTOR_BYTES];
+
+// Message text for a DOS status code
+PGM_P dosMessage(byte code)
+{
+	switch(code) {
+		case DOS_OK: return PSTR(" OK");
+		case DOS_READ_ERROR: return PSTR("READ ERROR");
+		case DOS_WRITE_PROTECT_ON: return PSTR("WRITE PROTECT ON");
+		case DOS_SYNTAX_ERROR:
+		case DOS_SYNTAX_LONG_LINE: return PSTR("SYNTAX ERROR");
+		case DOS_RECORD_NOT_PRESENT: return PSTR("RECORD NOT PRESENT");
+		case DOS_FILE_NOT_FOUND: return PSTR("FILE NOT FOUND");
+		case DOS_FILE_EXISTS: return PSTR("FILE EXISTS");
+		case DOS_FILE_TYPE_MISMATCH: return PSTR("FILE TYPE MISMATCH");
+		case DOS_ILLEGAL_TRACK_SECTOR: return PSTR("ILLEGAL TRACK OR SECTOR");
+		case DOS_NO_CHANNEL: return PSTR("NO CHANNEL");
+		case DOS_DISK_FULL: return PSTR("DISK FULL");
+		case DOS_VERSION: return PSTR("CBM DOS V2.6 1541");
+		case DOS_DRIVE_NOT_READY: return PSTR("DRIVE NOT READY");
+		default: return PSTR("");
+	}
+} // dosMessage
+
+// Checksums of the Epyx stage 2 loaders known to work
+const byte epyxStage2Checksums[] PROGMEM = { 0x91, 0x5b };
+
+bool knownEpyxStage2(byte checksum)
+{
+	for(byte i = 0; i < sizeof(epyxStage2Checksums); i++)
+		if(pgm_read_byte(&epyxStage2Checksums[i]) == checksum)
+			return true;
+	return false;
+} // knownEpyxStage2
+
+// Parse up to max decimal parameters from str[start] on, separated by anything that is not a digit,
+// e.g. the "2 0 18 0" of "U1:2 0 18 0" or "B-R 2,0,18,0". Returns how many were found.
+byte parseParams(const byte* str, byte len, byte start, byte* params, byte max)
+{
+	byte count = 0;
+	bool inNumber = false;
+
+	for(byte i = start; i < len; i++) {
+		if(str[i] >= '0' and str[i] <= '9') {
+			if(not inNumber) {
+				if(count == max)
+					break;
+				params[count++] = 0;
+				inNumber = true;
+			}
+			params[count - 1] = params[count - 1] * 10 + str[i] - '0';
+		}
+		else
+			inNumber = false;
+	}
+
+	return count;
+} // parseParams
+
+// Channel number as the host sees it: the secondary address, with the device number above 8 in the upper nibble so
+// that each device can be mapped to its own image. IEC only answers for the devices that fit, 8 to 23.
+byte hostChannel(byte device, byte chan)
+{
+	return ((device - IEC::DEFAULT_IEC_DEVICE) << 4) bitor chan;
+} // hostChannel
+
+// Drive trace opcodes, see DriveTrace in commodore_host/drive_trace.h
+enum DriveTraceOps {
+	TRACE_OP_MASK = 0xC0,
+	TRACE_DELAY = 0x00,
+	TRACE_DELAY_LONG = 0x3F,
+	TRACE_OUT = 0x40,
+	TRACE_OUT_CLOCK = 0x20,
+	TRACE_OUT_DATA = 0x10,
+	TRACE_OUT_DELAY = 0x0F,
+	TRACE_WAIT = 0x80,
+	TRACE_WAIT_PULLED = 0x20,
+	TRACE_WAIT_LINE = 0x03,
+	TRACE_END = 0xFF
+};
+
+enum DriveTraceLines {
+	TRACE_LINE_CLOCK = 0,
+	TRACE_LINE_DATA = 1,
+	TRACE_LINE_ATN = 2
+};
+
 } // unnamed namespace
 
 
-Interface::Interface(IEC& iec)
-	: m_iec(iec)
-	// NOTE: Householding with RAM bytes: We use the middle of serial buffer for the ATNCmd buffer info.
-	// This is ok and won't be overwritten by actual serial data from the host, this is because when this ATNCmd data is in use
-	// only a few bytes of the actual serial data will be used in the buffer.
-	, m_cmd(*reinterpret_cast<IEC::ATNCmd*>(&serCmdIOBuf[sizeof(serCmdIOBuf) / 2]))
-{}
+// Only the Epyx cartridge has a native transfer routine so far. Action Replay, Final Cartridge III and game loaders
+// go to the host's drive emulation when it runs drive code, and log their M-E address, CRC and length in DRIVE_CODE
+// events, which are what an entry here needs besides a transfer routine checked against the real loader.
+const Interface::Fastloader Interface::s_fastloaders[] PROGMEM = {
+	// Epyx fastload cartridge, stage 1 is started at $01A9 and then uploads stage 2 itself using the gijoe protocol
+#ifdef USE_SERIAL
+	{ 0x01A9, 0, 0, &Interface::epyxFastloadProgram },
+#endif
+#ifdef USE_ROM
+	{ 0x01A9, 0, 0, &Interface::epyxFastloadROM },
+#endif
+};
+
+
+Interface::Interface(IEC& iec, HostLink& host)
+	: m_iec(iec), m_host(host), m_channelBytes(0)
+	, m_mode(0), m_blockSeq(0)
+	, m_statusCode(DOS_VERSION), m_statusTrack(0), m_statusSector(0), m_hostReplyPending(false)
+	, m_openPending(false), m_earlyRead(false), m_saveChan(NO_CHANNEL)
+	, m_bufferChan(NO_CHANNEL), m_bufferPos(0), m_bufferEnd(SECTOR_BYTES - 1)
+	, m_uploadCrc(0), m_uploadLen(0)
+	, m_stackUnused(0xFFFF), m_ramCheckMillis(0), m_sniffing(false)
+{
+	for (byte i = 0; i < CHANNEL_SLOTS; i++) {
+		m_channels[i].chan = NO_CHANNEL;
+		m_channels[i].buf = NULL;
+	}
+}
+
+
+void Interface::begin()
+{
+	m_channelBytes = min(Memory::arenaFree() / CHANNEL_SLOTS, word(CHANNEL_BUFFER_MAX_BYTES));
+	for (byte i = 0; i < CHANNEL_SLOTS and m_channelBytes; i++)
+		m_channels[i].buf = static_cast<byte*>(Memory::arenaAlloc(m_channelBytes));
+} // begin
+
+
+// Record access positions open data channels, so it takes the channels mode with it.
+void Interface::setMode(byte mode)
+{
+	m_mode = mode;
+	if(m_mode bitand HOST_MODE_RECORDS)
+		m_mode or_eq HOST_MODE_CHANNELS;
+} // setMode
+
+
+// Read one block response from the host into serCmdIOBuf, returning its type ('B', 'b', 'L', 'l', 'X') and length.
+bool Interface::readHostBlock(uint8_t& bufEnd, uint8_t& bufLen)
+{
+	return readHostFrame(bufEnd, bufLen, reinterpret_cast<byte*>(serCmdIOBuf), 0);
+} // readHostBlock
+
+
+// Read one frame from the host: its type, an argument byte, then the data. A dataLen of zero takes the length from
+// the argument byte, as blocks do. In framed mode the frame also carries a sequence number and CRC-16. A bad or
+// missing frame is NAKed with 'N' and the expected sequence number, and the host sends it again. The Commodore is
+// held on the bus meanwhile.
+bool Interface::readHostFrame(uint8_t& type, uint8_t& arg, byte* data, word dataLen)
+{
+	uint8_t hdr[3], crc[2];
+	uint16_t sum;
+
+	if (not (m_mode bitand HOST_MODE_FRAMED)) {
+		m_host.readBytes(hdr, 2);  // read the frame type and length
+		type = hdr[0];
+		arg = hdr[1];
+		if (type != 'X')  // error responses carry no data bytes
+			m_host.readBytes(data, dataLen ? dataLen : arg);
+		return true;
+	}
+
+	for (uint8_t retry = 0; retry < HOST_BLOCK_RETRIES; retry++) {
+		if (m_host.readBytes(hdr, 2) == 2) {
+			type = hdr[0];
+			arg = hdr[1];
+			if (type == 'X')  // error responses are not framed
+				return true;
+
+			word len = dataLen ? dataLen : arg;
+			if (m_host.readBytes(&hdr[2], 1) == 1 and m_host.readBytes(data, len) == len
+				and m_host.readBytes(crc, 2) == 2) {
+				sum = 0;
+				for (uint8_t i = 0; i < 3; i++)
+					sum = _crc_xmodem_update(sum, hdr[i]);
+				for (word i = 0; i < len; i++)
+					sum = _crc_xmodem_update(sum, data[i]);
+				if (hdr[2] == m_blockSeq and sum == word(crc[0], crc[1])) {
+					m_blockSeq++;
+					return true;
+				}
+			}
+		}
+
+		// Bad frame, drop whatever is left of it and ask again
+		while (m_host.available())
+			m_host.read();
+		m_host.write('N');
+		m_host.write(m_blockSeq);
+		m_host.flush();
+	}
+
+	return false;
+} // readHostFrame
+
+
+// Send the 'W'/'w' block held in serCmdIOBuf to the host. In framed mode the block gets a sequence number and CRC-16,
+// and is sent again until the host acknowledges it with 'A'. 'X' and a DOS status code refuse it, e.g. disk full.
+bool Interface::writeHostBlock(uint8_t bufLen)
+{
+	uint16_t sum = 0;
+
+	if (not (m_mode bitand HOST_MODE_FRAMED)) {
+		m_host.write(serCmdIOBuf, bufLen);
+		m_host.flush();
+		return true;
+	}
+
+	for (uint8_t i = 0; i < bufLen; i++)
+		sum = _crc_xmodem_update(sum, serCmdIOBuf[i]);
+	serCmdIOBuf[bufLen] = highByte(sum);
+	serCmdIOBuf[bufLen + 1] = lowByte(sum);
+
+	for (uint8_t retry = 0; retry < HOST_BLOCK_RETRIES; retry++) {
+		m_host.write(serCmdIOBuf, bufLen + 2);
+		m_host.flush();
+		char r = 0;
+		if (m_host.readBytes(&r, 1) == 1 and r == 'A') {
+			m_blockSeq++;
+			return true;
+		}
+		if (r == 'X') {
+			byte code = DOS_DRIVE_NOT_READY;
+			m_host.readBytes(&code, 1);
+			setStatus(code);
+			return false;
+		}
+	}
+
+	return false;
+} // writeHostBlock
+
+
+// Ask the host for a sector with 'S' channel track sector and read it into the direct access buffer. The host answers with an
+// 'S' frame of 256 bytes, or 'X' and a DOS status code.
+bool Interface::readHostSector(byte track, byte sector)
+{
+	uint8_t type, arg;
+
+	while (m_host.available())  //Drop any stale reply to an earlier command
+		m_host.read();
+
+	m_host.write('S');
+	m_host.write(m_bufferChan);
+	m_host.write(track);
+	m_host.write(sector);
+	m_host.flush();
+
+	m_blockSeq = 0;
+	if (not readHostFrame(type, arg, sectorBuf, SECTOR_BYTES)) {
+		setStatus(DOS_DRIVE_NOT_READY);
+		return false;
+	}
+	if (type != 'S') {
+		setStatus(arg ? arg : DOS_READ_ERROR, track, sector);
+		return false;
+	}
+
+	setStatus(DOS_OK);
+	return true;
+} // readHostSector
+
+
+// Send the direct access buffer to the host with 'Y' channel track sector and the 256 bytes. In framed mode the frame gets a
+// sequence number and CRC-16, and is sent again until the host acknowledges it with 'A'. 'X' and a DOS status code refuse
+// it, e.g. 26 WRITE PROTECT ON for an image in an archive.
+bool Interface::writeHostSector(byte track, byte sector)
+{
+	const bool framed = m_mode bitand HOST_MODE_FRAMED;
+	byte hdr[5] = { 'Y', m_bufferChan, track, sector, 0 };
+	uint16_t sum = 0;
+
+	m_blockSeq = 0;
+	for (uint8_t i = 0; i < sizeof(hdr); i++)
+		sum = _crc_xmodem_update(sum, hdr[i]);
+	for (word i = 0; i < SECTOR_BYTES; i++)
+		sum = _crc_xmodem_update(sum, sectorBuf[i]);
+
+	for (uint8_t retry = 0; retry < HOST_BLOCK_RETRIES; retry++) {
+		m_host.write(hdr, framed ? 5 : 4);
+		m_host.write(sectorBuf, SECTOR_BYTES);
+		if (framed) {
+			m_host.write(highByte(sum));
+			m_host.write(lowByte(sum));
+		}
+		m_host.flush();
+		if (not framed)
+			return true;
+
+		char r = 0;
+		if (m_host.readBytes(&r, 1) == 1 and r == 'A')
+			return true;
+		if (r == 'X') {
+			byte code = DOS_DRIVE_NOT_READY;
+			m_host.readBytes(&code, 1);
+			setStatus(code, track, sector);
+			return false;
+		}
+	}
+
+	setStatus(DOS_DRIVE_NOT_READY);
+	return false;
+} // writeHostSector
 
 
 // send single basic line, including heading basic pointer and terminating zero.
@@ -51,9 +381,411 @@ void Interface::sendLine(byte len, char* text, word& basicPtr)
 } // sendLine
 
 
+void Interface::setStatus(byte code, byte track, byte sector)
+{
+	m_statusCode = code;
+	m_statusTrack = track;
+	m_statusSector = sector;
+} // setStatus
+
+
+// Send the DOS status line, e.g. "00, OK,00,00", as the command channel talker. Reading it clears the status.
+void Interface::sendStatus()
+{
+	byte len = sprintf_P(serCmdIOBuf, (PGM_P)F("%02u,%S,%02u,%02u\r"),
+						m_statusCode, dosMessage(m_statusCode), m_statusTrack, m_statusSector);
+
+	noInterrupts();
+	for(byte i = 0; i < len - 1; i++)
+		m_iec.send(serCmdIOBuf[i]);
+	m_iec.sendEOI(serCmdIOBuf[len - 1]);
+	interrupts();
+
+	setStatus(DOS_OK);
+} // sendStatus
+
+
+// Execute the common command channel commands locally, without a host round-trip.
+// Returns false when the command has to go to the host.
+bool Interface::handleLocalCommand(IEC::ATNCmd& cmd)
+{
+	byte len = cmd.strLen;
+
+	if(len and cmd.str[len - 1] == '\r')
+		len--;
+
+	if(len == 0)  // plain OPEN 15 or an empty PRINT#
+		return true;
+
+	if(cmd.str[0] == 'I') {  // Initialise
+		setStatus(DOS_OK);
+		return true;
+	}
+
+	if(cmd.str[0] == 'U' and len >= 2) {
+		switch(cmd.str[1]) {
+			case 'I': case '9':
+				if(len > 2 and (cmd.str[2] == '+' or cmd.str[2] == '-')) {  // C64 / VIC-20 bus speed switch
+					setStatus(DOS_OK);
+					return true;
+				}
+				// UI without a speed switch is a reset, same as UJ, fall through
+			case 'J': case ':':
+				setStatus(DOS_VERSION);
+				m_uploadCrc = m_uploadLen = 0;
+				return true;
+		}
+	}
+
+	return false;
+} // handleLocalCommand
+
+
+// Direct access commands on the buffer opened with "#": U1 / B-R and U2 / B-W read and write a sector through the
+// host, B-P positions the buffer pointer. Returns false for commands that have to go to the host.
+bool Interface::handleBlockCommand(IEC::ATNCmd& cmd)
+{
+	byte params[4];  // channel, drive, track, sector / channel, position
+	byte start, op;
+
+	if(cmd.strLen >= 2 and cmd.str[0] == 'U' and (cmd.str[1] == '1' or cmd.str[1] == 'A'))
+		op = 'R', start = 2;
+	else if(cmd.strLen >= 2 and cmd.str[0] == 'U' and (cmd.str[1] == '2' or cmd.str[1] == 'B'))
+		op = 'W', start = 2;
+	else if(cmd.strLen >= 3 and cmd.str[0] == 'B' and cmd.str[1] == '-'
+		and (cmd.str[2] == 'R' or cmd.str[2] == 'W' or cmd.str[2] == 'P'))
+		op = cmd.str[2], start = 3;
+	else
+		return false;
+
+	byte count = parseParams(cmd.str, cmd.strLen, start, params, op == 'P' ? 2 : 4);
+	if(count < (op == 'P' ? 2 : 4)) {
+		setStatus(DOS_SYNTAX_ERROR);
+		return true;
+	}
+	if(hostChannel(cmd.device, params[0]) != m_bufferChan) {
+		setStatus(DOS_NO_CHANNEL);
+		return true;
+	}
+
+	if(op == 'P') {
+		m_bufferPos = params[1];
+		setStatus(DOS_OK);
+		return true;
+	}
+
+	if(not (m_mode bitand HOST_MODE_SECTORS)) {
+		setStatus(DOS_DRIVE_NOT_READY);
+		return true;
+	}
+
+	bool blockCmd = cmd.str[0] == 'B';
+	if(op == 'R') {
+		if(readHostSector(params[2], params[3])) {
+			// B-R hands out the bytes counted in the first byte of the sector, U1 the whole sector
+			m_bufferPos = blockCmd ? 1 : 0;
+			m_bufferEnd = blockCmd ? max(sectorBuf[0], (byte)1) : SECTOR_BYTES - 1;
+		}
+	}
+	else {
+		if(blockCmd)  // B-W records the bytes written in the first byte
+			sectorBuf[0] = m_bufferPos;
+		if(writeHostSector(params[2], params[3]))
+			setStatus(DOS_OK);
+		m_bufferPos = blockCmd ? 1 : 0;
+	}
+
+	return true;
+} // handleBlockCommand
+
+
+// C128 burst commands, "U0" and a command byte. Only fastload is served, the C128 falls back to the serial bus
+// for the others on the error. Returns false for commands that have to go to the host.
+bool Interface::handleBurstCommand(IEC::ATNCmd& cmd)
+{
+	if(cmd.strLen < 3 or cmd.str[0] != 'U' or cmd.str[1] != '0' or not m_iec.hasFastSerial())
+		return false;
+
+	byte len = cmd.strLen;
+	if(cmd.str[len - 1] == '\r')
+		len--;
+
+	byte code = cmd.str[2] bitand BURST_CMD_MASK;
+	Log(LOG_BURST_COMMAND, code, len - 3);
+	if(code != BURST_CMD_FASTLOAD or len <= 3) {
+		setStatus(DOS_SYNTAX_ERROR);
+		return true;
+	}
+
+	burstLoad(cmd.str + 3, len - 3);
+	return true;
+} // handleBurstCommand
+
+
+// P channel recordLo recordHi position, binary bytes as the 1541 takes them, on a relative file open on a data
+// channel. The host positions its copy of the channel and answers with the record, so only the record crosses the
+// link. Returns false when the host has no record access, the command then goes to it as before.
+bool Interface::handleRecordCommand(IEC::ATNCmd& cmd)
+{
+	if(not (m_mode bitand HOST_MODE_RECORDS) or cmd.strLen < 2 or cmd.str[0] != 'P')
+		return false;
+
+	// A CR at the end ends the command, it is not a parameter. Like the 1541, this also drops a last parameter of 13
+	byte len = cmd.strLen;
+	if(cmd.str[len - 1] == '\r')
+		len--;
+
+	Channel* ch = findChannel(hostChannel(cmd.device, cmd.str[1] bitand 0x0F));
+	if(not ch) {
+		setStatus(DOS_NO_CHANNEL);
+		return true;
+	}
+
+	ch->pos = ch->len = 0;
+	ch->lastBlock = false;
+
+	while (m_host.available())  //Drop any stale reply to an earlier command
+		m_host.read();
+
+	m_host.write('P');
+	m_host.write(ch->chan);
+	m_host.write(len > 2 ? cmd.str[2] : 1);  // record, from 1
+	m_host.write(len > 3 ? cmd.str[3] : 0);
+	m_host.write(len > 4 ? cmd.str[4] : 1);  // position in the record, from 1
+	m_host.write(m_channelBytes);
+	m_host.flush();
+
+	ch->records = readChannel(*ch);
+	if(ch->records)
+		setStatus(DOS_OK);
+	return true;
+} // handleRecordCommand
+
+
+// Burst fastload: open the file on the host as a LOAD would, then send each block behind a status byte, clocked
+// out on SRQ. The blocks come through serCmdIOBuf as in sendFile, the host's blocks are the 254 data bytes of a
+// sector the C128 expects.
+void Interface::burstLoad(const byte* name, byte nameLen)
+{
+	uint8_t bufLen, bufEnd;
+	word i = 0;
+	bool ok = true;
+
+	serCmdIOBuf[0] = 'O';  //Open instruction
+	serCmdIOBuf[1] = nameLen + 3;
+	serCmdIOBuf[2] = hostChannel(m_cmd.device, 0);  //channel, a load
+	memcpy(serCmdIOBuf + 3, name, nameLen);
+	m_blockSeq = 0;
+	m_host.write(serCmdIOBuf, serCmdIOBuf[1]);
+	m_host.flush();
+
+	noInterrupts();
+	m_iec.beginFast();
+	interrupts();
+
+	do {
+
+		if (not readHostBlock(bufEnd, bufLen) or (bufEnd != 'B' and bufEnd != 'b')) {
+			setStatus(DOS_FILE_NOT_FOUND);
+			noInterrupts();
+			m_iec.sendFast(BURST_STATUS_ERROR);
+			interrupts();
+			while (m_host.available())  //Flush out read buffer
+				m_host.read();
+			ok = false;
+			break;
+		}
+
+		//Ask for the next block ahead when the board's transport keeps it
+		if (Board::PREFETCH and bufEnd != 'b') {
+			m_host.write('R');
+			m_host.flush();
+		}
+
+		noInterrupts();
+		if (bufEnd == 'b')
+			ok = m_iec.sendFast(BURST_STATUS_EOI) and m_iec.sendFast(bufLen);
+		else
+			ok = m_iec.sendFast(BURST_STATUS_OK);
+		for (i = 0; i < bufLen and ok; i++)
+			ok = m_iec.sendFast(serCmdIOBuf[i]);
+		interrupts();
+
+		if (not ok) {
+			Log(LOG_BURST_FAIL, i, bufLen);
+			while (m_host.available())
+				m_host.read();
+			break;
+		}
+
+		if (not Board::PREFETCH and bufEnd != 'b') {
+			m_host.write('R');
+			m_host.flush();
+		}
+
+	} while (bufEnd == 'B');
+
+	noInterrupts();
+	m_iec.endFast();
+	interrupts();
+
+	if (ok)
+		setStatus(DOS_OK);
+
+} // burstLoad
+
+
+// Follow drive code uploaded with M-W and start the native transfer routine of a known fastloader on M-E.
+// Returns false when the command has to go to the host.
+bool Interface::handleDriveCode(IEC::ATNCmd& cmd)
+{
+	if(cmd.strLen < 5 or cmd.str[0] != 'M' or cmd.str[1] != '-')
+		return false;
+
+	if(cmd.str[2] == 'W' and cmd.strLen >= 6) {
+		byte count = min(cmd.str[5], cmd.strLen - 6);
+		for(byte i = 0; i < count; i++)
+			m_uploadCrc = _crc_xmodem_update(m_uploadCrc, cmd.str[6 + i]);
+		m_uploadLen += count;
+	}
+	else if(cmd.str[2] == 'E') {
+		word addr = word(cmd.str[4], cmd.str[3]);
+		Fastloader loader;
+
+		for(byte i = 0; i < sizeof(s_fastloaders) / sizeof(s_fastloaders[0]); i++) {
+			memcpy_P(&loader, &s_fastloaders[i], sizeof(loader));
+			if(loader.execAddr == addr and (loader.uploadLen == 0
+				or (loader.uploadLen == m_uploadLen and loader.uploadCrc == m_uploadCrc))) {
+				m_uploadCrc = m_uploadLen = 0;
+				(this->*loader.handler)();
+				return true;
+			}
+		}
+
+		// Unknown drive code, report it so that it can be added to the table
+		Log(LOG_DRIVE_CODE, addr, m_uploadCrc);
+		Log(LOG_DRIVE_CODE_UPLOAD, m_uploadLen);
+		m_uploadCrc = m_uploadLen = 0;
+
+		// A host with a drive emulation has seen the M-W commands too, it runs the code and we replay the result
+		if(m_mode bitand HOST_MODE_DRIVE_CODE) {
+			handleATNCmdCodeOpen(cmd);
+			replayDriveTrace();
+			return true;
+		}
+	}
+
+	return false;
+} // handleDriveCode
+
+
+// Replay the serial bus activity of drive code the host ran in its 1541 emulation. The host sends it in 'T' blocks,
+// the last one 't', each byte a line change, a delay, or a wait for the Commodore. ATN from the Commodore while the
+// host did not expect it, or a wait timing out, ends the replay. Timing is as close as delayMicroseconds() gets,
+// which is good enough for loaders that handshake each byte or bit pair. The host ends a block just after a wait where
+// it can, and the next block is asked for before that wait, so it comes in while the Commodore takes its time rather
+// than between timed line changes.
+void Interface::replayDriveTrace()
+{
+	uint8_t bufLen, bufEnd, i, op;
+	bool ok = true, done = false, longDelay = false, atnExpected = false, asked;
+
+	m_iec.setClock(false);
+	m_iec.setData(false);
+
+	do {
+		if (not readHostBlock(bufEnd, bufLen) or (bufEnd != 'T' and bufEnd != 't')) {
+			Log(LOG_TRACE_HOST_ERROR);
+			setStatus(DOS_DRIVE_NOT_READY);
+			ok = false;
+			break;
+		}
+
+		asked = Board::PREFETCH and bufEnd == 'T';
+		if (asked) {
+			m_host.write('R');
+			m_host.flush();
+		}
+
+		for (i = 0; i < bufLen and ok and not done; i++) {
+			op = serCmdIOBuf[i];
+
+			if (longDelay) {  // second byte of a long delay, may start the next block
+				for (word n = 0; n <= op; n++)
+					delayMicroseconds(64);
+				longDelay = false;
+			}
+			else if (op == TRACE_END)
+				done = true;
+			else if ((op bitand TRACE_OP_MASK) == TRACE_WAIT) {
+				if (not asked and bufEnd == 'T' and i == bufLen - 1) {
+					m_host.write('R');
+					m_host.flush();
+					asked = true;
+				}
+				if ((op bitand TRACE_WAIT_LINE) == TRACE_LINE_ATN)
+					atnExpected = op bitand TRACE_WAIT_PULLED;
+				ok = waitDriveLine(op bitand TRACE_WAIT_LINE, op bitand TRACE_WAIT_PULLED);
+			}
+			else if (not atnExpected and not m_iec.getATN())
+				ok = false;  // the Commodore wants the bus back
+			else if ((op bitand TRACE_OP_MASK) == TRACE_OUT) {
+				delayMicroseconds((op bitand TRACE_OUT_DELAY) << 1);
+				m_iec.setClock(op bitand TRACE_OUT_CLOCK);
+				m_iec.setData(op bitand TRACE_OUT_DATA);
+			}
+			else if (op == TRACE_DELAY_LONG)
+				longDelay = true;
+			else
+				delayMicroseconds(op + 1);
+		}
+
+		if (not asked and bufEnd == 'T' and ok and not done) {
+			m_host.write('R');
+			m_host.flush();
+		}
+
+	} while (bufEnd == 'T' and ok and not done);
+
+	m_iec.setClock(false);
+	m_iec.setData(false);
+
+	if (done)
+		Log(LOG_TRACE_DONE);
+	else {
+		Log(LOG_TRACE_STOPPED, i);
+		while (m_host.available())  //Flush out read buffer
+			m_host.read();
+	}
+
+} // replayDriveTrace
+
+
+// Wait for the Commodore to pull or release a bus line for replayed drive code. The next trace block may be coming in
+// meanwhile, it is moved out of the serial buffer before that overflows.
+bool Interface::waitDriveLine(byte line, bool pulled)
+{
+	unsigned long start = millis();
+	bool state;
+
+	do {
+		switch (line) {
+			case TRACE_LINE_CLOCK: state = not m_iec.getClock(); break;
+			case TRACE_LINE_DATA: state = not m_iec.getData(); break;
+			default: state = not m_iec.getATN(); break;
+		}
+		if (state == pulled)
+			return true;
+		m_host.drain();
+	} while (millis() - start < DRIVE_WAIT_MSECS);
+
+	return false;
+} // waitDriveLine
+
+
 void Interface::sendListing()
 {
-	uint8_t bufLen, bytesRead, bufEnd;
+	uint8_t bufLen, bufEnd;
     boolean firstLine = true;
 
 	// Reset basic memory pointer:
@@ -61,11 +793,9 @@ void Interface::sendListing()
 
 	do {
 		//Serial read buffer will be populated in response to the first directory request and subsequent read requests using 'L'
-		Serial.readBytes(serCmdIOBuf, 2);
-		bufEnd = serCmdIOBuf[0];
-		bufLen = serCmdIOBuf[1];
+		if (not readHostBlock(bufEnd, bufLen))
+			break;
 		if (bufLen > 0) {
-			bytesRead = Serial.readBytes(serCmdIOBuf, bufLen);
 			noInterrupts();
 			if (firstLine) {  // Send load address
 				m_iec.send(C64_BASIC_START bitand 0xff);
@@ -76,7 +806,8 @@ void Interface::sendListing()
 			interrupts();
 		}
 		if (bufEnd == 'L') {  //'Normal' directory line types received are 'L', except for the last one 'l'
-			Serial.write('L');  //Request another directory line
+			m_host.write('L');  //Request another directory line
+			m_host.flush();
 		}
 	} while (bufEnd == 'L');  //Continue while 'normal' directory lines are being returned
 
@@ -91,21 +822,26 @@ void Interface::sendListing()
 
 void Interface::sendFile()
 {
-	uint8_t bufLen, bytesRead, bufEnd, i;
+	uint8_t bufLen, bufEnd, i;
 	bool ok = true;
 
 	do {
 	
 		//Serial read buffer will be populated in response to the first open file request and subsequent read requests using 'R'
-		bytesRead = Serial.readBytes(serCmdIOBuf, 2); // read the ack type ('B' or 'b') and length
-		bufEnd = serCmdIOBuf[0];
-		bufLen = serCmdIOBuf[1];
-		bytesRead = Serial.readBytes(serCmdIOBuf, bufLen); // read the program data bytes
-
-		//Ask for more bytes from the PC now, then send the current buffer load to the C64
-#if !defined(__AVR_ATmega328P__)  //Not suitable for Arduino uno
-		if (bufEnd != 'b') Serial.write('R');
-#endif
+		//The ack type ('B' or 'b'), length and program data bytes are read, a bad framed block is requested again
+		if (not readHostBlock(bufEnd, bufLen)) {
+			Log(LOG_SEND_FILE_HOST_ERROR);
+			setStatus(DOS_DRIVE_NOT_READY);
+			ok = false;
+			break;
+		}
+
+		//Ask for more bytes from the PC now when the board's transport keeps them, then send the current buffer load to the C64
+		if (Board::PREFETCH and bufEnd != 'b' and not m_earlyRead) {  //The second block may have been asked for before the TALK
+			m_host.write('R');
+			m_host.flush();
+		}
+		m_earlyRead = false;
 
 		for (i = 0; i < bufLen and ok; i++) {
 			noInterrupts();
@@ -117,22 +853,22 @@ void Interface::sendFile()
 		}
 
 		if (!ok) {
-			sprintf_P(serCmdIOBuf, (PGM_P)F("sendFile send bytes problem: %u"), i);
-			Log(serCmdIOBuf);
+			Log(LOG_SEND_FILE_BYTES, i);
 		}
 
-#if defined(__AVR_ATmega328P__)  //Suitable for Arduino uno
-      	if (bufEnd != 'b') Serial.write('R');
-#endif
+		if (not Board::PREFETCH and bufEnd != 'b') {
+			m_host.write('R');
+			m_host.flush();
+		}
 
 	} while (bufEnd == 'B' and ok); // keep asking for more as long as we don't get the 'b' or something else (indicating out of sync).
 
 	if (ok) {
-		Log("sendFile completed");
+		Log(LOG_SEND_FILE_DONE);
 	}
 	else {
-		while (Serial.available())  //Flush out read buffer
-			Serial.read();
+		while (m_host.available())  //Flush out read buffer
+			m_host.read();
 	}
 
 } // sendFile
@@ -141,10 +877,12 @@ void Interface::sendFile()
 void Interface::saveFile()
 {
 	boolean done = false;
+	const uint8_t hdrLen = (m_mode bitand HOST_MODE_FRAMED) ? 3 : 2;
+
 	do {
 
 		// Receive bytes from Commodore until EOI detected
-		uint8_t bufLen = 2;  //Allow for 'W'/'w' and length prefix bytes
+		uint8_t bufLen = hdrLen;  //Allow for 'W'/'w' and length prefix bytes, plus sequence number when framed
 		do {
 			noInterrupts();
 			serCmdIOBuf[bufLen++] = m_iec.receive();
@@ -158,8 +896,12 @@ void Interface::saveFile()
 			serCmdIOBuf[0] = 'w';
 		}
 		serCmdIOBuf[1] = bufLen;
-		Serial.write((const byte*)serCmdIOBuf, bufLen);
-		Serial.flush();
+		if (hdrLen == 3)
+			serCmdIOBuf[2] = m_blockSeq;
+		if (not writeHostBlock(bufLen)) {
+			Log(LOG_SAVE_FILE_HOST_ERROR);
+			done = true;
+		}
 
 	} while (not done);
 
@@ -168,28 +910,29 @@ void Interface::saveFile()
 
 byte Interface::handler(void)
 {
+	if(m_mode bitand HOST_MODE_SNIFF)
+		return sniff();
+
 	noInterrupts();
 	IEC::ATNCheck retATN = m_iec.checkATN(m_cmd);
 	interrupts();
 
 	if(retATN == IEC::ATN_ERROR) {
-		strcpy_P(serCmdIOBuf, (PGM_P)F("ATNCMD: IEC_ERROR!"));
-		Log(serCmdIOBuf);
+		Log(LOG_IEC_ERROR, m_iec.state());
+		// Keep the cause for the error channel
+		setStatus((m_iec.state() bitand IEC::overflowFlag) ? DOS_SYNTAX_LONG_LINE : DOS_READ_ERROR);
 	}
 
 	// Did anything happen from the host side?
 	else if(retATN not_eq IEC::ATN_IDLE) {
 		// A command is received, make cmd string null terminated
 		m_cmd.str[m_cmd.strLen] = '\0';
-#ifdef CONSOLE_DEBUG
-		{
-			sprintf_P(serCmdIOBuf, (PGM_P)F("ATN code:%d cmd: %s (len: %d) retATN: %d"), m_cmd.code, m_cmd.str, m_cmd.strLen, retATN);
-			Log(serCmdIOBuf);
-		}
-#endif
+		Log(LOG_ATN_COMMAND, m_cmd.code, retATN);
 
 		// lower nibble is the channel.
 		byte chan = m_cmd.code bitand 0x0F;
+		// and the channel as the host and the channel buffers know it, with the device number
+		byte key = hostChannel(m_cmd.device, chan);
 
 		// check upper nibble, the command itself.
 		switch(m_cmd.code bitand 0xF0) {
@@ -199,40 +942,46 @@ byte Interface::handler(void)
 				// Note: Some of the host response handling is done LATER, since we will get a TALK or LISTEN after this.
 				// Also, simply issuing the request to the host and not waiting for any response here makes us more
 				// responsive to the CBM here, when the DATA with TALK or LISTEN comes in the next sequence.
-				handleATNCmdCodeOpen(m_cmd);
+				if(CMD_CHANNEL == chan)
+					handleATNCmdCodeCommand();
+				else
+					handleATNCmdCodeOpen(m_cmd);
 			break;
 
 			case IEC::ATN_CODE_DATA:  // data channel opened
 				if(retATN == IEC::ATN_CMD_TALK) {
-					 // when the CMD channel is read (status), we first need to issue the host request. The data channel is opened directly.
+					// when the CMD channel is read (status), it is served locally unless the host owes a reply. The data channel is opened directly.
 					if(CMD_CHANNEL == chan)
-						handleATNCmdCodeOpen(m_cmd);  // Typically an empty command for channel 15 message to Commodore
-					handleATNCmdCodeDataTalk(chan);  // Talk to Commodore, sending file and listing data
+						handleATNCmdCodeStatusTalk();
+					else if(key == m_bufferChan)
+						sendBuffer();  // direct access buffer, served locally
+					else if(findChannel(key))
+						sendChannel(*findChannel(key));  // data channel kept open on the host
+					else if((m_mode bitand HOST_MODE_CHANNELS) and chan > WRITEPRG_CHANNEL)
+						m_iec.sendFNF();  // no slot was free when it was opened
+					else
+						handleATNCmdCodeDataTalk(chan);  // Talk to Commodore, sending file and listing data
 				}
 				else if(retATN == IEC::ATN_CMD_LISTEN) {
-					handleATNCmdCodeDataListen();  // Listen for commands / data from the Commodore e.g. save data
+					if(key == m_bufferChan)
+						receiveBuffer();
+					else
+						handleATNCmdCodeDataListen();  // Listen for commands / data from the Commodore e.g. save data
 				}
 				else if(retATN == IEC::ATN_CMD) { // Here we are sending a command to PC and executing it, but not sending response
-					if (CMD_CHANNEL == chan) {
-
-						//Check if received M-E for semi-fast / gijoe mode, proceeding to epyx fastload
-						if(strcmp(m_cmd.str,"M-E\xa9\x01\r") == 0) {
-#ifdef USE_SERIAL
-							epyxFastloadProgram();
-#endif
-#ifdef USE_ROM
-							epyxFastloadROM();
-#endif
-						}
-					}
-					else
+					if (CMD_CHANNEL == chan)
+						handleATNCmdCodeCommand();  // e.g. M-E for semi-fast / gijoe mode, proceeding to epyx fastload
+					else if (key != m_bufferChan)
 						handleATNCmdCodeOpen(m_cmd);	// back to CBM, the result code of the command is however buffered on the PC side.
 				}
 				break;
 
 			case IEC::ATN_CODE_CLOSE:
-				// handle close with host.
-				handleATNCmdClose();
+				// handle close with host, the direct access buffer is ours.
+				if(key == m_bufferChan)
+					m_bufferChan = NO_CHANNEL;
+				else
+					handleATNCmdClose(key);
 				break;
 
 			case IEC::ATN_CODE_LISTEN:
@@ -256,78 +1005,199 @@ byte Interface::handler(void)
 		} // switch
 	} // IEC not idle
 
+	else {
+		captureHostReply();  // nothing on the bus, e.g. between the OPEN and the TALK
+		reportRam();
+		if(m_mode bitand HOST_MODE_EVENTS)
+			flushLog(m_host);
+	}
+
 	return retATN;
 } // handler
 
 
-#ifdef USE_SERIAL
-//Open the program and fastload to C64 with data sent serially from PC
-void Interface::epyxFastloadProgram()
+// Sniffer mode: pass every byte on the bus to the host in a 'Z' frame, answering for no device. The first frame
+// gives the timer rate. Interrupts stay on while the bus is idle, so the host link and the log keep going.
+byte Interface::sniff()
 {
-	uint8_t bufLen, bytesRead, bufEnd, i, b;
-	uint8_t checksum = 0;
-	int16_t j;
+	byte data, flags;
+	unsigned long time;
+	bool got;
+
+	if(not m_sniffing) {
+		m_iec.beginSniff();
+		sendSniff(SNIFF_CLOCK, 0, IEC::sniffTicksPerSecond());
+		m_sniffing = true;
+	}
 
-	//Switchover to full epyx fastload via semi-fastload gijoe protocol
+	got = m_iec.sniffReady();
+	if(got) {
+		noInterrupts();
+		got = m_iec.sniffByte(data, flags, time);
+		interrupts();
+	}
 
-	//Initial handshake
-	noInterrupts();
-	m_iec.setData(true);
-	m_iec.setClock(false);
+	if(got)
+		sendSniff(flags, data, time);
+	else {
+		reportRam();
+		if(m_mode bitand HOST_MODE_EVENTS)
+			flushLog(m_host);
+	}
 
-	while(m_iec.getData() != false)
-	m_iec.setClock(true);
-	interrupts();
+	return IEC::ATN_IDLE;
+} // sniff
 
-	//Receive and checksum stage 2
-	for (j=0; j<256; j++) {
-		noInterrupts();
-		b = m_iec.gijoe_read_byte();
-		interrupts();
-		if (b < 0) {
-			Log("epyxFastloadProgram, read checksum error");
-			return;
+
+// 'Z' flags data time, the time in four bytes, low byte first
+void Interface::sendSniff(byte flags, byte data, unsigned long time)
+{
+	byte frame[] = { 'Z', flags, data, byte(time), byte(time >> 8), byte(time >> 16), byte(time >> 24) };
+
+	m_host.write(frame, sizeof(frame));
+	m_host.push();  // the bus does not wait for the host
+} // sendSniff
+
+
+// Go on scanning for the stack's high-water mark and log it when it has gone deeper than last reported, so the host
+// sees how close the deepest call chain so far came to the arena (memory.h).
+void Interface::reportRam()
+{
+	word unused = Memory::stackUnused();
+	if(unused >= m_stackUnused)
+		return;
+
+	unsigned long now = millis();
+	if(now - m_ramCheckMillis < RAM_CHECK_MSECS)
+		return;
+	m_ramCheckMillis = now;
+
+	m_stackUnused = unused;
+	Log(LOG_RAM, unused, Memory::arenaFree());
+} // reportRam
+
+
+// While the Commodore goes through UNLISTEN, TALK and the turnaround after an OPEN, move the host's reply out of the
+// serial buffer, so the first byte goes on the bus as soon as the turnaround is done. Boards that ask for the next
+// block before sending the current one (see sendFile) ask for the second block as soon as the first is in.
+void Interface::captureHostReply()
+{
+	word held = m_host.drain();
+
+	if (not Board::PREFETCH or not m_openPending or held < 2)
+		return;
+
+	word frameLen = 2 + m_host.ahead(1) + ((m_mode bitand HOST_MODE_FRAMED) ? 3 : 0);
+	if (m_host.ahead(0) != 'B')
+		m_openPending = false;  //Last block, listing or error, nothing more to ask for
+	else if (held >= frameLen) {
+		m_host.write('R');
+		m_host.flush();
+		m_earlyRead = true;
+		m_openPending = false;
+	}
+} // captureHostReply
+
+
+//Switch over to the gijoe protocol and receive the cartridge's stage 2 loader and the file name in one critical
+//section, timing the C64's bytes to match the send delays to its clock. The name goes to name in the order typed,
+//or nowhere when name is NULL. Returns the name length, or -1 when the C64 stopped sending or pulled ATN
+int16_t Interface::epyxReceiveLoader(byte source, byte* name, byte maxLen)
+{
+	byte checksum = 0, junk = 0, nameLen = 0;
+	byte result, nameResult = GIJOE_OK;
+
+	epyxBeginTiming();
+	ATOMIC_BLOCK(ATOMIC_FORCEON) {
+
+		//Initial handshake
+		m_iec.setData(true);
+		m_iec.setClock(false);
+
+		while(m_iec.getData() != false)
+		m_iec.setClock(true);
+
+		//Stage 2 has some junk bytes at the end, left out of the checksum
+		result = asm_gijoe_receive(NULL, EPYX_STAGE2_CHECKED, &checksum);
+		if (result == GIJOE_OK)
+			result = asm_gijoe_receive(NULL, EPYX_STAGE2_BYTES - EPYX_STAGE2_CHECKED, &junk);
+
+		if (result == GIJOE_OK) {
+			nameResult = asm_gijoe_receive(&nameLen, 1, &junk);
+			if (nameResult == GIJOE_OK and name != NULL and nameLen > maxLen)
+				nameResult = EPYX_NAME_TOO_LONG;
+			if (nameResult == GIJOE_OK)
+				nameResult = asm_gijoe_receive(name, nameLen, &junk);
 		}
 
-		if (j < 237)
-		//Stage 2 has some junk bytes at the end, ignore them
-		checksum ^= b;
 	}
+	word gijoeCycles = epyxEndTiming();
+
+	if (result != GIJOE_OK or nameResult != GIJOE_OK) {  //Let go of the bus
+		m_iec.setClock(false);
+		m_iec.setData(false);
+	}
+
+	if (result != GIJOE_OK) {
+		Log(LOG_EPYX_CHECKSUM, source, result);
+		return -1;
+	}
+	Log(LOG_EPYX_TIMING, epyxCalibrate(gijoeCycles), gijoeCycles);
 
 	//Check for known stage2 loaders
-	if (checksum != 0x91 && checksum != 0x5b) {
-		Log("epyxFastloadProgram, checksum total error");
+	if (not knownEpyxStage2(checksum)) {
+		Log(LOG_EPYX_CHECKSUM_TOTAL, source);
 	}
 
-	//Receive file name length
-	noInterrupts();
-	j = m_iec.gijoe_read_byte();
-	interrupts();
-	if (j < 0) {
-		Log("epyxFastloadProgram, file length error");
+	if (nameResult == EPYX_NAME_TOO_LONG) {
+		Log(LOG_EPYX_NAME_LENGTH, source, nameResult);
+		return -1;
+	}
+	if (nameResult != GIJOE_OK) {
+		Log(nameLen ? LOG_EPYX_NAME : LOG_EPYX_NAME_LENGTH, source, nameResult);
+		return -1;
 	}
-	bufLen = j + 3;  //Allow for 'O' (open), file/command length and channel
 
-	//Receive file name and build open command
-	serCmdIOBuf[0] = 'O';  //Open instruction
-	serCmdIOBuf[1] = bufLen;
-	serCmdIOBuf[2] = IEC::ATN_CODE_OPEN bitand 0xF;  //channel
-	do {
-		noInterrupts();
-		b = m_iec.gijoe_read_byte();
-		interrupts();
-		if (b < 0) {
-			Log("epyxFastloadProgram, file name error");
-			break;
+	//The name comes last character first
+	if (name != NULL)
+		for (byte i = 0; i < nameLen / 2; i++) {
+			byte c = name[i];
+			name[i] = name[nameLen - 1 - i];
+			name[nameLen - 1 - i] = c;
 		}
 
-		serCmdIOBuf[--bufLen] = b;
-	} while (bufLen > 3);  //Preserve first 3 bytes of serCmdIOBuf 
+	return nameLen;
+} // epyxReceiveLoader
+
+
+#ifdef USE_SERIAL
+//Open the program and fastload to C64 with data sent serially from PC
+void Interface::epyxFastloadProgram()
+{
+	uint8_t bufLen, bufEnd, i;
+	int16_t j;
+
+	//The assembler send routine drives the port pins of the board profile, whatever pins the host set
+	if (not m_iec.usesPins(Board::EPYX_ATN_PIN, Board::EPYX_CLOCK_PIN, Board::EPYX_DATA_PIN)) {
+		Log(LOG_EPYX_PINS, LOG_EPYX_SERIAL);
+		return;
+	}
+
+	//Switchover to full epyx fastload via semi-fastload gijoe protocol, receiving the file name into an open command
+	j = epyxReceiveLoader(LOG_EPYX_SERIAL, reinterpret_cast<byte*>(serCmdIOBuf) + 3, MAX_BYTES_PER_REQUEST - 4);  //bufLen is a byte
+	if (j < 0)
+		return;
+	bufLen = j + 3;  //Allow for 'O' (open), file/command length and channel
+	serCmdIOBuf[0] = 'O';  //Open instruction
+	serCmdIOBuf[1] = bufLen;
+	serCmdIOBuf[2] = hostChannel(m_cmd.device, IEC::ATN_CODE_OPEN bitand 0xF);  //channel
 
 	m_iec.setClock(true);
 
 	//Request file open from PC which then returns a buffer load of data
-	Serial.write((const byte*)serCmdIOBuf, serCmdIOBuf[1]);  //send instruction to PC
+	m_blockSeq = 0;
+	m_host.write(serCmdIOBuf, serCmdIOBuf[1]);  //send instruction to PC
+	m_host.flush();
 
 	// Transfer data via full epyx fastload protocol
 	do {
@@ -337,21 +1207,21 @@ void Interface::epyxFastloadProgram()
 			m_iec.setData(true);
 		}
 
-		bytesRead = Serial.readBytes(serCmdIOBuf, 2); // read the ack type usually B/E or X if error
-		bufEnd = serCmdIOBuf[0];
-		bufLen = serCmdIOBuf[1];
-		if (bufEnd == 'X') {  //
+		// read the ack type usually B/E or X if error, and the program data bytes.
+		// A bad framed block is requested again here, before the sector length goes out to the C64
+		if (not readHostBlock(bufEnd, bufLen) or bufEnd == 'X') {
+			setStatus(DOS_FILE_NOT_FOUND);
 			m_iec.sendFNF();  //Error, return file not found on Commodore
-			while (Serial.available())  //Flush out read buffer
-				Serial.read();
+			while (m_host.available())  //Flush out read buffer
+				m_host.read();
 			break;
 		}
-		bytesRead = Serial.readBytes(serCmdIOBuf, bufLen); // read the program data bytes
 
-		//Ask for more bytes from the PC now, then send the current buffer load to the C64
-#if !defined(__AVR_ATmega328P__)  //Not suitable for Arduino uno
-		if (bufEnd != 'b') Serial.write('R');
-#endif
+		//Ask for more bytes from the PC now when the board's transport keeps them, then send the current buffer load to the C64
+		if (Board::PREFETCH and bufEnd != 'b') {
+			m_host.write('R');
+			m_host.flush();
+		}
 		//Send the program data bytes via epyx fastload protocol
 		ATOMIC_BLOCK(ATOMIC_FORCEON) {
 
@@ -360,29 +1230,30 @@ void Interface::epyxFastloadProgram()
 
 			// send number of bytes in sector
 			if (asm_epyxcart_send_byte(bufLen)) {
-				Log("epyxFastloadProgram, length fail");
+				Log(LOG_EPYX_LENGTH_FAIL, LOG_EPYX_SERIAL);
 				break;
 			}
 
 			// send data
 			for (i=0; i<bufLen; i++) {
 				if (asm_epyxcart_send_byte(serCmdIOBuf[i])) {
-					Log("epyxFastloadProgram, send byte fail");
+					Log(LOG_EPYX_SEND_FAIL, LOG_EPYX_SERIAL, i);
 					break;
 				}
 			}
 
 			// check ATN ok
 			if (m_iec.getATN() == false) {
-				Log("epyxFastloadProgram, ATN false");
+				Log(LOG_EPYX_ATN, LOG_EPYX_SERIAL);
 				bufEnd = 'b';
 				break;
 			}
 
 		}
-#if defined(__AVR_ATmega328P__)  //Suitable for Arduino uno
-      	if (bufEnd != 'b') Serial.write('R');
-#endif
+		if (not Board::PREFETCH and bufEnd != 'b') {
+			m_host.write('R');
+			m_host.flush();
+		}
 
 	} while (bufEnd == 'B');
 
@@ -398,62 +1269,18 @@ void Interface::epyxFastloadProgram()
 //Open the ROM program and fastload to C64
 void Interface::epyxFastloadROM()
 {
-	uint8_t b;
-	uint8_t checksum = 0;
-	int16_t bufLen, bufEnd, pos, i, j;
+	int16_t bufLen, bufEnd, pos, i;
 	PGM_P binFile = reinterpret_cast<PGM_P>(gROMFileData);
 
-	//Switchover to full epyx fastload via semi-fastload gijoe protocol
-
-	//Initial handshake
-	noInterrupts();
-	m_iec.setData(true);
-	m_iec.setClock(false);
-
-	while(m_iec.getData() != false)
-	m_iec.setClock(true);
-	interrupts();
-
-	//Receive and checksum stage 2
-	for (j=0; j<256; j++) {
-		noInterrupts();
-		b = m_iec.gijoe_read_byte();
-		interrupts();
-		if (b < 0) {
-			Log("epyxFastloadROM, read checksum error");
-			return;
-		}
-
-		if (j < 237)
-		//Stage 2 has some junk bytes at the end, ignore them
-		checksum ^= b;
+	//The assembler send routine drives the port pins of the board profile, whatever pins the host set
+	if (not m_iec.usesPins(Board::EPYX_ATN_PIN, Board::EPYX_CLOCK_PIN, Board::EPYX_DATA_PIN)) {
+		Log(LOG_EPYX_PINS, LOG_EPYX_ROM);
+		return;
 	}
 
-	//Check for known stage2 loaders
-	if (checksum != 0x91 && checksum != 0x5b) {
-		Log("epyxFastloadROM, checksum total error");
-	}
-
-	//Receive file name length
-	noInterrupts();
-	j = m_iec.gijoe_read_byte();
-	interrupts();
-	if (j < 0) {
-		Log("epyxFastloadROM, file length error");
-	}
-
-	//Read the file name bytes, not needed for this ROM version
-	do {
-		noInterrupts();
-		b = m_iec.gijoe_read_byte();
-		interrupts();
-		if (b < 0) {
-			Log("epyxFastloadROM, file name error");
-			break;
-		}
-
-		j--;
-	} while (j > 0);
+	//Switchover to full epyx fastload via semi-fastload gijoe protocol, the file name is not needed for this ROM version
+	if (epyxReceiveLoader(LOG_EPYX_ROM, NULL, 0) < 0)
+		return;
 
 	m_iec.setClock(false);
 
@@ -469,20 +1296,20 @@ void Interface::epyxFastloadROM()
 
 			// send number of bytes in sector
 			if (asm_epyxcart_send_byte(lowByte(bufLen))) {  //Just the low byte of length is needed (is max 255 $FF)
-				Log("epyxFastloadROM, length fail");
+				Log(LOG_EPYX_LENGTH_FAIL, LOG_EPYX_ROM);
 				break;
 			}
 
 			for (i=0; i<bufLen; i++) {
 				if (asm_epyxcart_send_byte(pgm_read_byte(binFile++))) {
-					Log("epyxFastloadROM, send byte fail");
+					Log(LOG_EPYX_SEND_FAIL, LOG_EPYX_ROM, i);
 					break;
 				}
 			}
 
 			// check ATN ok
 			if (m_iec.getATN() == false) {
-				Log("epyxFastloadROM, ATN false");
+				Log(LOG_EPYX_ATN, LOG_EPYX_ROM);
 				break;
 			}
 
@@ -515,13 +1342,52 @@ void Interface::epyxFastloadROM()
 void Interface::handleATNCmdCodeOpen(IEC::ATNCmd& cmd)
 {
 	uint8_t bufLen = 3;  //Allow for 'O' (open), file/command length and channel
+	byte chan = cmd.code bitand 0xF;
+	byte key = hostChannel(cmd.device, chan);  //Channel with the device number in the upper nibble
+
+	if (cmd.strLen and cmd.str[0] == '#' and chan != CMD_CHANNEL) {  //Direct access buffer, no host involved
+		m_bufferChan = key;
+		m_bufferPos = 0;
+		m_bufferEnd = SECTOR_BYTES - 1;
+		setStatus(DOS_OK);
+		return;
+	}
+
+	if ((m_mode bitand HOST_MODE_CHANNELS) and chan > WRITEPRG_CHANNEL and chan != CMD_CHANNEL) {
+		Channel* ch = findChannel(key);
+		if (ch and cmd.strLen == 0)  //Already open
+			return;
+		if (not ch)
+			ch = findChannel(NO_CHANNEL);
+		if (not ch) {
+			setStatus(DOS_NO_CHANNEL);
+			return;
+		}
+		ch->chan = key;
+		ch->pos = ch->len = 0;
+		ch->lastBlock = false;
+		ch->records = false;
+	}
+
+	while (m_host.available())  //Drop any stale reply to an earlier command
+		m_host.read();
 
 	serCmdIOBuf[0] = 'O';
-	serCmdIOBuf[2] = cmd.code bitand 0xF;  //channel
+	serCmdIOBuf[2] = key;  //channel, device number above 8 in the upper nibble
 	memcpy(&serCmdIOBuf[bufLen], cmd.str, cmd.strLen);
 	bufLen += cmd.strLen;
 	serCmdIOBuf[1] = bufLen;  //file/command length
-	Serial.write((const byte*)serCmdIOBuf, bufLen);  //send instruction to PC
+	m_blockSeq = 0;
+	m_host.write(serCmdIOBuf, bufLen);  //send instruction to PC
+	m_host.flush();
+
+	if (chan == WRITEPRG_CHANNEL and (m_mode bitand HOST_MODE_FRAMED))
+		m_saveChan = key;
+
+	//Loads and listings are answered straight away, the reply is captured while the Commodore gets round to TALK
+	m_openPending = chan != CMD_CHANNEL and chan != WRITEPRG_CHANNEL
+		and not ((m_mode bitand HOST_MODE_CHANNELS) and chan > WRITEPRG_CHANNEL);
+	m_earlyRead = false;
 
 } // handleATNCmdCodeOpen
 
@@ -530,48 +1396,247 @@ void Interface::handleATNCmdCodeOpen(IEC::ATNCmd& cmd)
 void Interface::handleATNCmdCodeDataTalk(byte chan)
 {
 
-	while (!Serial.available());  // Wait for a response from the PC
-	char r = Serial.peek();  // Peek at response (this leaves the byte in the serial buffer)
+	while (!m_host.available());  // Wait for a response from the PC
+	char r = m_host.peek();  // Peek at response (this leaves the byte in the serial buffer)
 	switch(r) {
 	case 'B': case 'b':
+		setStatus(DOS_OK);
 		sendFile();  //Load program on Commodore
 		break;
 
 	case 'L': case 'l':
+		setStatus(DOS_OK);
 		sendListing();  //Directory listing on Commodore
 		break;
 
 	default:
+		setStatus(DOS_FILE_NOT_FOUND);
 		m_iec.sendFNF();  //Error, return file not found on Commodore
 	}
 
-	while (Serial.available())  //Flush out read buffer
-		Serial.read();
+	while (m_host.available())  //Flush out read buffer
+		m_host.read();
 
 } // handleATNCmdCodeDataTalk
 
 
+// Talk the command channel to the Commodore. Data owed by the host for a forwarded command (e.g. M-R) is relayed,
+// otherwise the DOS status is served from the local status buffer without a host round-trip.
+void Interface::handleATNCmdCodeStatusTalk()
+{
+	if(m_hostReplyPending) {
+		m_hostReplyPending = false;
+
+		unsigned long start = millis();
+		while(not m_host.available() and millis() - start < HOST_REPLY_WAIT_MSECS);
+
+		char r = m_host.available() ? m_host.peek() : 0;
+		if(r == 'B' or r == 'b') {
+			setStatus(DOS_OK);
+			sendFile();
+			return;
+		}
+		if(r == 'X')
+			setStatus(DOS_FILE_NOT_FOUND);
+
+		while (m_host.available())  //Flush out read buffer
+			m_host.read();
+	}
+
+	sendStatus();
+
+} // handleATNCmdCodeStatusTalk
+
+
+// Command channel command: common commands are executed locally, C128 burst loads and known fastloaders are started
+// natively.
+// Anything else goes to the host. It owes a reply on the next status read only for an M-R it can answer (the drive
+// number, or RAM with its drive emulation) and for S:, everything else is served from the status buffer.
+void Interface::handleATNCmdCodeCommand()
+{
+	if(handleLocalCommand(m_cmd) or handleBurstCommand(m_cmd) or handleRecordCommand(m_cmd) or handleBlockCommand(m_cmd)
+		or handleDriveCode(m_cmd))
+		return;
+
+	const byte *str = m_cmd.str;
+	if(m_cmd.strLen >= 5 and str[0] == 'M' and str[1] == '-' and str[2] == 'R') {
+		word addr = word(str[4], str[3]);
+		m_hostReplyPending = ((m_mode bitand HOST_MODE_DRIVE_CODE) and addr < DRIVE_RAM_SIZE)
+			or ((addr == 0xE5C4 or addr == 0xE5C6) and m_cmd.strLen >= 6 and str[5] == 4);
+	}
+	else
+		m_hostReplyPending = m_cmd.strLen >= 2 and str[0] == 'S' and str[1] == ':';
+	handleATNCmdCodeOpen(m_cmd);
+
+} // handleATNCmdCodeCommand
+
+
 // Listen for commands / data from the Commodore
 void Interface::handleATNCmdCodeDataListen()
 {
-	while (!Serial.available());  // Wait for a response from the PC
-	char r = Serial.read();  // Read response (this removes the byte in the serial buffer)
+	while (!m_host.available());  // Wait for a response from the PC
+	char r = m_host.read();  // Read response (this removes the byte in the serial buffer)
 	if (r == 'W') {
 		saveFile();
 	}
 	else {
+		byte code = DOS_FILE_NOT_FOUND;
+		if (r == 'X')  // the save is refused, e.g. 63 FILE EXISTS
+			m_host.readBytes(&code, 1);
+		setStatus(code);
 		m_iec.sendFNF();
 	}
 
-	while (Serial.available())  //Flush out read buffer
-		Serial.read();
+	while (m_host.available())  //Flush out read buffer
+		m_host.read();
 
 } // handleATNCmdCodeDataListen
 
 
-void Interface::handleATNCmdClose()
+// Channel slot open on chan, or a free slot for NO_CHANNEL. None when the arena had no room for the buffers.
+Interface::Channel* Interface::findChannel(byte chan)
+{
+	if (not m_channelBytes)
+		return NULL;
+	for (byte i = 0; i < CHANNEL_SLOTS; i++)
+		if (m_channels[i].chan == chan)
+			return &m_channels[i];
+	return NULL;
+} // findChannel
+
+
+// Ask the host for the next part of a channel's file with 'G' channel maxLen. The host answers with a 'B' block, or
+// 'b' for the end of the file, of up to maxLen bytes, or 'X' when the file cannot be read. On a relative file 'b' is
+// the end of the record, and the next 'G' goes on with the record after it.
+bool Interface::fillChannel(Channel& ch)
+{
+	m_host.write('G');
+	m_host.write(ch.chan);
+	m_host.write(m_channelBytes);
+	m_host.flush();
+
+	return readChannel(ch);
+} // fillChannel
+
+
+// The host's answer to 'G' or 'P' into the channel's buffer. An 'X' leaves its code as the status.
+bool Interface::readChannel(Channel& ch)
+{
+	uint8_t type = 0, len;
+
+	m_blockSeq = 0;
+	if (not readHostFrame(type, len, ch.buf, 0) or (type != 'B' and type != 'b')) {
+		setStatus((type == 'X' and len) ? len : DOS_FILE_NOT_FOUND);
+		while (m_host.available())  //Flush out read buffer
+			m_host.read();
+		return false;
+	}
+
+	ch.pos = 0;
+	ch.len = len;
+	ch.lastBlock = type == 'b';
+	return true;
+} // readChannel
+
+
+// Talk a data channel from its read-ahead buffer, refilled from the host as it runs empty. The last byte of the file
+// goes with EOI. Bytes the Commodore did not take before ending the TALK, e.g. after a single GET#, stay buffered for
+// the next one.
+void Interface::sendChannel(Channel& ch)
+{
+	bool ok = true, last = false;
+
+	do {
+		if (ch.pos == ch.len and ((ch.lastBlock and not ch.records) or not fillChannel(ch) or ch.len == 0)) {
+			if (ch.lastBlock)
+				setStatus(DOS_OK);  //otherwise the failed fill left its status
+			m_iec.sendFNF();  //Nothing more to read
+			return;
+		}
+
+		last = ch.lastBlock and ch.pos == ch.len - 1;
+		noInterrupts();
+		ok = last ? m_iec.sendEOI(ch.buf[ch.pos]) : m_iec.send(ch.buf[ch.pos]);
+		interrupts();
+		if (ok)
+			ch.pos++;
+	} while (ok and not last);
+
+	setStatus(DOS_OK);
+
+} // sendChannel
+
+
+// Talk the direct access buffer from the buffer pointer on, the last byte with EOI. A byte is only used up once the
+// Commodore has taken it, so a read cut short by ATN picks up where it stopped.
+void Interface::sendBuffer()
+{
+	bool ok = true;
+
+	while (ok and m_bufferPos < m_bufferEnd) {
+		noInterrupts();
+		ok = m_iec.send(sectorBuf[m_bufferPos]);
+		interrupts();
+		if (ok)
+			m_bufferPos++;
+	}
+
+	if (ok) {
+		noInterrupts();
+		m_iec.sendEOI(sectorBuf[m_bufferEnd]);
+		interrupts();
+	}
+
+} // sendBuffer
+
+
+// Listen for PRINT# data into the direct access buffer at the buffer pointer.
+void Interface::receiveBuffer()
 {
+	boolean done = false;
+
+	do {
+		noInterrupts();
+		byte data = m_iec.receive();
+		interrupts();
+		done = (m_iec.state() bitand IEC::eoiFlag) or (m_iec.state() bitand IEC::errorFlag);
+		if (not (m_iec.state() bitand IEC::errorFlag))
+			sectorBuf[m_bufferPos++] = data;
+	} while (not done);
 
-	Serial.write('C');  //Tell PC to close the file,  no response expected
+} // receiveBuffer
+
+
+void Interface::handleATNCmdClose(byte chan)
+{
+	Channel* ch = (chan bitand 0x0F) != CMD_CHANNEL ? findChannel(chan) : NULL;  //device 23's is NO_CHANNEL
+
+	if (ch)
+		ch->chan = NO_CHANNEL;
+
+	// A framed host answers the close of a save once the file is on disk, 'A' or 'X' and a DOS status code for the
+	// status read. Without channels every close goes to the open file, the save's is the next one.
+	bool save = m_saveChan != NO_CHANNEL and (chan == m_saveChan or not (m_mode bitand HOST_MODE_CHANNELS));
+	if (save) {
+		m_saveChan = NO_CHANNEL;
+		while (m_host.available())  //Drop any stale reply to an earlier command
+			m_host.read();
+	}
+
+	m_host.write('C');  //Tell PC to close the file
+	if (m_mode bitand HOST_MODE_CHANNELS)
+		m_host.write(chan);
+	m_host.flush();
+
+	if (save) {
+		char r = 0;
+		byte code = DOS_DRIVE_NOT_READY;
+		m_host.readBytes(&r, 1);
+		if (r == 'A')
+			code = DOS_OK;
+		else if (r == 'X')
+			m_host.readBytes(&code, 1);
+		setStatus(code);
+	}
 
 } // handleATNCmdClose
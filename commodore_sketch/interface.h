@@ -5,40 +5,145 @@
 //#define CONSOLE_DEBUG
 
 #include "iec_driver.h"
+#include "host_link.h"
 #include "cbmdefines.h"
 
 // The base pointer of basic.
 #define C64_BASIC_START 0x0801
 
+// Data channels (2-14) that can be open at once, sized to the board's RAM. Their read-ahead buffers share the arena
+// left after the host look-ahead (memory.h), up to a block each.
+#define CHANNEL_SLOTS Board::CHANNEL_SLOTS
+#define CHANNEL_BUFFER_MAX_BYTES 254
+
 class Interface
 {
 public:
-	Interface(IEC& iec);
+	Interface(IEC& iec, HostLink& host);
 	virtual ~Interface() {}
 
 	// The handler returns the current IEC state, see the iec_driver.hpp for possible states.
 	byte handler(void);
 
+	// Host handshake mode flags, see CBM::HostModes.
+	void setMode(byte mode);
+
+	// Takes the channel read-ahead buffers from the arena, after HostLink::begin().
+	void begin();
+
+	// Bytes of read-ahead each data channel has, 0 when the arena had no room for them.
+	byte channelBufferSize() const { return m_channelBytes; }
+
 private:
 	void saveFile();
 	void sendFile();
 	void sendListing();
 	bool removeFilePrefix(void);
+	bool readHostBlock(uint8_t& bufEnd, uint8_t& bufLen);
+	bool readHostFrame(uint8_t& type, uint8_t& arg, byte* data, word dataLen);
+	bool writeHostBlock(uint8_t bufLen);
+	bool readHostSector(byte track, byte sector);
+	bool writeHostSector(byte track, byte sector);
 	void sendLine(byte len, char* text, word &basicPtr);
+	void setStatus(byte code, byte track = 0, byte sector = 0);
+	void sendStatus();
+	bool handleLocalCommand(IEC::ATNCmd &cmd);
+	bool handleBlockCommand(IEC::ATNCmd &cmd);
+	bool handleBurstCommand(IEC::ATNCmd &cmd);
+	bool handleRecordCommand(IEC::ATNCmd &cmd);
+	void burstLoad(const byte* name, byte nameLen);
+	bool handleDriveCode(IEC::ATNCmd &cmd);
+	void replayDriveTrace();
+	bool waitDriveLine(byte line, bool pulled);
 
 	// handler helpers
 	void handleATNCmdCodeOpen(IEC::ATNCmd &cmd);
 	void handleATNCmdCodeDataTalk(byte chan);
+	void handleATNCmdCodeStatusTalk();
+	void handleATNCmdCodeCommand();
 	void handleATNCmdCodeDataListen();
-	void handleATNCmdClose();
+	void handleATNCmdClose(byte chan);
+	void captureHostReply();
+	void reportRam();
+	byte sniff();
+	void sendSniff(byte flags, byte data, unsigned long time);
+	void sendBuffer();
+	void receiveBuffer();
 	void epyxFastloadProgram();
 	void epyxFastloadROM();
+	int16_t epyxReceiveLoader(byte source, byte* name, byte maxLen);
+
+	// An open data channel. The host streams the file into buf on request, TALKs are served from it.
+	typedef struct _tagCHANNEL {
+		byte chan;  // secondary address with the device in the upper nibble, NO_CHANNEL when the slot is free
+		byte pos;   // next byte to talk
+		byte len;   // bytes in buf
+		bool lastBlock;  // buf holds the end of the file, or of the record
+		bool records;    // a relative file positioned with P, the host goes on with the next record after one ends
+		byte* buf;       // m_channelBytes from the arena
+	} Channel;
+
+	Channel* findChannel(byte chan);
+	bool fillChannel(Channel& ch);
+	bool readChannel(Channel& ch);
+	void sendChannel(Channel& ch);
+
+	// Known fastloaders, recognised by the M-E start address and the CRC-16 and length of the drive code uploaded
+	// with M-W before it. An uploadLen of zero matches on the M-E address alone.
+	typedef void (Interface::*FastloadHandler)();
+	typedef struct _tagFASTLOADER {
+		word execAddr;
+		word uploadCrc;
+		word uploadLen;
+		FastloadHandler handler;
+	} Fastloader;
+	static const Fastloader s_fastloaders[];
 
 	// our iec low level driver:
 	IEC& m_iec;
 
+	// transport to the media host:
+	HostLink& m_host;
+
 	// atn command buffer struct
-	IEC::ATNCmd& m_cmd;
+	IEC::ATNCmd m_cmd;
+
+	// open data channels when the host streams per channel (HOST_MODE_CHANNELS), and the size of their buffers
+	Channel m_channels[CHANNEL_SLOTS];
+	byte m_channelBytes;
+
+	// handshake mode flags and the sequence number of the next framed block
+	byte m_mode;
+	byte m_blockSeq;
+
+	// DOS status for the command channel, and whether the host owes a reply to a forwarded command
+	byte m_statusCode;
+	byte m_statusTrack;
+	byte m_statusSector;
+	bool m_hostReplyPending;
+
+	// the host answers the last 'O' with a block, and 'R' for the second block already went out
+	bool m_openPending;
+	bool m_earlyRead;
+
+	// channel a save was opened on (with the device as in 'O' frames), its close is answered by the host when framed
+	byte m_saveChan;
+
+	// channel the direct access buffer is open on ("#", with the device as in 'O' frames), the B-P position and the last byte a TALK sends
+	byte m_bufferChan;
+	byte m_bufferPos;
+	byte m_bufferEnd;
+
+	// running CRC-16 and length of the drive code uploaded with M-W since the last M-E
+	word m_uploadCrc;
+	word m_uploadLen;
+
+	// stack bytes never used as last reported in a LOG_RAM event, and when that was
+	word m_stackUnused;
+	unsigned long m_ramCheckMillis;
+
+	// sniffer mode has started its timer
+	bool m_sniffing;
 
 };
 
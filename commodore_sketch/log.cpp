@@ -0,0 +1,88 @@
+#include "log.h"
+#include "host_link.h"
+
+#ifdef LOG_ENABLED
+
+// Most events per 'V' frame, fewer when the transmit buffer has less room
+#define LOG_FLUSH_EVENTS 4
+
+// 'V' and the count ahead of the records
+#define LOG_FRAME_HEADER_BYTES 2
+
+namespace {
+
+struct LogRecord {
+	byte id;
+	word a;
+	word b;
+	word time;
+};
+
+LogRecord logRing[LOG_RING_EVENTS];
+byte logHead;  // next record to send
+byte logTail;  // next record to write
+word logLost;
+
+void putWord(HostLink& host, word value)
+{
+	host.write(lowByte(value));
+	host.write(highByte(value));
+} // putWord
+
+} // unnamed namespace
+
+
+void Log(byte id, word a, word b)
+{
+	if(byte(logTail - logHead) == LOG_RING_EVENTS) {
+		logLost++;
+		return;
+	}
+
+	LogRecord& rec = logRing[logTail % LOG_RING_EVENTS];
+	rec.id = id;
+	rec.a = a;
+	rec.b = b;
+	rec.time = word(millis());
+	logTail++;
+} // Log
+
+
+void flushLog(HostLink& host)
+{
+	byte count = byte(logTail - logHead);
+
+	if(count == 0 and logLost == 0)
+		return;
+	if(count > LOG_FLUSH_EVENTS)
+		count = LOG_FLUSH_EVENTS;
+
+	// Only a whole frame goes out, a record for the lost events included
+	int room = (host.availableForWrite() - LOG_FRAME_HEADER_BYTES) / LOG_RECORD_BYTES - (logLost ? 1 : 0);
+	if(room < 0)
+		return;
+	if(count > room)
+		count = room;
+	if(count == 0 and logLost == 0)
+		return;
+
+	host.write(LOG_FRAME);
+	host.write(count + (logLost ? 1 : 0));
+	for(byte i = 0; i < count; i++, logHead++) {
+		const LogRecord& rec = logRing[logHead % LOG_RING_EVENTS];
+		host.write(rec.id);
+		putWord(host, rec.a);
+		putWord(host, rec.b);
+		putWord(host, rec.time);
+	}
+	if(logLost) {  // room was made above, report the gap after the events before it
+		host.write(LOG_DROPPED);
+		putWord(host, logLost);
+		putWord(host, 0);
+		putWord(host, word(millis()));
+		logLost = 0;
+	}
+	host.push();
+} // flushLog
+
+#endif // LOG_ENABLED
@@ -1,19 +1,33 @@
 #ifndef LOG_H
 #define LOG_H
 
-// Comment out for no logging to host
-//#define LOG_ENABLED
+#include <Arduino.h>
+#include "board.h"
+#include "log_events.h"
+
+class HostLink;
+
+// Comment out to leave the event log out altogether
+#define LOG_ENABLED
+
+// Events held until the next idle point, a power of two. Each takes LOG_RECORD_BYTES of RAM.
+#define LOG_RING_EVENTS Board::LOG_RING_EVENTS
+
 #ifdef LOG_ENABLED
 
-inline void Log(char* msg)
-{
-    Serial.print("D:");  //D for debug
-    Serial.println(msg);
-}
+// Record an event. Only a few RAM writes, no formatting and no serial traffic, so it can stay on in the middle of a
+// transfer. When the ring is full the event is counted as lost.
+void Log(byte id, word a = 0, word b = 0);
+
+// Send recorded events to the host in a 'V' frame, only as many as the transmit buffer has room for, so it never
+// waits. The rest stay in the ring for a later call. Called when the bus is idle and the host has asked for events
+// (HOST_MODE_EVENTS).
+void flushLog(HostLink& host);
 
 #else
 
-#define Log(msg)
+#define Log(...)
+inline void flushLog(HostLink&) {}
 
 #endif // LOG_ENABLED
 
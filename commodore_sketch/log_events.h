@@ -0,0 +1,54 @@
+#ifndef LOG_EVENTS_H
+#define LOG_EVENTS_H
+
+// Events the sketch logs with Log(id, a, b). Shared with the host, which keeps the format strings: the sketch only
+// sends the event number and the two arguments. Add new events at the end so older hosts keep decoding the rest.
+//
+// LOG_EVENT(name, format)
+#define LOG_EVENTS(LOG_EVENT) \
+	LOG_EVENT(DROPPED, "%u events lost, the log was full") \
+	LOG_EVENT(IEC_ERROR, "ATN command error, state %02x") \
+	LOG_EVENT(ATN_COMMAND, "ATN code %02x, result %u") \
+	LOG_EVENT(SEND_FILE_HOST_ERROR, "sendFile host block error") \
+	LOG_EVENT(SEND_FILE_BYTES, "sendFile send bytes problem: %u") \
+	LOG_EVENT(SEND_FILE_DONE, "sendFile completed") \
+	LOG_EVENT(SAVE_FILE_HOST_ERROR, "saveFile host block error") \
+	LOG_EVENT(DRIVE_CODE, "M-E %04x, upload crc %04x") \
+	LOG_EVENT(DRIVE_CODE_UPLOAD, "M-E upload len %u") \
+	LOG_EVENT(TRACE_HOST_ERROR, "replayDriveTrace host block error") \
+	LOG_EVENT(TRACE_DONE, "replayDriveTrace completed") \
+	LOG_EVENT(TRACE_STOPPED, "replayDriveTrace stopped at %u") \
+	LOG_EVENT(EPYX_CHECKSUM, "epyx fastload %u, stage 2 receive error %u (1 timeout, 2 ATN)") \
+	LOG_EVENT(EPYX_CHECKSUM_TOTAL, "epyx fastload %u, checksum total error") \
+	LOG_EVENT(EPYX_NAME_LENGTH, "epyx fastload %u, file length error %u (1 timeout, 2 ATN, 3 too long)") \
+	LOG_EVENT(EPYX_NAME, "epyx fastload %u, file name error %u (1 timeout, 2 ATN)") \
+	LOG_EVENT(EPYX_LENGTH_FAIL, "epyx fastload %u, length fail") \
+	LOG_EVENT(EPYX_SEND_FAIL, "epyx fastload %u, send byte fail at %u") \
+	LOG_EVENT(EPYX_ATN, "epyx fastload %u, ATN false") \
+	LOG_EVENT(RAM, "stack %u bytes never used, arena %u bytes free") \
+	LOG_EVENT(AHEAD_BUFFER, "host look-ahead buffer %u bytes") \
+	LOG_EVENT(EPYX_PINS, "epyx fastload %u, bus not on the board profile's epyx pins") \
+	LOG_EVENT(EPYX_TIMING, "epyx fastload timing %u (0 generic, 1 PAL, 2 NTSC), gijoe byte %u AVR cycles") \
+	LOG_EVENT(BURST_COMMAND, "burst command %u, %u name bytes") \
+	LOG_EVENT(BURST_FAIL, "burst load stopped after %u of %u block bytes") \
+	LOG_EVENT(CHANNEL_BUFFERS, "%u data channels, %u bytes of read-ahead each")
+
+#define LOG_EVENT_ID(name, format) LOG_##name,
+enum LogEventId {
+	LOG_EVENTS(LOG_EVENT_ID)
+	LOG_EVENT_COUNT
+};
+#undef LOG_EVENT_ID
+
+// 'V' count, then count records of LOG_RECORD_BYTES: the event, its two arguments and the time in milliseconds
+// (low 16 bits), all little endian.
+#define LOG_FRAME 'V'
+#define LOG_RECORD_BYTES 7
+
+// First argument of the EPYX_ events
+enum LogEpyxSource {
+	LOG_EPYX_SERIAL = 0,
+	LOG_EPYX_ROM = 1
+};
+
+#endif
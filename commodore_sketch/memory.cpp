@@ -0,0 +1,76 @@
+#include "memory.h"
+
+// Pattern the free RAM is filled with at reset
+#define STACK_PAINT 0xC5
+
+// Painted bytes stackUnused() looks at per call, few enough to leave ATN answered in time
+#define STACK_SCAN_BYTES 32
+
+extern uint8_t _end;     // end of .bss, the start of free RAM
+extern uint8_t __stack;  // top of RAM
+extern char* __malloc_heap_start;
+
+namespace {
+
+uint8_t* arenaNext = &_end;
+const uint8_t* stackLow = &__stack + 1;  // lowest byte the stack is known to have used
+const uint8_t* stackScan = &_end;        // where stackUnused() goes on looking
+
+} // unnamed namespace
+
+
+// Runs from .init3, after the zero register and stack pointer are set up but before .data and .bss are initialised,
+// so it must not use either. Naked: it has no return and falls through into .init4.
+void paintStack() __attribute__((naked, used, section(".init3")));
+void paintStack()
+{
+	uint8_t* p = &_end;
+	while(p <= &__stack)
+		*p++ = STACK_PAINT;
+} // paintStack
+
+
+namespace Memory {
+
+word arenaFree()
+{
+	uint8_t* top = reinterpret_cast<uint8_t*>(SP) - STACK_RESERVE_BYTES;
+	return top > arenaNext ? top - arenaNext : 0;
+} // arenaFree
+
+
+void* arenaAlloc(word bytes)
+{
+	if(bytes > arenaFree())
+		return NULL;
+
+	void* block = arenaNext;
+	arenaNext += bytes;
+	__malloc_heap_start = reinterpret_cast<char*>(arenaNext);  // keep malloc, should anything use it, off the arena
+	return block;
+} // arenaAlloc
+
+
+// The paint is scanned up from the arena a few bytes per call, starting over once the scan reaches the lowest used
+// byte found so far, so a deeper stack shows up within a pass over the painted RAM.
+word stackUnused()
+{
+	const uint8_t* sp = reinterpret_cast<const uint8_t*>(SP) + 1;
+	if(sp < stackLow)
+		stackLow = sp;
+	if(stackScan < arenaNext)
+		stackScan = arenaNext;
+
+	for(byte n = STACK_SCAN_BYTES; n and stackScan < stackLow; n--, stackScan++) {
+		if(*stackScan != STACK_PAINT) {
+			stackLow = stackScan;
+			break;
+		}
+	}
+	if(stackScan >= stackLow)
+		stackScan = arenaNext;
+
+	return stackLow > arenaNext ? stackLow - arenaNext : 0;
+} // stackUnused
+
+} // namespace Memory
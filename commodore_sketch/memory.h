@@ -0,0 +1,28 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <Arduino.h>
+#include "board.h"
+
+// Stack kept clear below the arena, the deepest call chain seen in the stack high-water mark plus a margin. Check
+// LOG_RAM events after changes that add locals or call depth.
+#define STACK_RESERVE_BYTES Board::STACK_RESERVE_BYTES
+
+// RAM left over after the static data. Buffers that can use more RAM than the smallest board has, the host link
+// look-ahead and the data channel read-ahead, are carved from it at start-up, so each board gets the largest ones it can hold. Nothing is freed.
+// The free RAM is painted before main() so the stack's high-water mark can be found while running.
+namespace Memory {
+
+// Bytes between the arena and the stack reserve, not yet handed out.
+word arenaFree();
+
+// Hands out bytes of arena, NULL when there is not enough.
+void* arenaAlloc(word bytes);
+
+// Bytes between the arena and the lowest the stack has been seen to reach since reset. Each call looks at only a few
+// more bytes of the painted RAM, so it is cheap enough for every idle pass but takes many calls to see a new low.
+word stackUnused();
+
+} // namespace Memory
+
+#endif
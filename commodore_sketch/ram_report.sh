@@ -0,0 +1,45 @@
+#!/bin/sh
+# RAM budget of the sketch for each supported board: static data, the largest .data/.bss symbols and what is left
+# for the stack and the memory arena (memory.h). Needs arduino-cli with the arduino:avr core installed.
+#
+#   ./ram_report.sh [fqbn...]
+
+cd "$(dirname "$0")" || exit 1
+BOARDS=${*:-"arduino:avr:uno arduino:avr:leonardo arduino:avr:mega"}
+TOP=12
+
+for fqbn in $BOARDS; do
+	out=$(mktemp -d)
+	if ! arduino-cli compile --fqbn "$fqbn" --output-dir "$out" . >/dev/null; then
+		echo "$fqbn: build failed"
+		rm -rf "$out"
+		continue
+	fi
+	elf=$(ls "$out"/*.elf)
+	case $fqbn in
+		*:uno|*:nano) mcu=atmega328p; ram=2048 ;;
+		*:leonardo|*:micro) mcu=atmega32u4; ram=2560 ;;
+		*:mega) mcu=atmega2560; ram=8192 ;;
+		*) mcu=; ram= ;;
+	esac
+
+	echo "== $fqbn"
+	if [ -n "$mcu" ]; then
+		avr-size -C --mcu=$mcu "$elf"
+	else
+		avr-size "$elf"
+	fi
+
+	static=$(avr-size -A "$elf" | awk '$1 == ".data" || $1 == ".bss" { n += $2 } END { print n }')
+	if [ -n "$ram" ]; then
+		echo "Static data $static bytes, $((ram - static)) bytes left for the stack and the arena"
+	fi
+
+	echo "Largest RAM symbols:"
+	avr-nm -S --size-sort -C "$elf" | awk '$3 ~ /^[bBdD]$/' | tail -n $TOP | \
+		while read -r addr size type name; do
+			printf "%6d  %s\n" "0x$size" "$name"
+		done
+	echo
+	rm -rf "$out"
+done